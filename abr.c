@@ -0,0 +1,140 @@
+#include <string.h>
+
+#include "abr.h"
+#include "rtp264.h"
+
+/* receiver ---------------------------------------------------------------*/
+
+void abr_rx_init(AbrRx *ar)
+{
+	memset(ar, 0, sizeof(*ar));
+}
+
+void abr_rx_packet(AbrRx *ar, const unsigned char *pkt, int len, long long now)
+{
+	uint16_t seq;
+	uint32_t ts;
+	double x, y;
+
+	if(len < RTP_HDR_SIZE || (pkt[0] >> 6) != 2)
+		return;
+	if(ar->t_report == 0)
+		ar->t_report = now;
+	ar->bytes += len;
+	if((pkt[1] & 0x7F) != RTP_PT_H264)
+		return;                              // repairs: rate only
+
+	/* 1. sequence numbers (RFC 3550, A.1, without the probation) */
+	seq = rtp_seq(pkt);
+	if(!ar->started){
+		ar->started  = 1;
+		ar->base_seq = seq;
+		ar->max_seq  = seq - 1;
+		ar->last_ts  = rtp_ts(pkt) - 1;
+	}
+	ar->received++;
+	if((uint16_t)(seq - ar->max_seq) < 0x8000){
+		if(seq < ar->max_seq)
+			ar->cycles += 1 << 16;
+		ar->max_seq = seq;
+	}else
+		return;                              // reordered or resent
+
+	/* 2. first packet of a frame: a delay sample */
+	ts = rtp_ts(pkt);
+	if(ts == ar->last_ts)
+		return;
+	ar->last_ts = ts;
+	if(ar->ns == 0)
+		ar->ts_ref = ts;
+	x = (now - ar->t_report) / 1e9;
+	y = (now - ar->t_report) / 1e6 - (int32_t)(ts - ar->ts_ref) / (RTP_CLOCK / 1000.0);
+	ar->sx  += x;
+	ar->sy  += y;
+	ar->sxx += x * x;
+	ar->sxy += x * y;
+	ar->ns++;
+}
+
+int abr_rx_report(AbrRx *ar, long long now, uint32_t jitter, RtcpReport *r)
+{
+	unsigned long expected, exp_int, rec_int;
+	double dt = (now - ar->t_report) / 1e9, d;
+
+	if(!ar->started || dt * 1000 < ABR_REPORT_MS)
+		return 0;
+
+	/* 1. loss since the last report, resent packets may make it negative */
+	expected = ar->cycles + ar->max_seq - ar->base_seq + 1;
+	exp_int  = expected - ar->expected_prior;
+	rec_int  = ar->received - ar->received_prior;
+	ar->expected_prior = expected;
+	ar->received_prior = ar->received;
+	r->fraction_lost = exp_int > rec_int ? ((exp_int - rec_int) << 8) / exp_int : 0;
+	r->cum_lost      = expected > ar->received ? (expected - ar->received) & 0xFFFFFF : 0;
+	r->ext_seq       = ar->cycles + ar->max_seq;
+	r->jitter        = jitter;
+
+	/* 2. receive rate, delay trend */
+	r->recv_kbps = ar->bytes * 8 / dt / 1000;
+	d = ar->ns * ar->sxx - ar->sx * ar->sx;
+	r->trend_us  = ar->ns >= 3 && d > 0 ? (ar->ns * ar->sxy - ar->sx * ar->sy) / d * 1000 : 0;
+
+	ar->bytes = 0;
+	ar->sx = ar->sy = ar->sxx = ar->sxy = 0;
+	ar->ns = 0;
+	ar->t_report = now;
+	return 1;
+}
+
+/* sender -----------------------------------------------------------------*/
+
+void abr_init(AbrCtl *ac, double min_bps, double max_bps, double start_bps)
+{
+	memset(ac, 0, sizeof(*ac));
+	ac->min_bps = min_bps;
+	ac->max_bps = max_bps;
+	ac->target  = start_bps;
+}
+
+double abr_update(AbrCtl *ac, const RtcpReport *r, long long now)
+{
+	double dt = ac->t_last ? (now - ac->t_last) / 1e9 : ABR_REPORT_MS / 1000.0;
+	double loss = r->fraction_lost / 256.0, recv = r->recv_kbps * 1000.0, t;
+
+	if(dt > 2.0)
+		dt = 2.0;
+	ac->t_last = now;
+	ac->reports++;
+	ac->trend = (ac->trend + r->trend_us / 1000.0) / 2;
+
+	if(loss > ABR_LOSS_HIGH){
+		ac->target *= 1 - loss / 2;
+		ac->state = ABR_DECREASE;
+	}else if(ac->trend > ABR_OVERUSE_MS){
+		t = ABR_BACKOFF * recv;
+		if(t < ac->target)
+			ac->target = t;
+		ac->state = ABR_DECREASE;
+	}else if(ac->trend < -ABR_OVERUSE_MS / 2){
+		ac->state = ABR_HOLD;                 // the queue drains, let it
+	}else if(loss < ABR_LOSS_LOW){
+		/* not beyond what the link has shown it carries: a still scene
+		   sends less than the target and proves nothing */
+		t = ac->target * (1 + ABR_GROWTH * dt);
+		if(t > 1.5 * recv)
+			t = 1.5 * recv;
+		if(t > ac->target)
+			ac->target = t;
+		ac->state = ABR_INCREASE;
+	}else
+		ac->state = ABR_HOLD;
+
+	if(ac->state == ABR_DECREASE)
+		ac->decreases++;
+	if(ac->target < ac->min_bps)
+		ac->target = ac->min_bps;
+	if(ac->target > ac->max_bps)
+		ac->target = ac->max_bps;
+	return ac->target;
+}
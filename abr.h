@@ -0,0 +1,86 @@
+#ifndef ABR_H
+#define ABR_H
+
+#include <stdint.h>
+#include "rtcp.h"
+
+/*--------------------------------------------------------------------------
+   adaptive bitrate
+
+   receiver (AbrRx): counts the media packets and bytes it gets and each
+   ABR_REPORT_MS sends a receiver report (rtcp.h): loss since the last
+   report, receive rate, and the delay trend, the slope (least squares)
+   of the one-way delay of the first packet of each frame over the
+   report interval. a growing delay means a queue is filling up on the
+   way, before it overflows and packets are lost.
+
+   sender (AbrCtl): one controller per receiver, reports in, target
+   bitrate out (the encoder's, for all receivers the lowest one)
+
+     loss > ABR_LOSS_HIGH              decrease: target * (1 - loss/2)
+     delay grows > ABR_OVERUSE_MS/s    decrease: ABR_BACKOFF * receive rate
+     delay falls (queue drains)        hold
+     loss < ABR_LOSS_LOW               increase: ABR_GROWTH per second,
+                                       at most 1.5 * receive rate
+     else                              hold
+
+   so a link getting worse costs picture quality, not stalls; the target
+   stays within min..max. rpi-abr-sim runs the same code against a
+   simulated link.
+---------------------------------------------------------------------------*/
+
+#define ABR_REPORT_MS    500       // receiver report interval
+#define ABR_LOSS_HIGH    0.10
+#define ABR_LOSS_LOW     0.02
+#define ABR_OVERUSE_MS   10.0      // delay growth (ms per second) of a filling queue
+#define ABR_BACKOFF      0.85
+#define ABR_GROWTH       0.10      // increase per second
+
+/* receiver --------------------------------------------------------------*/
+
+typedef struct {
+	int      started;
+	uint16_t max_seq;
+	uint32_t cycles;             // sequence number wraps, << 16
+	uint32_t base_seq;
+	unsigned long received;      // media packets
+	unsigned long expected_prior, received_prior;
+	unsigned long bytes;         // all packets, this interval
+	long long t_report;          // interval started
+
+	/* delay samples of this interval: x arrival (s), y delay (ms) */
+	uint32_t last_ts, ts_ref;
+	double   sx, sy, sxx, sxy;
+	int      ns;
+} AbrRx;
+
+void abr_rx_init(AbrRx *ar);
+
+/* every packet received (media, repair, retransmission) */
+void abr_rx_packet(AbrRx *ar, const unsigned char *pkt, int len, long long now);
+
+/*
+ * the report of the interval when ABR_REPORT_MS are over: returns 1 and
+ * *r (jitter in RTP timestamp units from the caller), else 0
+ */
+int  abr_rx_report(AbrRx *ar, long long now, uint32_t jitter, RtcpReport *r);
+
+/* sender ----------------------------------------------------------------*/
+
+enum { ABR_HOLD, ABR_INCREASE, ABR_DECREASE };
+
+typedef struct {
+	double min_bps, max_bps;
+	double target;               // bit/s
+	double trend;                // delay trend (ms per s), smoothed
+	long long t_last;            // last report
+	int state;                   // ABR_HOLD ..
+	unsigned long reports, decreases;
+} AbrCtl;
+
+void   abr_init(AbrCtl *ac, double min_bps, double max_bps, double start_bps);
+
+/* a receiver report, returns the new target (bit/s) */
+double abr_update(AbrCtl *ac, const RtcpReport *r, long long now);
+
+#endif
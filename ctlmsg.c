@@ -0,0 +1,130 @@
+#include <string.h>
+
+#include "ctlmsg.h"
+
+static unsigned char *put16(unsigned char *p, uint16_t v)
+{
+	p[0] = v >> 8;
+	p[1] = v;
+	return p + 2;
+}
+
+static unsigned char *put32(unsigned char *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+	return p + 4;
+}
+
+static uint16_t get16(const unsigned char **p)
+{
+	uint16_t v = ((*p)[0] << 8) | (*p)[1];
+	*p += 2;
+	return v;
+}
+
+static uint32_t get32(const unsigned char **p)
+{
+	uint32_t v = ((uint32_t)(*p)[0] << 24) | ((*p)[1] << 16) | ((*p)[2] << 8) | (*p)[3];
+	*p += 4;
+	return v;
+}
+
+int ctl_msg_build(unsigned char *buf, int type, const unsigned char *payload, int len)
+{
+	buf[0] = CTL_MAGIC;
+	buf[1] = type;
+	put16(buf + 2, len);
+	if(len > 0 && payload != buf + CTL_HDR_SIZE)
+		memmove(buf + CTL_HDR_SIZE, payload, len);
+	return CTL_HDR_SIZE + len;
+}
+
+int ctl_msg_parse(const unsigned char *buf, int len, int *type,
+		  const unsigned char **payload, int *plen)
+{
+	const unsigned char *p = buf + 2;
+
+	if(len < 1)
+		return 0;
+	if(buf[0] != CTL_MAGIC)
+		return -1;
+	if(len < CTL_HDR_SIZE)
+		return 0;
+	*plen = get16(&p);
+	if(len < CTL_HDR_SIZE + *plen)
+		return 0;
+	*type = buf[1];
+	*payload = buf + CTL_HDR_SIZE;
+	return CTL_HDR_SIZE + *plen;
+}
+
+int ctl_stats_build(unsigned char *buf, const CtlStats *st)
+{
+	unsigned char *p = buf;
+	const CtlClientStats *c;
+	int i, n = st->nclients < CTL_MAX_CLIENTS ? st->nclients : CTL_MAX_CLIENTS;
+
+	p = put32(p, st->uptime_ms);
+	p = put32(p, st->frames);
+	p = put16(p, st->fps100);
+	p = put32(p, st->kbps);
+	p = put32(p, st->target_kbps);
+	*p++ = n;                          // as many as written
+	for(i = 0; i < n; i++){
+		c = &st->client[i];
+		memcpy(p, &c->addr, 4);         // already in network order
+		p += 4;
+		*p++ = c->streaming;
+		*p++ = c->layer;
+		*p++ = c->fraction_lost;
+		p = put16(p, c->queue_pkts);
+		p = put16(p, c->queue_frames);
+		p = put32(p, c->sent);
+		p = put32(p, c->dropped);
+		p = put32(p, c->skipped);
+		p = put32(p, c->resent);
+		p = put32(p, c->rtt_us);
+		p = put32(p, c->rttvar_us);
+		p = put32(p, c->recv_kbps);
+	}
+	return p - buf;
+}
+
+int ctl_stats_parse(const unsigned char *buf, int len, CtlStats *st)
+{
+	const unsigned char *p = buf;
+	CtlClientStats *c;
+	int i;
+
+	if(len < CTL_STATS_HDR)
+		return -1;
+	st->uptime_ms   = get32(&p);
+	st->frames      = get32(&p);
+	st->fps100      = get16(&p);
+	st->kbps        = get32(&p);
+	st->target_kbps = get32(&p);
+	st->nclients    = *p++;
+	if(st->nclients > CTL_MAX_CLIENTS || len < CTL_STATS_HDR + st->nclients * CTL_STATS_CLIENT)
+		return -1;
+	for(i = 0; i < st->nclients; i++){
+		c = &st->client[i];
+		memcpy(&c->addr, p, 4);
+		p += 4;
+		c->streaming     = *p++;
+		c->layer         = *p++;
+		c->fraction_lost = *p++;
+		c->queue_pkts    = get16(&p);
+		c->queue_frames  = get16(&p);
+		c->sent          = get32(&p);
+		c->dropped       = get32(&p);
+		c->skipped       = get32(&p);
+		c->resent        = get32(&p);
+		c->rtt_us        = get32(&p);
+		c->rttvar_us     = get32(&p);
+		c->recv_kbps     = get32(&p);
+	}
+	return 0;
+}
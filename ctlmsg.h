@@ -0,0 +1,87 @@
+#ifndef CTLMSG_H
+#define CTLMSG_H
+
+#include <stdint.h>
+
+/*--------------------------------------------------------------------------
+   control connection messages
+
+   the control connection (tcp) carries one byte commands, 's' start,
+   'c' stop, 'k' key frame, each answered by one byte, 'a' ack or 'n'
+   nack. a message with a length prefix starts with CTL_MAGIC, which is
+   no command, so both go over the same connection:
+
+     CTL_MAGIC | type | length (16 bits) | payload (length bytes)
+
+   a command sent as a message ('s', 'c', 'k', no payload) is answered
+   by a message 'a' or 'n'; so is CTL_LAYER (one byte: the layer, the
+   streamer's sources in order, 0 the first), which picks the stream
+   sent from 's' on, or, while streaming, switches to it at its next
+   IDR ('n': no such layer). CTL_STATS_REQ (no payload) is answered by
+   CTL_STATS, the streamer's state in one read (big endian):
+
+     uptime ms (32) | frames (32) | fps x 100 (16) | bitrate kbit/s (32)
+     target kbit/s (32, 0: no rate control) | clients (8)
+     per client (CTL_STATS_CLIENT bytes):
+       IPv4 address (32) | streaming (8) | layer (8)
+       fraction lost (8, / 256)
+       queue: packets (16) frames (16) | packets sent (32) | dropped (32)
+       frames skipped (32) | resent (32) | RTT us (32) | RTT var us (32)
+       receive kbit/s (32)
+
+   frames, fps and bitrate are those of layer 0 (the encoder's main
+   output), measured at the source over the last second; queue the
+   packets of the current frame waiting in the pacer and the frames
+   waiting behind it; dropped the packets the udp socket refused; RTT
+   that of the control connection (TCP_INFO); loss and receive rate
+   from the player's last receiver report.
+---------------------------------------------------------------------------*/
+
+#define CTL_MAGIC         0xC5
+#define CTL_HDR_SIZE      4
+#define CTL_STATS_REQ     '?'
+#define CTL_STATS         'S'
+#define CTL_LAYER         'L'
+#define CTL_MAX_CLIENTS   64
+#define CTL_STATS_HDR     19
+#define CTL_STATS_CLIENT  39
+#define CTL_MAX_MSG       (CTL_HDR_SIZE + CTL_STATS_HDR + CTL_MAX_CLIENTS * CTL_STATS_CLIENT)
+
+typedef struct {
+	uint32_t addr;               // network byte order
+	uint8_t  streaming;
+	uint8_t  layer;
+	uint8_t  fraction_lost;
+	uint16_t queue_pkts, queue_frames;
+	uint32_t sent, dropped, skipped, resent;
+	uint32_t rtt_us, rttvar_us;
+	uint32_t recv_kbps;
+} CtlClientStats;
+
+typedef struct {
+	uint32_t uptime_ms;
+	uint32_t frames;             // published by the source
+	uint16_t fps100;
+	uint32_t kbps, target_kbps;
+	int      nclients;
+	CtlClientStats client[CTL_MAX_CLIENTS];
+} CtlStats;
+
+/* a message of type with len bytes of payload, returns its length */
+int ctl_msg_build(unsigned char *buf, int type, const unsigned char *payload, int len);
+
+/*
+ * the message at the start of buf (len bytes received): returns its length
+ * with *type and *payload, *plen set, 0 if it is not complete yet, -1 if
+ * buf does not start with a message
+ */
+int ctl_msg_parse(const unsigned char *buf, int len, int *type,
+		  const unsigned char **payload, int *plen);
+
+/* the payload of CTL_STATS, returns its length */
+int ctl_stats_build(unsigned char *buf, const CtlStats *st);
+
+/* 0 and *st if the payload is valid, else -1 */
+int ctl_stats_parse(const unsigned char *buf, int len, CtlStats *st);
+
+#endif
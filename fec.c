@@ -0,0 +1,799 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define HAVE_NEON 1
+#endif
+
+#include "fec.h"
+
+/*--------------------------------------------------------------------------
+   FEC for RTP, see fec.h for the schemes and the repair packet
+
+   GF(256) arithmetic: polynomial x^8+x^4+x^3+x^2+1 (0x11D), log/exp
+   tables and a full product table; the multiply-add kernel uses the
+   split nibble tables (c*x = c*lo(x) ^ c*hi(x)) with PSHUFB (SSSE3,
+   -mssse3) or VTBL (NEON, -mfpu=neon), the product table otherwise.
+
+   Reed-Solomon: systematic Cauchy code, repair j of a block of k is
+   sum_i C[j][i] * symbol_i with C[j][i] = 1 / ((k+j) ^ i); any square
+   part of a Cauchy matrix can be inverted, so any e <= m losses of the
+   block are repaired with e repairs.
+---------------------------------------------------------------------------*/
+
+#define FEC_RX_ACTIVE_NS  1000000000LL   // repairs seen this recently: hold holes
+
+/* GF(256) -----------------------------------------------------------------*/
+
+static uint8_t gf_exp[512], gf_log[256];
+static uint8_t gf_mul_tab[256][256];
+static uint8_t gf_nib_lo[256][16], gf_nib_hi[256][16];
+static pthread_once_t gf_once = PTHREAD_ONCE_INIT;
+
+static void gf_init(void)
+{
+	int i, j, x = 1;
+
+	for(i = 0; i < 255; i++){
+		gf_exp[i] = gf_exp[i + 255] = x;
+		gf_log[x] = i;
+		x <<= 1;
+		if(x & 0x100)
+			x ^= 0x11D;
+	}
+	for(i = 0; i < 256; i++)
+		for(j = 0; j < 256; j++)
+			gf_mul_tab[i][j] = (i && j) ? gf_exp[gf_log[i] + gf_log[j]] : 0;
+	for(i = 0; i < 256; i++)
+		for(j = 0; j < 16; j++){
+			gf_nib_lo[i][j] = gf_mul_tab[i][j];
+			gf_nib_hi[i][j] = gf_mul_tab[i][j << 4];
+		}
+}
+
+static inline uint8_t gf_mul(uint8_t a, uint8_t b)
+{
+	return gf_mul_tab[a][b];
+}
+
+/* a != 0 */
+static inline uint8_t gf_inv(uint8_t a)
+{
+	return gf_exp[255 - gf_log[a]];
+}
+
+/* Cauchy coefficient of repair j and source i in a block of k */
+static inline uint8_t rs_coef(int k, int j, int i)
+{
+	return gf_inv((k + j) ^ i);
+}
+
+/* kernels -----------------------------------------------------------------*/
+
+void fec_xor(unsigned char *dst, const unsigned char *src, int len)
+{
+	int i = 0;
+
+	for(; i + 8 <= len; i += 8){
+		uint64_t a, b;
+		memcpy(&a, dst + i, 8);
+		memcpy(&b, src + i, 8);
+		a ^= b;
+		memcpy(dst + i, &a, 8);
+	}
+	for(; i < len; i++)
+		dst[i] ^= src[i];
+}
+
+void fec_gf_muladd_table(unsigned char *dst, const unsigned char *src, uint8_t c, int len)
+{
+	const uint8_t *t;
+	int i;
+
+	pthread_once(&gf_once, gf_init);
+	if(c == 0)
+		return;
+	if(c == 1){
+		fec_xor(dst, src, len);
+		return;
+	}
+	t = gf_mul_tab[c];
+	for(i = 0; i < len; i++)
+		dst[i] ^= t[src[i]];
+}
+
+void fec_gf_muladd(unsigned char *dst, const unsigned char *src, uint8_t c, int len)
+{
+	int i = 0;
+
+	pthread_once(&gf_once, gf_init);
+	if(c == 0)
+		return;
+	if(c == 1){
+		fec_xor(dst, src, len);
+		return;
+	}
+
+#if defined(__SSSE3__)
+	__m128i tlo  = _mm_loadu_si128((const __m128i *)gf_nib_lo[c]);
+	__m128i thi  = _mm_loadu_si128((const __m128i *)gf_nib_hi[c]);
+	__m128i mask = _mm_set1_epi8(0x0F);
+
+	for(; i + 16 <= len; i += 16){
+		__m128i s  = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i lo = _mm_and_si128(s, mask);
+		__m128i hi = _mm_and_si128(_mm_srli_epi16(s, 4), mask);
+		__m128i p  = _mm_xor_si128(_mm_shuffle_epi8(tlo, lo), _mm_shuffle_epi8(thi, hi));
+		__m128i d  = _mm_loadu_si128((const __m128i *)(dst + i));
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(d, p));
+	}
+#elif defined(HAVE_NEON)
+	uint8x8x2_t tlo, thi;
+	uint8x16_t mask = vdupq_n_u8(0x0F);
+
+	tlo.val[0] = vld1_u8(gf_nib_lo[c]);
+	tlo.val[1] = vld1_u8(gf_nib_lo[c] + 8);
+	thi.val[0] = vld1_u8(gf_nib_hi[c]);
+	thi.val[1] = vld1_u8(gf_nib_hi[c] + 8);
+	for(; i + 16 <= len; i += 16){
+		uint8x16_t s  = vld1q_u8(src + i);
+		uint8x16_t lo = vandq_u8(s, mask);
+		uint8x16_t hi = vshrq_n_u8(s, 4);
+		uint8x8_t pl = veor_u8(vtbl2_u8(tlo, vget_low_u8(lo)),  vtbl2_u8(thi, vget_low_u8(hi)));
+		uint8x8_t ph = veor_u8(vtbl2_u8(tlo, vget_high_u8(lo)), vtbl2_u8(thi, vget_high_u8(hi)));
+		vst1q_u8(dst + i, veorq_u8(vld1q_u8(dst + i), vcombine_u8(pl, ph)));
+	}
+#endif
+
+	for(; i < len; i++)
+		dst[i] ^= gf_mul_tab[c][src[i]];
+}
+
+const char *fec_gf_impl(void)
+{
+#if defined(__SSSE3__)
+	return "ssse3";
+#elif defined(HAVE_NEON)
+	return "neon";
+#else
+	return "table";
+#endif
+}
+
+/* symbols: length (2 bytes) + packet, zero padded ---------------------------*/
+
+static void sym_xor(unsigned char *sym, const unsigned char *pkt, int len)
+{
+	sym[0] ^= len >> 8;
+	sym[1] ^= len & 0xFF;
+	fec_xor(sym + 2, pkt, len);
+}
+
+static void sym_muladd(unsigned char *sym, const unsigned char *pkt, int len, uint8_t c)
+{
+	sym[0] ^= gf_mul(c, len >> 8);
+	sym[1] ^= gf_mul(c, len & 0xFF);
+	fec_gf_muladd(sym + 2, pkt, c, len);
+}
+
+/* configuration -------------------------------------------------------------*/
+
+int fec_parse(FecConfig *fc, const char *spec)
+{
+	int a = 0, b = 0;
+
+	memset(fc, 0, sizeof(*fc));
+	if(strcmp(spec, "none") == 0)
+		return 0;
+	if(sscanf(spec, "row:%d", &a) == 1 && a >= 2 && a <= FEC_MAX_K){
+		fc->scheme = FEC_XOR_ROW;
+		fc->cols = a;
+		fc->rows = 1;
+	}else if(sscanf(spec, "col:%d:%d", &a, &b) == 2 && a >= 1 && b >= 2 && a * b <= FEC_MAX_K){
+		fc->scheme = FEC_XOR_COL;
+		fc->cols = a;
+		fc->rows = b;
+	}else if(sscanf(spec, "2d:%d:%d", &a, &b) == 2 && a >= 2 && b >= 2 && a * b <= FEC_MAX_K){
+		fc->scheme = FEC_XOR_2D;
+		fc->cols = a;
+		fc->rows = b;
+	}else if(sscanf(spec, "rs:%d:%d", &a, &b) == 2 && a >= 1 && b >= 1 && b <= FEC_RS_MAX_M && a + b <= 255){
+		fc->scheme = FEC_RS;
+		fc->k = a;
+		fc->m = b;
+	}else
+		return -1;
+	return 0;
+}
+
+int fec_block_size(const FecConfig *fc)
+{
+	switch(fc->scheme){
+	case FEC_XOR_ROW: return fc->cols;
+	case FEC_XOR_COL:
+	case FEC_XOR_2D:  return fc->cols * fc->rows;
+	case FEC_RS:      return fc->k;
+	}
+	return FEC_MAX_K;
+}
+
+/*
+ * repairs of a block of k source packets
+ * a short block (the end of a frame) keeps the overhead of a full one:
+ * fewer columns for the same rows, fewer RS repairs
+ */
+typedef struct {
+	int cols;                    // columns of the XOR matrix
+	int nrow, ncol, nrs;         // repairs
+} BlockShape;
+
+static void block_shape(const FecConfig *fc, int k, BlockShape *bs)
+{
+	int rows;
+
+	memset(bs, 0, sizeof(*bs));
+	switch(fc->scheme){
+	case FEC_XOR_ROW:
+		bs->cols = k;
+		bs->nrow = 1;
+		break;
+	case FEC_XOR_COL:
+	case FEC_XOR_2D:
+		bs->cols = (k + fc->rows - 1) / fc->rows;
+		if(bs->cols > fc->cols)
+			bs->cols = fc->cols;
+		rows = (k + bs->cols - 1) / bs->cols;
+		if(fc->scheme == FEC_XOR_COL)
+			bs->ncol = bs->cols;
+		else{
+			bs->nrow = bs->cols >= 2 ? rows : 0;
+			bs->ncol = (rows >= 2 || bs->nrow == 0) ? bs->cols : 0;
+		}
+		break;
+	case FEC_RS:
+		bs->nrs = (fc->m * k + fc->k - 1) / fc->k;
+		break;
+	}
+}
+
+int fec_max_repair(const FecConfig *fc, int nsrc)
+{
+	int bsize = fec_block_size(fc), rem = nsrc % bsize;
+	BlockShape bs;
+	int n;
+
+	if(fc->scheme == FEC_NONE)
+		return 0;
+	block_shape(fc, bsize, &bs);
+	n = nsrc / bsize * (bs.nrow + bs.ncol + bs.nrs);
+	if(rem){
+		block_shape(fc, rem, &bs);
+		n += bs.nrow + bs.ncol + bs.nrs;
+	}
+	return n;
+}
+
+double fec_overhead(const FecConfig *fc)
+{
+	int bsize = fec_block_size(fc);
+	return fc->scheme == FEC_NONE ? 0.0 : (double)fec_max_repair(fc, bsize) / bsize;
+}
+
+/* sender ------------------------------------------------------------------*/
+
+void fec_encoder_init(FecEncoder *fe, const FecConfig *fc)
+{
+	pthread_once(&gf_once, gf_init);
+	fe->cfg  = *fc;
+	fe->seq  = rand() & 0xFFFF;
+	fe->ssrc = ((uint32_t)rand() << 16) ^ rand();
+}
+
+/* start a repair packet: RTP and FEC headers, zero symbol */
+static unsigned char *repair_start(FecEncoder *fe, unsigned char *p, const RtpPkt *src,
+				   int type, int index, int k, int cols, int nrep, int symlen)
+{
+	unsigned char *q = p + RTP_HDR_SIZE;
+
+	p[0]  = 0x80;                                  // V=2
+	p[1]  = RTP_PT_FEC;
+	p[2]  = fe->seq >> 8;
+	p[3]  = fe->seq & 0xFF;
+	memcpy(p + 4, src->data + 4, 4);               // timestamp of the frame
+	p[8]  = fe->ssrc >> 24;
+	p[9]  = fe->ssrc >> 16;
+	p[10] = fe->ssrc >> 8;
+	p[11] = fe->ssrc;
+	fe->seq++;
+
+	q[0] = type;
+	q[1] = index;
+	q[2] = src->data[2];                           // base: first source
+	q[3] = src->data[3];
+	q[4] = k;
+	q[5] = cols;
+	q[6] = nrep;
+	q[7] = 0;
+	memset(q + FEC_HDR_SIZE, 0, symlen);
+	return q + FEC_HDR_SIZE;
+}
+
+/* largest of n packets, step apart */
+static int max_len(const RtpPkt *s, int n, int step)
+{
+	int i, len = 0;
+
+	for(i = 0; i < n; i += step)
+		if(s[i].len > len)
+			len = s[i].len;
+	return len;
+}
+
+int fec_encode(FecEncoder *fe, const RtpPkt *src, int n,
+	       unsigned char *rep, int repstride, RtpPkt *out, int maxout)
+{
+	int bsize = fec_block_size(&fe->cfg);
+	int b, i, j, k, nrep, symlen, nout = 0;
+	const RtpPkt *s;
+	unsigned char *p, *sym;
+	BlockShape bs;
+
+	for(b = 0; b < n; b += bsize){
+		s = src + b;
+		k = n - b < bsize ? n - b : bsize;
+		block_shape(&fe->cfg, k, &bs);
+		nrep = bs.nrow + bs.ncol + bs.nrs;
+		if(nout + k + nrep > maxout || max_len(s, k, 1) + FEC_OVERHEAD > repstride)
+			return -1;
+
+		/* 1. the block */
+		for(i = 0; i < k; i++)
+			out[nout++] = s[i];
+
+		/* 2. rows: consecutive packets */
+		for(j = 0; j < bs.nrow; j++){
+			int first = j * bs.cols, cnt = k - first < bs.cols ? k - first : bs.cols;
+
+			symlen = 2 + max_len(s + first, cnt, 1);
+			p = rep;
+			sym = repair_start(fe, p, s, FEC_PKT_ROW, j, k, bs.cols, nrep, symlen);
+			for(i = first; i < first + cnt; i++)
+				sym_xor(sym, s[i].data, s[i].len);
+			out[nout].data = p;
+			out[nout++].len = RTP_HDR_SIZE + FEC_HDR_SIZE + symlen;
+			rep += repstride;
+		}
+
+		/* 3. columns: packets cols apart, a burst hits each column once */
+		for(j = 0; j < bs.ncol; j++){
+			symlen = 2 + max_len(s + j, k - j, bs.cols);
+			p = rep;
+			sym = repair_start(fe, p, s, FEC_PKT_COL, j, k, bs.cols, nrep, symlen);
+			for(i = j; i < k; i += bs.cols)
+				sym_xor(sym, s[i].data, s[i].len);
+			out[nout].data = p;
+			out[nout++].len = RTP_HDR_SIZE + FEC_HDR_SIZE + symlen;
+			rep += repstride;
+		}
+
+		/* 4. Reed-Solomon */
+		symlen = 2 + max_len(s, k, 1);
+		for(j = 0; j < bs.nrs; j++){
+			p = rep;
+			sym = repair_start(fe, p, s, FEC_PKT_RS, j, k, 0, nrep, symlen);
+			for(i = 0; i < k; i++)
+				sym_muladd(sym, s[i].data, s[i].len, rs_coef(k, j, i));
+			out[nout].data = p;
+			out[nout++].len = RTP_HDR_SIZE + FEC_HDR_SIZE + symlen;
+			rep += repstride;
+		}
+	}
+	return nout;
+}
+
+/* receiver ----------------------------------------------------------------*/
+
+#define SLOT(s) ((s) & (FEC_RX_WIN - 1))
+
+static inline int seqdiff(uint16_t a, uint16_t b)
+{
+	return (int16_t)(a - b);
+}
+
+static inline int present(const FecRx *fr, uint16_t s)
+{
+	return fr->len[SLOT(s)] > 0 && fr->sseq[SLOT(s)] == s;
+}
+
+static inline const unsigned char *slot_pkt(const FecRx *fr, uint16_t s)
+{
+	return fr->pkt + SLOT(s) * FEC_RX_MAX_PKT;
+}
+
+int fec_rx_init(FecRx *fr, int hold_ms)
+{
+	int i;
+
+	pthread_once(&gf_once, gf_init);
+	memset(fr, 0, sizeof(*fr));
+	fr->pkt     = malloc((size_t)FEC_RX_WIN * FEC_RX_MAX_PKT);
+	fr->repbuf  = malloc((size_t)FEC_RX_REPAIRS * FEC_RX_MAX_PKT);
+	fr->scratch = malloc((size_t)2 * FEC_RS_MAX_M * FEC_RX_MAX_PKT);
+	if(!fr->pkt || !fr->repbuf || !fr->scratch){
+		fec_rx_free(fr);
+		return -1;
+	}
+	for(i = 0; i < FEC_RX_REPAIRS; i++)
+		fr->rep[i].sym = fr->repbuf + i * FEC_RX_MAX_PKT;
+	fr->hold_ns = hold_ms * 1000000LL;
+	return 0;
+}
+
+void fec_rx_free(FecRx *fr)
+{
+	free(fr->pkt);
+	free(fr->repbuf);
+	free(fr->scratch);
+	fr->pkt = fr->repbuf = fr->scratch = NULL;
+}
+
+void fec_rx_restart(FecRx *fr)
+{
+	int i;
+
+	memset(fr->len, 0, sizeof(fr->len));
+	memset(fr->nack_cnt, 0, sizeof(fr->nack_cnt));
+	for(i = 0; i < FEC_RX_REPAIRS; i++)
+		fr->rep[i].inuse = 0;
+	fr->started = fr->rep_started = 0;
+	fr->hole_ns = 0;
+}
+
+static void store(FecRx *fr, uint16_t s, const unsigned char *pkt, int len)
+{
+	memcpy(fr->pkt + SLOT(s) * FEC_RX_MAX_PKT, pkt, len);
+	fr->len[SLOT(s)]  = len;
+	fr->sseq[SLOT(s)] = s;
+	if(seqdiff(s, fr->high) > 0)
+		fr->high = s;
+}
+
+/* a repaired symbol back to its packet */
+static int rebuild(FecRx *fr, uint16_t s, const unsigned char *sym, int symlen)
+{
+	int len = (sym[0] << 8) | sym[1];
+
+	if(len < RTP_HDR_SIZE || len > symlen - 2 || rtp_seq(sym + 2) != s)
+		return 0;                           // not consistent, repair not used
+	store(fr, s, sym + 2, len);
+	fr->recovered++;
+	return 1;
+}
+
+/* a row or column with exactly one packet missing */
+static int recover_xor(FecRx *fr, const FecRepair *r)
+{
+	int i, first, step, end, nmiss = 0, len;
+	uint16_t s, miss = 0;
+	unsigned char *sym = fr->scratch;
+
+	if(r->type == FEC_PKT_ROW){
+		first = r->index * r->cols;
+		step  = 1;
+		end   = first + r->cols < r->k ? first + r->cols : r->k;
+	}else{
+		first = r->index;
+		step  = r->cols;
+		end   = r->k;
+	}
+	for(i = first; i < end; i += step){
+		s = r->base + i;
+		if(!present(fr, s)){
+			if(++nmiss > 1)
+				return 0;
+			miss = s;
+		}
+	}
+	if(nmiss == 0 || seqdiff(miss, fr->next) < 0)
+		return 0;
+
+	memcpy(sym, r->sym, r->len);
+	for(i = first; i < end; i += step){
+		s = r->base + i;
+		if(s == miss)
+			continue;
+		len = fr->len[SLOT(s)];
+		if(len + 2 > r->len)
+			return 0;
+		sym_xor(sym, slot_pkt(fr, s), len);
+	}
+	return rebuild(fr, miss, sym, r->len);
+}
+
+/* invert the n x n matrix a (destroyed), -1 if singular */
+static int gf_invert(uint8_t a[][FEC_RS_MAX_M], uint8_t inv[][FEC_RS_MAX_M], int n)
+{
+	int i, j, r, p;
+	uint8_t t, c;
+
+	for(i = 0; i < n; i++)
+		for(j = 0; j < n; j++)
+			inv[i][j] = i == j;
+	for(i = 0; i < n; i++){
+		for(p = i; p < n && a[p][i] == 0; p++)
+			;
+		if(p == n)
+			return -1;
+		for(j = 0; j < n; j++){
+			t = a[i][j]; a[i][j] = a[p][j]; a[p][j] = t;
+			t = inv[i][j]; inv[i][j] = inv[p][j]; inv[p][j] = t;
+		}
+		c = gf_inv(a[i][i]);
+		for(j = 0; j < n; j++){
+			a[i][j]   = gf_mul(c, a[i][j]);
+			inv[i][j] = gf_mul(c, inv[i][j]);
+		}
+		for(r = 0; r < n; r++){
+			if(r == i || a[r][i] == 0)
+				continue;
+			c = a[r][i];
+			for(j = 0; j < n; j++){
+				a[r][j]   ^= gf_mul(c, a[i][j]);
+				inv[r][j] ^= gf_mul(c, inv[i][j]);
+			}
+		}
+	}
+	return 0;
+}
+
+/* the RS repairs of r's block, when there are as many as losses */
+static int recover_rs(FecRx *fr, const FecRepair *r)
+{
+	const FecRepair *rr[FEC_RS_MAX_M];
+	int miss[FEC_RS_MAX_M];
+	uint8_t a[FEC_RS_MAX_M][FEC_RS_MAX_M], inv[FEC_RS_MAX_M][FEC_RS_MAX_M];
+	int i, j, e, nr = 0, ne = 0, useful = 0, done = 0, len;
+	unsigned char *syn, *out;
+	uint16_t s;
+
+	/* 1. repairs and losses of the block */
+	for(i = 0; i < FEC_RX_REPAIRS && nr < FEC_RS_MAX_M; i++){
+		const FecRepair *x = &fr->rep[i];
+		if(x->inuse && x->type == FEC_PKT_RS && x->base == r->base && x->k == r->k && x->len == r->len)
+			rr[nr++] = x;
+	}
+	for(i = 0; i < r->k; i++){
+		s = r->base + i;
+		if(present(fr, s))
+			continue;
+		if(ne == nr)
+			return 0;                       // not enough repairs (yet)
+		miss[ne++] = i;
+		if(seqdiff(s, fr->next) >= 0)
+			useful = 1;
+	}
+	if(!useful)
+		return 0;
+
+	/* 2. syndromes: repairs minus the packets received */
+	for(j = 0; j < ne; j++){
+		syn = fr->scratch + j * FEC_RX_MAX_PKT;
+		memcpy(syn, rr[j]->sym, r->len);
+		for(i = 0, e = 0; i < r->k; i++){
+			if(e < ne && miss[e] == i){
+				e++;
+				continue;
+			}
+			s = r->base + i;
+			len = fr->len[SLOT(s)];
+			if(len + 2 > r->len)
+				return 0;
+			sym_muladd(syn, slot_pkt(fr, s), len, rs_coef(r->k, rr[j]->index, i));
+		}
+	}
+
+	/* 3. solve: losses = inverse(C[repairs][losses]) * syndromes */
+	for(j = 0; j < ne; j++)
+		for(e = 0; e < ne; e++)
+			a[j][e] = rs_coef(r->k, rr[j]->index, miss[e]);
+	if(gf_invert(a, inv, ne) < 0)
+		return 0;
+	for(e = 0; e < ne; e++){
+		s = r->base + miss[e];
+		if(seqdiff(s, fr->next) < 0)
+			continue;
+		out = fr->scratch + (FEC_RS_MAX_M + e) * FEC_RX_MAX_PKT;
+		memset(out, 0, r->len);
+		for(j = 0; j < ne; j++)
+			fec_gf_muladd(out, fr->scratch + j * FEC_RX_MAX_PKT, inv[e][j], r->len);
+		done |= rebuild(fr, s, out, r->len);
+	}
+	return done;
+}
+
+/* use the repairs until nothing more can be rebuilt */
+static void recover(FecRx *fr)
+{
+	int i, progress = 1;
+	FecRepair *r;
+
+	while(progress){
+		progress = 0;
+		for(i = 0; i < FEC_RX_REPAIRS; i++){
+			r = &fr->rep[i];
+			if(!r->inuse)
+				continue;
+			if(seqdiff(r->base + r->k - 1, fr->next) < 0){
+				r->inuse = 0;                   // the block is out
+				continue;
+			}
+			progress |= r->type == FEC_PKT_RS ? recover_rs(fr, r) : recover_xor(fr, r);
+		}
+	}
+}
+
+static int repair_in(FecRx *fr, const unsigned char *pkt, int len, long long now)
+{
+	const unsigned char *q = pkt + RTP_HDR_SIZE;
+	FecRepair *r = NULL;
+	int i, type, index, k, cols;
+	uint16_t base;
+
+	if(len < RTP_HDR_SIZE + FEC_HDR_SIZE + 2 + RTP_HDR_SIZE)
+		return -1;
+	type  = q[0];
+	index = q[1];
+	base  = (q[2] << 8) | q[3];
+	k     = q[4];
+	cols  = q[5];
+	if(k == 0 ||
+	   (type == FEC_PKT_ROW && (cols == 0 || index * cols >= k)) ||
+	   (type == FEC_PKT_COL && (cols == 0 || index >= cols)) ||
+	   (type == FEC_PKT_RS  && (index >= FEC_RS_MAX_M || k + index > 255)) ||
+	   type < FEC_PKT_ROW || type > FEC_PKT_RS)
+		return -1;
+
+	fr->repairs++;
+	fr->fec_ns = now;
+	if(!fr->started || seqdiff(base + k - 1, fr->next) < 0)
+		return 0;                           // its block is out already
+	if(fr->rep_started == 0 || seqdiff(base, fr->rep_high) > 0)
+		fr->rep_high = base;
+	fr->rep_started = 1;
+
+	/* 1. keep it: a free slot, else the oldest block */
+	for(i = 0; i < FEC_RX_REPAIRS; i++){
+		if(!fr->rep[i].inuse){
+			r = &fr->rep[i];
+			break;
+		}
+		if(r == NULL || seqdiff(fr->rep[i].base, r->base) < 0)
+			r = &fr->rep[i];
+	}
+	r->inuse = 1;
+	r->type  = type;
+	r->index = index;
+	r->base  = base;
+	r->k     = k;
+	r->cols  = cols;
+	r->nrep  = q[6];
+	r->len   = len - RTP_HDR_SIZE - FEC_HDR_SIZE;
+	memcpy(r->sym, q + FEC_HDR_SIZE, r->len);
+
+	/* 2. repair what it can */
+	recover(fr);
+	return 0;
+}
+
+int fec_rx_push(FecRx *fr, const unsigned char *pkt, int len, long long now)
+{
+	uint16_t s;
+	int d;
+
+	if(len < RTP_HDR_SIZE || len > FEC_RX_MAX_PKT || (pkt[0] >> 6) != 2)
+		return -1;
+	if((pkt[1] & 0x7F) == RTP_PT_FEC)
+		return repair_in(fr, pkt, len, now);
+
+	s = rtp_seq(pkt);
+	if(!fr->started){
+		fr->started = 1;
+		fr->next = s;
+		fr->high = s - 1;
+	}
+
+	/* 1. out of the window */
+	fr->received++;
+	d = seqdiff(s, fr->next);
+	if(d < 0){
+		if(present(fr, s)){
+			fr->duplicates++;
+			return 0;
+		}
+		fr->late++;                     // its hole was given up
+		return 1;
+	}
+	if(present(fr, s)){
+		fr->duplicates++;
+		return 0;
+	}
+	while(seqdiff(s, fr->next) >= FEC_RX_WIN){  // held too many: drop the oldest
+		if(!present(fr, fr->next))
+			fr->unrecovered++;
+		fr->next++;
+		fr->hole_ns = 0;
+	}
+
+	/* 2. keep it, it may complete a row, a column or an RS block */
+	store(fr, s, pkt, len);
+	if(seqdiff(fr->high, fr->next) > 0 && fr->rep_started)
+		recover(fr);
+	return 0;
+}
+
+const unsigned char *fec_rx_pop(FecRx *fr, int *len, long long now)
+{
+	uint16_t s;
+
+	while(fr->started && seqdiff(fr->high, fr->next) >= 0){
+		s = fr->next;
+		if(present(fr, s)){
+			fr->next++;
+			fr->hole_ns = 0;
+			*len = fr->len[SLOT(s)];
+			return slot_pkt(fr, s);
+		}
+
+		/* a hole with packets behind it: wait while repairs may come */
+		if(fr->hole_ns == 0)
+			fr->hole_ns = now;
+		if(now - fr->hole_ns < fr->hold_ns &&
+		   (fr->nack ||
+		    (now - fr->fec_ns < FEC_RX_ACTIVE_NS && !(fr->rep_started && seqdiff(fr->rep_high, s) > 0))))
+			return NULL;
+		fr->unrecovered++;
+		fr->next++;
+	}
+	return NULL;
+}
+
+int fec_rx_timeout(const FecRx *fr, long long now)
+{
+	long long t;
+
+	if(!fr->started || fr->hole_ns == 0 || seqdiff(fr->high, fr->next) < 0)
+		return -1;
+	t = fr->hole_ns + fr->hold_ns - now;
+	return t > 0 ? (int)((t + 999999) / 1000000) : 0;
+}
+
+int fec_rx_missing(FecRx *fr, uint16_t *seqs, int max, long long now, long long retry_ns)
+{
+	uint16_t s;
+	int i, n = 0;
+
+	if(!fr->started)
+		return 0;
+	for(s = fr->next; seqdiff(fr->high, s) > 0 && n < max; s++){
+		i = SLOT(s);
+		if(present(fr, s))
+			continue;
+		if(fr->nack_seq[i] != s || fr->nack_cnt[i] == 0){  // a new hole
+			fr->nack_seq[i] = s;
+			fr->nack_cnt[i] = 0;
+		}else if(fr->nack_cnt[i] >= FEC_RX_NACKS || now - fr->nack_ns[i] < retry_ns)
+			continue;
+		fr->nack_cnt[i]++;
+		fr->nack_ns[i] = now;
+		seqs[n++] = s;
+	}
+	fr->nacked += n;
+	return n;
+}
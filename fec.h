@@ -0,0 +1,181 @@
+#ifndef FEC_H
+#define FEC_H
+
+#include <stdint.h>
+#include "rtp264.h"
+
+/*--------------------------------------------------------------------------
+   forward error correction for the RTP stream
+
+   the packets of a frame are cut into blocks; after each block the
+   sender adds repair packets, so the receiver rebuilds lost packets
+   without asking for them again.
+
+   schemes (one per stream, FecConfig):
+     row:L        XOR of each L consecutive packets           overhead 1/L
+     col:L:D      blocks of L x D packets, XOR of each column overhead 1/D
+                  (packets i, i+L, i+2L ..), repairs a burst of up to L
+     2d:L:D       row and column parity of each L x D block   1/L + 1/D
+     rs:K:M       Reed-Solomon over GF(256): M repairs per    M/K
+                  K packets, any M losses of the block repaired
+
+   a source packet is protected as a symbol: 2 bytes length, the whole
+   RTP packet (header included), zero padding to the block's largest
+   packet; so a repaired symbol gives back the packet and its length.
+
+   repair packet: RTP header, PT RTP_PT_FEC, own SSRC and sequence
+   numbers, timestamp of the frame, then
+
+     0       1       2       3       4       5       6       7
+     +-------+-------+-------+-------+-------+-------+-------+-------+
+     | type  | index |   base seq    |   k   |   L   | nrep  |   0   |
+     +-------+-------+-------+-------+-------+-------+-------+-------+
+     | symbol: XOR / RS combination of the k source symbols ...
+
+     type   FEC_PKT_ROW, FEC_PKT_COL or FEC_PKT_RS
+     index  row, column or RS parity row
+     base   sequence number of the first source packet of the block
+     k      source packets in the block
+     L      columns of an XOR block (row:L: L)
+     nrep   repair packets of the block
+---------------------------------------------------------------------------*/
+
+#define RTP_PT_FEC      97
+#define FEC_HDR_SIZE    8
+#define FEC_OVERHEAD    (RTP_HDR_SIZE + FEC_HDR_SIZE + 2)  // repair over its largest source
+#define FEC_MAX_K       255       // source packets per block
+#define FEC_RS_MAX_M    32        // RS repairs per block
+
+enum { FEC_NONE, FEC_XOR_ROW, FEC_XOR_COL, FEC_XOR_2D, FEC_RS };
+enum { FEC_PKT_ROW = 1, FEC_PKT_COL, FEC_PKT_RS };
+
+typedef struct {
+	int scheme;                  // FEC_NONE ..
+	int cols, rows;              // XOR: L columns, D rows
+	int k, m;                    // RS: m repairs per k packets
+} FecConfig;
+
+/* "row:L", "col:L:D", "2d:L:D", "rs:K:M" or "none", 0 or -1 if not valid */
+int    fec_parse(FecConfig *fc, const char *spec);
+/* source packets per block */
+int    fec_block_size(const FecConfig *fc);
+/* repair packets for nsrc source packets at most */
+int    fec_max_repair(const FecConfig *fc, int nsrc);
+/* repair packets per source packet */
+double fec_overhead(const FecConfig *fc);
+
+/* sender ----------------------------------------------------------------*/
+
+typedef struct {
+	FecConfig cfg;
+	uint16_t seq;                // repair stream
+	uint32_t ssrc;
+} FecEncoder;
+
+void fec_encoder_init(FecEncoder *fe, const FecConfig *fc);
+
+/*
+ * protect the n source packets of one frame
+ * out[] gets all the packets in send order, each block followed by its
+ * repairs; repair i is written at rep + i*repstride (repstride >= the
+ * largest source + FEC_OVERHEAD), returns the number of packets in out
+ * or -1 if maxout is too small
+ */
+int  fec_encode(FecEncoder *fe, const RtpPkt *src, int n,
+		unsigned char *rep, int repstride, RtpPkt *out, int maxout);
+
+/* receiver --------------------------------------------------------------
+
+   media and repair packets go in as they arrive, media packets come out
+   in sequence order. a packet is held only behind a hole that repairs
+   may still fill: until the hole is repaired, a repair of a later block
+   shows up (the hole's block is over), or hold_ms have passed. without
+   repair packets in the stream nothing is held.
+
+   with nack set the holes are also asked for again (fec_rx_missing(),
+   rtcp.h) and wait hold_ms for the retransmission, FEC or not.
+   reordering is not waited for here: the player's jitter buffer
+   (jitbuf.h) is in front of it.
+*/
+
+#define FEC_RX_WIN      1024     // source packets kept, power of 2
+#define FEC_RX_REPAIRS  256      // repair packets kept
+#define FEC_RX_MAX_PKT  2048
+#define FEC_RX_NACKS    3        // times a lost packet is asked for
+
+typedef struct {
+	int      inuse;
+	int      type, index, k, cols, nrep;
+	uint16_t base;
+	int      len;                // symbol
+	unsigned char *sym;
+} FecRepair;
+
+typedef struct {
+	unsigned char *pkt;          // FEC_RX_WIN slots of FEC_RX_MAX_PKT
+	int      len[FEC_RX_WIN];    // 0: empty
+	uint16_t sseq[FEC_RX_WIN];   // sequence number in the slot
+	FecRepair rep[FEC_RX_REPAIRS];
+	unsigned char *repbuf;
+	unsigned char *scratch;      // RS: FEC_RS_MAX_M symbols
+
+	int      started;
+	uint16_t next;               // next sequence number out
+	uint16_t high;               // highest sequence number in
+	long long hole_ns;           // a packet waits behind a hole since
+	long long fec_ns;            // last repair packet
+	long long hold_ns;
+	int      rep_started;
+	uint16_t rep_high;           // newest block with repairs in
+
+	int      nack;               // holes are asked for again, wait for them
+	uint16_t nack_seq[FEC_RX_WIN];
+	uint8_t  nack_cnt[FEC_RX_WIN];
+	long long nack_ns[FEC_RX_WIN];  // last asked
+	unsigned long nacked;        // sequence numbers asked for
+
+	unsigned long received;      // media packets received
+	unsigned long repairs;       // repair packets received
+	unsigned long recovered;     // source packets rebuilt
+	unsigned long unrecovered;   // holes given up
+	unsigned long duplicates, late;
+} FecRx;
+
+int  fec_rx_init(FecRx *fr, int hold_ms);
+void fec_rx_free(FecRx *fr);
+
+/* a new stream (another SSRC, sequence numbers of its own): empty the
+   window, keep the counters */
+void fec_rx_restart(FecRx *fr);
+
+/* one received packet, media or repair; 1 if it came after its hole was
+   given up, -1 if not valid */
+int  fec_rx_push(FecRx *fr, const unsigned char *pkt, int len, long long now);
+
+/*
+ * next media packet in sequence order, NULL if there is none or it waits
+ * for repairs; valid until the next fec_rx_push()
+ */
+const unsigned char *fec_rx_pop(FecRx *fr, int *len, long long now);
+
+/* ms until a held packet may be let go (call fec_rx_pop() then), -1 if none */
+int  fec_rx_timeout(const FecRx *fr, long long now);
+
+/*
+ * nack: the holes to ask for (again), not asked for in the last retry_ns
+ * and at most FEC_RX_NACKS times; up to max in seqs, returns how many
+ */
+int  fec_rx_missing(FecRx *fr, uint16_t *seqs, int max, long long now, long long retry_ns);
+
+/* kernels (rpi-fec-bench) -----------------------------------------------*/
+
+/* dst ^= src */
+void fec_xor(unsigned char *dst, const unsigned char *src, int len);
+/* dst ^= c * src in GF(256), SIMD when built for it */
+void fec_gf_muladd(unsigned char *dst, const unsigned char *src, uint8_t c, int len);
+/* same with the 256x256 product table only */
+void fec_gf_muladd_table(unsigned char *dst, const unsigned char *src, uint8_t c, int len);
+/* "ssse3", "neon" or "table" */
+const char *fec_gf_impl(void);
+
+#endif
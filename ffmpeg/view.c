@@ -0,0 +1,349 @@
+#include <malloc.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <SDL/SDL.h>
+#include "view.h"
+
+// initialise
+void viewsys_init()
+{
+  SDL_Init(SDL_INIT_VIDEO);
+}
+
+// delay for a given number of milliseconds
+void viewsys_wait(unsigned int msec)
+{
+  SDL_Delay(msec);
+}
+
+// quit
+void viewsys_quit()
+{
+  SDL_Quit();
+}
+
+/*----------------------------------------------------------------------
+ * frame pacing
+ *
+ * every frame n has an absolute deadline start + n*period on the
+ * monotonic clock, so the time spent in conversion and display does not
+ * add up (no drift as with a fixed delay after each frame).
+ *
+ *  pacer_behind() : before conversion, true if frame n is already one full
+ *                   period late (caller should skip it, counted as dropped)
+ *  pacer_wait()   : sleep until the deadline of frame n, true if late
+ *
+ * pacer_behind() may run in another thread (a converter) than the rest:
+ * its count is atomic, read it with pacer_dropped()
+----------------------------------------------------------------------*/
+#define NSEC_PER_SEC 1000000000LL
+
+static long long ts_to_ns(const struct timespec *ts)
+{
+  return (long long)ts->tv_sec * NSEC_PER_SEC + ts->tv_nsec;
+}
+
+static long long pacer_now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts_to_ns(&ts);
+}
+
+void pacer_init(Pacer *pc, unsigned int msec)
+{
+  memset(pc, 0, sizeof(*pc));
+  pc->period_ns = (long long)msec * 1000000LL;
+  clock_gettime(CLOCK_MONOTONIC, &pc->start);
+}
+
+int pacer_behind(Pacer *pc, unsigned long n)
+{
+  long long deadline;
+
+  if(pc->period_ns == 0)
+     return 0;
+
+  deadline = ts_to_ns(&pc->start) + (long long)n * pc->period_ns;
+  if(pacer_now_ns() - deadline >= pc->period_ns){
+     __atomic_fetch_add(&pc->dropped, 1, __ATOMIC_RELAXED);
+     return 1;
+  }
+  return 0;
+}
+
+int pacer_wait(Pacer *pc, unsigned long n)
+{
+  long long deadline;
+  struct timespec ts;
+
+  pc->shown++;
+  if(pc->period_ns == 0)
+     return 0;
+
+  deadline = ts_to_ns(&pc->start) + (long long)n * pc->period_ns;
+  if(pacer_now_ns() > deadline){
+     pc->late++;
+     return 1;
+  }
+
+  ts.tv_sec  = deadline / NSEC_PER_SEC;
+  ts.tv_nsec = deadline % NSEC_PER_SEC;
+  while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+     ;
+  return 0;
+}
+
+// displayed frames per second since pacer_init()
+double pacer_fps(Pacer *pc)
+{
+  long long elapsed = pacer_now_ns() - ts_to_ns(&pc->start);
+
+  if(elapsed <= 0)
+     return 0.0;
+  return (double)pc->shown * NSEC_PER_SEC / elapsed;
+}
+
+unsigned long pacer_dropped(Pacer *pc)
+{
+  return __atomic_load_n(&pc->dropped, __ATOMIC_RELAXED);
+}
+
+void pacer_report(Pacer *pc, FILE *fp)
+{
+  fprintf(fp, "fps %.2f (target %.2f), shown %lu, late %lu, dropped %lu\n",
+		pacer_fps(pc),
+		pc->period_ns ? (double)NSEC_PER_SEC / pc->period_ns : 0.0,
+		pc->shown, pc->late, pacer_dropped(pc));
+}
+
+Viewer *view_open(unsigned int width, unsigned int height, 
+			const char * title)
+{       
+   // set up the view
+   Viewer *view = (Viewer *)malloc(sizeof(*view));
+   if(view == NULL){
+      fprintf(stderr, "Could not allocate memory for view\n");
+      return NULL;
+   }
+
+   // initialise the screen surface
+   view->screen = SDL_SetVideoMode(width, height, 24, SDL_SWSURFACE);
+   if(view == NULL){
+      fprintf(stderr, "Failed to open screen surface\n");
+      free(view);
+      return NULL;
+   }
+   // set the window title
+   SDL_WM_SetCaption(title, 0);
+   // return the completed view object
+   return view;
+}
+
+
+void view_close(Viewer * view)
+{
+        // free the screen surface
+        SDL_FreeSurface(view->screen);
+        // free the view container
+        free(view);
+}
+
+void view_disp_image(Viewer * view, Image * img)
+{
+        // Blit the image to the window surface
+        SDL_BlitSurface(img->sdl_surface, NULL, view->screen, NULL);
+        
+        // Flip the screen to display the changes
+        SDL_Flip(view->screen);
+}
+
+
+/* 
+ * make img RGB24 surfaces 
+ * @TODO: enable YUV format!
+ */
+Image * imgNew(unsigned int width, unsigned int height)
+{
+        // Allocate for the image container
+        Image *img = (Image *)malloc(sizeof(*img));
+        if(img == NULL){
+                fprintf(stderr, "Failed to allocate mem for image container\n");
+                return NULL;
+        }
+        img->width = width;
+        img->height = height;
+
+        // allocate image data, 3 byte per pixel, 8-Byte aligned 
+        img->mem_ptr = (char *)malloc(img->width * img->height * 3 + 8);
+        if(img->mem_ptr == NULL){
+                fprintf(stderr, "Memory allocation of image data failed\n");
+                free(img);
+                return NULL;
+        }
+
+       // make certain it is aligned to 8 bytes
+       unsigned int remainder = ((size_t)img->mem_ptr) % 8;
+       if(remainder == 0)
+          img->data = img->mem_ptr;
+       else 
+          img->data = img->mem_ptr + (8 - remainder);
+        
+        // Fill the SDL_Surface container
+        img->sdl_surface = SDL_CreateRGBSurfaceFrom(
+                                img->data,
+                                img->width,
+                                img->height,
+                                24, 
+                                img->width * 3,
+                                0xff0000,
+                                0x00ff00,
+                                0x0000ff,
+                                0x000000);
+
+       // check the surface was initialised
+        if(img->sdl_surface == NULL){
+                fprintf(stderr, "Failed to initialise RGB surface from pixel data\n");
+                SDL_FreeSurface(img->sdl_surface);
+                free(img->mem_ptr);
+                free(img);
+                return NULL;
+        }
+
+        return img;
+}
+
+
+/*
+ * Destroys the image
+ */
+void imgDestroy(Image * img)
+{
+  // Free the SDL surface
+   SDL_FreeSurface(img->sdl_surface);
+   if(img->mem_ptr != NULL)
+       free(img->mem_ptr);
+        
+   // free the image container
+   free(img);
+}
+
+/* 
+ *  convert and re-scale 
+ *  now only scale down to 320x240
+ *  e.g.) 640x480 to 320x240
+ *        1920x1080 to 320x240
+ */
+void convertYUV2RGB(unsigned char *pY, unsigned char *pU, unsigned char *pV, 
+			int width, int height, 
+					Image *pI){
+   int scale = 1;
+   int x, y;
+
+   if(width == 640) 
+      scale = 2;
+
+   // Copy data across, converting to RGB along the way
+   char *pRGB = pI->data;
+
+   for(y = 0; y < 240; y++){
+	for(x = 0; x < 320; x++){ 
+
+           int dstidx = 3*(y*320 +x);
+           int srcidx_y = (y*640 +x)*2; //
+	   int srcidx_uv = y*320 +x;    // already subsampled
+  
+	   // avg of 4 pixels
+           int yy = (pY[srcidx_y] + pY[srcidx_y +1] 
+			+  pY[srcidx_y + 640] +  pY[srcidx_y + 641]) >> 2;
+	   int uu =  pU[srcidx_uv];
+	   int vv =  pV[srcidx_uv];
+
+           // yuv to rgb
+           int r = yy + ((357 * vv) >> 8) - 179;
+           int g = yy - (( 87 * uu) >> 8) +  44 - ((181 * vv) >> 8) + 91;
+           int b = yy + ((450 * uu) >> 8) - 226;
+           // clamp to 0 to 255
+           pRGB[dstidx +2] = r > 254 ? 255 : (r < 0 ? 0 : r);
+           pRGB[dstidx +1] = g > 254 ? 255 : (g < 0 ? 0 : g);
+           pRGB[dstidx +0] = b > 254 ? 255 : (b < 0 ? 0 : b);
+     }
+   } 
+
+#if 0 
+   // iterate 2 pixels at a time, so 4 bytes for YUV and 6 bytes for RGB^M
+   for(int i = 0; i < pI->width*pI->height/2; 
+	pY+=2*scale, pU+=scale, pV+=scale, pRGB+=6, i++){
+
+        // YCbCr to RGB conversion 
+	// (from: http://www.equasys.de/colorconversion.html);^M
+        int y0 = *pY, cb = *pU, y1 = *(pY +1), cr = *pV;
+        int r, g, b;
+        // first RGB
+        r = y0 + ((357 * cr) >> 8) - 179;
+        g = y0 - (( 87 * cb) >> 8) +  44 - ((181 * cr) >> 8) + 91;
+        b = y0 + ((450 * cb) >> 8) - 226;
+        // clamp to 0 to 255
+        pRGB[2] = r > 254 ? 255 : (r < 0 ? 0 : r);
+        pRGB[1] = g > 254 ? 255 : (g < 0 ? 0 : g);
+        pRGB[0] = b > 254 ? 255 : (b < 0 ? 0 : b);
+               
+        // second RGB
+        r = y1 + ((357 * cr) >> 8) - 179;
+        g = y1 - (( 87 * cb) >> 8) +  44 - ((181 * cr) >> 8) + 91;
+        b = y1 + ((450 * cb) >> 8) - 226;
+        pRGB[5] = r > 254 ? 255 : (r < 0 ? 0 : r);
+        pRGB[4] = g > 254 ? 255 : (g < 0 ? 0 : g);
+        pRGB[3] = b > 254 ? 255 : (b < 0 ? 0 : b);
+      }
+#endif
+
+
+}
+
+/* 
+ *  convert and re-scale into a region of the image
+ *  (dx, dy, dw, dh) in pI, nearest neighbour sampling, any ratio
+ *  callers may convert different regions of one image in parallel
+ */
+void convertYUV2RGBRect(unsigned char *pY, unsigned char *pU, unsigned char *pV, 
+			int width, int height, Image *pI,
+			int dx, int dy, int dw, int dh)
+{
+   int x, y;
+
+   if(dx + dw > (int)pI->width)  dw = pI->width - dx;
+   if(dy + dh > (int)pI->height) dh = pI->height - dy;
+   if(dw <= 0 || dh <= 0)
+      return;
+
+   int xmap[dw];       // source column for each destination column
+   for(x = 0; x < dw; x++)
+      xmap[x] = x * width / dw;
+
+   for(y = 0; y < dh; y++){
+      int sy = y * height / dh;
+      unsigned char *py = pY + sy * width;
+      unsigned char *pu = pU + (sy >> 1) * (width >> 1);
+      unsigned char *pv = pV + (sy >> 1) * (width >> 1);
+      char *pRGB = pI->data + 3 * ((dy + y) * pI->width + dx);
+
+      for(x = 0; x < dw; x++, pRGB += 3){
+           int sx = xmap[x];
+           int yy = py[sx];
+	   int uu = pu[sx >> 1];
+	   int vv = pv[sx >> 1];
+
+           // yuv to rgb
+           int r = yy + ((357 * vv) >> 8) - 179;
+           int g = yy - (( 87 * uu) >> 8) +  44 - ((181 * vv) >> 8) + 91;
+           int b = yy + ((450 * uu) >> 8) - 226;
+           // clamp to 0 to 255
+           pRGB[2] = r > 254 ? 255 : (r < 0 ? 0 : r);
+           pRGB[1] = g > 254 ? 255 : (g < 0 ? 0 : g);
+           pRGB[0] = b > 254 ? 255 : (b < 0 ? 0 : b);
+      }
+   }
+}
@@ -1,5 +1,7 @@
 #ifndef VIEW_H
 #define VIEW_H
+#include <stdio.h>
+#include <time.h>
 #include <SDL/SDL.h>
 
 typedef struct {
@@ -16,6 +18,15 @@ typedef struct {
         SDL_Surface * screen;
 } Viewer;
 
+/* frame pacing against an absolute monotonic clock (no drift) */
+typedef struct {
+        struct timespec start;   // deadline of frame 0
+        long long period_ns;     // frame interval, 0 for as fast as possible
+        unsigned long shown;     // frames displayed
+        unsigned long late;      // displayed after their deadline
+        unsigned long dropped;   // skipped, atomic: read with pacer_dropped()
+} Pacer;
+
 void viewsys_init();
 void viewsys_wait(unsigned int msec);
 void viewsys_quit();
@@ -26,7 +37,15 @@ void view_close(Viewer * view);
 void view_disp_image(Viewer * view, Image * img);
 Image * imgNew(unsigned int width, unsigned int height);
 void imgDestroy(Image * img);
+void pacer_init(Pacer *pc, unsigned int msec);
+int  pacer_behind(Pacer *pc, unsigned long n);
+int  pacer_wait(Pacer *pc, unsigned long n);
+double pacer_fps(Pacer *pc);
+unsigned long pacer_dropped(Pacer *pc);
+void pacer_report(Pacer *pc, FILE *fp);
 void convertYUV2RGB(unsigned char *pY, unsigned char *pU, unsigned char *pV, int width, int height, Image *pI);
+void convertYUV2RGBRect(unsigned char *pY, unsigned char *pU, unsigned char *pV, int width, int height, Image *pI,
+			int dx, int dy, int dw, int dh);
 
 
 #endif
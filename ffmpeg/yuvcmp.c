@@ -0,0 +1,438 @@
+/*
+ * YUV quality comparison: PSNR and SSIM per plane
+ *
+ * compare a source YUV (I420) file with a decoded one frame by frame, to
+ * see what the encoder bitrate settings cost in quality.
+ *
+ * - SSD and SSIM sums with SSE2 (x86) or NEON (RPi 2/3, -mfpu=neon)
+ *   kernels, plain C otherwise
+ * - each frame is split into bands of rows over worker threads
+ * - the next frame pair is read while the workers compute the current one
+ *
+ * SSIM follows x264: 8x8 windows on a 4x4 grid, from 4x4 block sums.
+ */
+
+/* std headers   ---------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <pthread.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define HAVE_NEON 1
+#endif
+
+#define MAX_THREADS 16
+
+/*-------------------------------------------------------------------------
+  kernels
+--------------------------------------------------------------------------*/
+
+/* sum of squared differences of one row */
+static uint64_t ssd_row(const uint8_t *a, const uint8_t *b, int n)
+{
+	uint64_t ssd = 0;
+	int i = 0;
+
+#if defined(__SSE2__)
+	__m128i zero = _mm_setzero_si128();
+	__m128i acc = zero;
+	uint32_t lane[4];
+
+	for(; i + 16 <= n; i += 16){
+		__m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+		__m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+		__m128i dlo = _mm_sub_epi16(_mm_unpacklo_epi8(va, zero), _mm_unpacklo_epi8(vb, zero));
+		__m128i dhi = _mm_sub_epi16(_mm_unpackhi_epi8(va, zero), _mm_unpackhi_epi8(vb, zero));
+		acc = _mm_add_epi32(acc, _mm_madd_epi16(dlo, dlo));
+		acc = _mm_add_epi32(acc, _mm_madd_epi16(dhi, dhi));
+	}
+	_mm_storeu_si128((__m128i *)lane, acc);
+	ssd = (uint64_t)lane[0] + lane[1] + lane[2] + lane[3];
+#elif defined(HAVE_NEON)
+	uint32x4_t acc = vdupq_n_u32(0);
+	uint64x2_t acc64;
+
+	for(; i + 16 <= n; i += 16){
+		uint8x16_t va = vld1q_u8(a + i);
+		uint8x16_t vb = vld1q_u8(b + i);
+		uint8x16_t d  = vabdq_u8(va, vb);
+		uint16x8_t lo = vmull_u8(vget_low_u8(d),  vget_low_u8(d));
+		uint16x8_t hi = vmull_u8(vget_high_u8(d), vget_high_u8(d));
+		acc = vpadalq_u16(acc, lo);
+		acc = vpadalq_u16(acc, hi);
+	}
+	acc64 = vpaddlq_u32(acc);
+	ssd = vgetq_lane_u64(acc64, 0) + vgetq_lane_u64(acc64, 1);
+#endif
+
+	for(; i < n; i++){
+		int d = a[i] - b[i];
+		ssd += d * d;
+	}
+	return ssd;
+}
+
+/*
+ * sums of the 4x4 blocks along a strip of 4 rows
+ * sums[k] = { sum a, sum b, sum a*a + b*b, sum a*b } of block k
+ */
+static void ssim_4x4_row(const uint8_t *a, int sa, const uint8_t *b, int sb,
+			 int nblk, int sums[][4])
+{
+	int k = 0, r, x;
+
+#if defined(__SSE2__)
+	__m128i zero = _mm_setzero_si128();
+	__m128i one  = _mm_set1_epi16(1);
+	int32_t l1[4], l2[4], lss[4], l12[4];
+
+	for(; k + 2 <= nblk; k += 2){   // two blocks = 8 pixels per step
+		__m128i s1 = zero, s2 = zero, ss = zero, s12 = zero;
+		for(r = 0; r < 4; r++){
+			__m128i va = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(a + r*sa + 4*k)), zero);
+			__m128i vb = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(b + r*sb + 4*k)), zero);
+			s1  = _mm_add_epi16(s1, va);
+			s2  = _mm_add_epi16(s2, vb);
+			ss  = _mm_add_epi32(ss, _mm_add_epi32(_mm_madd_epi16(va, va), _mm_madd_epi16(vb, vb)));
+			s12 = _mm_add_epi32(s12, _mm_madd_epi16(va, vb));
+		}
+		// pairs of pixels -> 32 bit lanes, lanes 0,1 block k and 2,3 block k+1
+		_mm_storeu_si128((__m128i *)l1,  _mm_madd_epi16(s1, one));
+		_mm_storeu_si128((__m128i *)l2,  _mm_madd_epi16(s2, one));
+		_mm_storeu_si128((__m128i *)lss, ss);
+		_mm_storeu_si128((__m128i *)l12, s12);
+		for(x = 0; x < 2; x++){
+			sums[k+x][0] = l1[2*x]  + l1[2*x+1];
+			sums[k+x][1] = l2[2*x]  + l2[2*x+1];
+			sums[k+x][2] = lss[2*x] + lss[2*x+1];
+			sums[k+x][3] = l12[2*x] + l12[2*x+1];
+		}
+	}
+#elif defined(HAVE_NEON)
+	uint32_t l1[4], l2[4], lss[4], l12[4];
+
+	for(; k + 2 <= nblk; k += 2){   // two blocks = 8 pixels per step
+		uint16x8_t s1 = vdupq_n_u16(0), s2 = vdupq_n_u16(0);
+		uint32x4_t ss = vdupq_n_u32(0), s12 = vdupq_n_u32(0);
+		for(r = 0; r < 4; r++){
+			uint8x8_t va = vld1_u8(a + r*sa + 4*k);
+			uint8x8_t vb = vld1_u8(b + r*sb + 4*k);
+			s1  = vaddw_u8(s1, va);
+			s2  = vaddw_u8(s2, vb);
+			ss  = vpadalq_u16(ss, vmull_u8(va, va));
+			ss  = vpadalq_u16(ss, vmull_u8(vb, vb));
+			s12 = vpadalq_u16(s12, vmull_u8(va, vb));
+		}
+		// pairs of pixels -> 32 bit lanes, lanes 0,1 block k and 2,3 block k+1
+		vst1q_u32(l1,  vpaddlq_u16(s1));
+		vst1q_u32(l2,  vpaddlq_u16(s2));
+		vst1q_u32(lss, ss);
+		vst1q_u32(l12, s12);
+		for(x = 0; x < 2; x++){
+			sums[k+x][0] = l1[2*x]  + l1[2*x+1];
+			sums[k+x][1] = l2[2*x]  + l2[2*x+1];
+			sums[k+x][2] = lss[2*x] + lss[2*x+1];
+			sums[k+x][3] = l12[2*x] + l12[2*x+1];
+		}
+	}
+#endif
+
+	for(; k < nblk; k++){
+		int s1 = 0, s2 = 0, ss = 0, s12 = 0;
+		for(r = 0; r < 4; r++)
+			for(x = 0; x < 4; x++){
+				int va = a[r*sa + 4*k + x];
+				int vb = b[r*sb + 4*k + x];
+				s1  += va;
+				s2  += vb;
+				ss  += va*va + vb*vb;
+				s12 += va*vb;
+			}
+		sums[k][0] = s1;
+		sums[k][1] = s2;
+		sums[k][2] = ss;
+		sums[k][3] = s12;
+	}
+}
+
+/* SSIM of one 8x8 window from its sums (x264 ssim_end1) */
+static float ssim_end1(int s1, int s2, int ss, int s12)
+{
+	static const int ssim_c1 = (int)(.01*.01*255*255*64 + .5);
+	static const int ssim_c2 = (int)(.03*.03*255*255*64*63 + .5);
+	int vars  = ss*64 - s1*s1 - s2*s2;
+	int covar = s12*64 - s1*s2;
+
+	return (float)(2*s1*s2 + ssim_c1) * (float)(2*covar + ssim_c2)
+		/ ((float)(s1*s1 + s2*s2 + ssim_c1) * (float)(vars + ssim_c2));
+}
+
+/*
+ * SSIM sum over window rows [j0, j1) of a plane
+ * window row j covers block rows j and j+1
+ */
+static double ssim_rows(const uint8_t *a, const uint8_t *b, int w, int j0, int j1,
+			int (*sums0)[4], int (*sums1)[4])
+{
+	int nblk = w / 4;
+	int j, k;
+	int (*cur)[4] = sums0, (*nxt)[4] = sums1, (*tmp)[4];
+	double ssim = 0.0;
+
+	if(j0 >= j1)
+		return 0.0;
+
+	ssim_4x4_row(a + 4*j0*w, w, b + 4*j0*w, w, nblk, cur);
+	for(j = j0; j < j1; j++){
+		ssim_4x4_row(a + 4*(j+1)*w, w, b + 4*(j+1)*w, w, nblk, nxt);
+		for(k = 0; k + 1 < nblk; k++)
+			ssim += ssim_end1(
+				cur[k][0] + cur[k+1][0] + nxt[k][0] + nxt[k+1][0],
+				cur[k][1] + cur[k+1][1] + nxt[k][1] + nxt[k+1][1],
+				cur[k][2] + cur[k+1][2] + nxt[k][2] + nxt[k+1][2],
+				cur[k][3] + cur[k+1][3] + nxt[k][3] + nxt[k+1][3]);
+		tmp = cur; cur = nxt; nxt = tmp;
+	}
+	return ssim;
+}
+
+/*-------------------------------------------------------------------------
+  worker threads, one band of rows of every plane each
+--------------------------------------------------------------------------*/
+typedef struct {
+	uint64_t ssd[3];
+	double   ssim[3];
+} PlaneSums;
+
+typedef struct Cmp Cmp;
+
+typedef struct {
+	int id;
+	Cmp *cmp;
+	PlaneSums sums;
+	int (*blk)[4];           // 2 rows of block sums
+	pthread_t tid;
+} Worker;
+
+struct Cmp {
+	int w, h, nthread;
+	uint8_t *ref, *dst;      // frame being compared
+	int quit;
+	Worker wk[MAX_THREADS];
+	pthread_barrier_t start, done;
+};
+
+static void plane_geom(Cmp *c, int p, int *pw, int *ph, size_t *off)
+{
+	*pw  = p ? c->w / 2 : c->w;
+	*ph  = p ? c->h / 2 : c->h;
+	*off = p == 0 ? 0 : (size_t)c->w * c->h * (p == 1 ? 4 : 5) / 4;
+}
+
+static void *worker_thread(void *arg)
+{
+	Worker *wk = (Worker *)arg;
+	Cmp *c = wk->cmp;
+	int p, y, pw, ph, nwin, r0, r1, j0, j1;
+	size_t off;
+
+	while(1){
+		pthread_barrier_wait(&c->start);
+		if(c->quit)
+			break;
+
+		for(p = 0; p < 3; p++){
+			const uint8_t *a, *b;
+
+			plane_geom(c, p, &pw, &ph, &off);
+			a = c->ref + off;
+			b = c->dst + off;
+
+			// SSD over pixel rows of the band
+			r0 = ph * wk->id / c->nthread;
+			r1 = ph * (wk->id + 1) / c->nthread;
+			wk->sums.ssd[p] = 0;
+			for(y = r0; y < r1; y++)
+				wk->sums.ssd[p] += ssd_row(a + y*pw, b + y*pw, pw);
+
+			// SSIM over window rows of the band
+			nwin = ph / 4 - 1;
+			j0 = nwin * wk->id / c->nthread;
+			j1 = nwin * (wk->id + 1) / c->nthread;
+			wk->sums.ssim[p] = ssim_rows(a, b, pw, j0, j1,
+					wk->blk, wk->blk + c->w / 4);
+		}
+
+		pthread_barrier_wait(&c->done);
+	}
+	return NULL;
+}
+
+/*-------------------------------------------------------------------------
+  report helpers
+--------------------------------------------------------------------------*/
+static double psnr(uint64_t ssd, double npix)
+{
+	if(ssd == 0)
+		return 100.0;
+	return 10.0 * log10(255.0 * 255.0 * npix / (double)ssd);
+}
+
+static double ssim_db(double ssim)
+{
+	if(ssim >= 1.0)
+		return 100.0;
+	return -10.0 * log10(1.0 - ssim);
+}
+
+static const char *PlaneName[3] = { "Y", "U", "V" };
+
+/*------------------------------------------------------------------------
+   yuvcmp
+
+   usage:  prog <ref.yuv> <dist.yuv> width height [threads] [-q]
+           -q : summary only, no per-frame lines
+-------------------------------------------------------------------------*/
+int main(int argc, char *argv[])
+{
+	Cmp c;
+	FILE *fref, *fdst;
+	uint8_t *buf[2][2];       // [set][ref,dst], double buffered
+	size_t fsize;
+	int cur = 0, have, i, p, pw, ph, nwin, quiet = 0;
+	unsigned long nfrm = 0;
+	uint64_t ssd[3], tot_ssd[3] = {0, 0, 0};
+	double ssim[3], tot_ssim[3] = {0, 0, 0}, sum_psnr[3] = {0, 0, 0};
+	double npix[3];
+	size_t off;
+
+	if(argc < 5){
+		fprintf(stderr, "usage: %s <ref.yuv> <dist.yuv> width height [threads] [-q]\n", argv[0]);
+		return 0;
+	}
+
+	memset(&c, 0, sizeof(c));
+	c.w = atoi(argv[3]);
+	c.h = atoi(argv[4]);
+	c.nthread = 4;
+	for(i = 5; i < argc; i++){
+		if(strcmp(argv[i], "-q") == 0)
+			quiet = 1;
+		else
+			c.nthread = atoi(argv[i]);
+	}
+	if(c.nthread < 1) c.nthread = 1;
+	if(c.nthread > MAX_THREADS) c.nthread = MAX_THREADS;
+	if(c.w < 16 || c.h < 16 || (c.w & 1) || (c.h & 1)){
+		fprintf(stderr, "bad resolution %dx%d\n", c.w, c.h);
+		return 1;
+	}
+
+	fref = fopen(argv[1], "rb");
+	fdst = fopen(argv[2], "rb");
+	if(fref == NULL || fdst == NULL){
+		fprintf(stderr, "Cannot open yuv files: %s %s\n", argv[1], argv[2]);
+		return 1;
+	}
+
+	fsize = (size_t)c.w * c.h * 3 / 2;
+	for(i = 0; i < 4; i++){
+		buf[i/2][i%2] = malloc(fsize);
+		if(buf[i/2][i%2] == NULL){
+			fprintf(stderr, "Cannot allocate frame buffers\n");
+			return 1;
+		}
+	}
+	for(p = 0; p < 3; p++){
+		plane_geom(&c, p, &pw, &ph, &off);
+		npix[p] = (double)pw * ph;
+	}
+
+	/* START the workers */
+	pthread_barrier_init(&c.start, NULL, c.nthread + 1);
+	pthread_barrier_init(&c.done,  NULL, c.nthread + 1);
+	for(i = 0; i < c.nthread; i++){
+		c.wk[i].id = i;
+		c.wk[i].cmp = &c;
+		c.wk[i].blk = malloc(2 * (c.w / 4) * sizeof(*c.wk[i].blk));
+		if(c.wk[i].blk == NULL){
+			fprintf(stderr, "Cannot allocate block sums\n");
+			return 1;
+		}
+		pthread_create(&c.wk[i].tid, NULL, worker_thread, &c.wk[i]);
+	}
+
+	have = fread(buf[cur][0], 1, fsize, fref) == fsize
+	    && fread(buf[cur][1], 1, fsize, fdst) == fsize;
+
+	while(have){
+
+		// 1. compare this pair, read the next one meanwhile
+		c.ref = buf[cur][0];
+		c.dst = buf[cur][1];
+		pthread_barrier_wait(&c.start);
+		have = fread(buf[cur^1][0], 1, fsize, fref) == fsize
+		    && fread(buf[cur^1][1], 1, fsize, fdst) == fsize;
+		pthread_barrier_wait(&c.done);
+		cur ^= 1;
+
+		// 2. gather the bands
+		for(p = 0; p < 3; p++){
+			plane_geom(&c, p, &pw, &ph, &off);
+			nwin = (pw / 4 - 1) * (ph / 4 - 1);
+			ssd[p] = 0;
+			ssim[p] = 0.0;
+			for(i = 0; i < c.nthread; i++){
+				ssd[p]  += c.wk[i].sums.ssd[p];
+				ssim[p] += c.wk[i].sums.ssim[p];
+			}
+			ssim[p] /= nwin;
+			tot_ssd[p]  += ssd[p];
+			tot_ssim[p] += ssim[p];
+			sum_psnr[p] += psnr(ssd[p], npix[p]);
+		}
+
+		if(!quiet)
+			printf("frame %6lu  PSNR Y %6.3f U %6.3f V %6.3f  SSIM Y %.5f U %.5f V %.5f\n",
+				nfrm, psnr(ssd[0], npix[0]), psnr(ssd[1], npix[1]), psnr(ssd[2], npix[2]),
+				ssim[0], ssim[1], ssim[2]);
+		nfrm++;
+	}
+
+	/* FINISH the workers */
+	c.quit = 1;
+	pthread_barrier_wait(&c.start);
+	for(i = 0; i < c.nthread; i++){
+		pthread_join(c.wk[i].tid, NULL);
+		free(c.wk[i].blk);
+	}
+	pthread_barrier_destroy(&c.start);
+	pthread_barrier_destroy(&c.done);
+
+	/* REPORT overall: global PSNR from the total SSD, average per frame PSNR and SSIM */
+	if(nfrm == 0){
+		fprintf(stderr, "No complete frame to compare\n");
+	}else{
+		printf("%lu frames %dx%d, %d threads\n", nfrm, c.w, c.h, c.nthread);
+		for(p = 0; p < 3; p++)
+			printf("  %s: PSNR global %6.3f avg %6.3f  SSIM %.5f (%.3f dB)\n",
+				PlaneName[p],
+				psnr(tot_ssd[p], npix[p] * nfrm), sum_psnr[p] / nfrm,
+				tot_ssim[p] / nfrm, ssim_db(tot_ssim[p] / nfrm));
+		printf("  All: PSNR global %6.3f  SSIM %.5f\n",
+			psnr(tot_ssd[0] + tot_ssd[1] + tot_ssd[2], (npix[0] + npix[1] + npix[2]) * nfrm),
+			(4.0 * tot_ssim[0] + tot_ssim[1] + tot_ssim[2]) / 6.0 / nfrm);
+	}
+
+	for(i = 0; i < 4; i++)
+		free(buf[i/2][i%2]);
+	fclose(fref);
+	fclose(fdst);
+	return 0;
+}
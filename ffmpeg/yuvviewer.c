@@ -1,210 +1,10 @@
 #include <malloc.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
 #include <SDL/SDL.h>
 #include "view.h"
 
-// initialise
-void viewsys_init()
-{
-  SDL_Init(SDL_INIT_VIDEO);
-}
-
-// delay for a given number of milliseconds
-void viewsys_wait(unsigned int msec)
-{
-  SDL_Delay(msec);
-}
-
-// quit
-void viewsys_quit()
-{
-  SDL_Quit();
-}
-
-Viewer *view_open(unsigned int width, unsigned int height, 
-			const char * title)
-{       
-   // set up the view
-   Viewer *view = (Viewer *)malloc(sizeof(*view));
-   if(view == NULL){
-      fprintf(stderr, "Could not allocate memory for view\n");
-      return NULL;
-   }
-
-   // initialise the screen surface
-   view->screen = SDL_SetVideoMode(width, height, 24, SDL_SWSURFACE);
-   if(view == NULL){
-      fprintf(stderr, "Failed to open screen surface\n");
-      free(view);
-      return NULL;
-   }
-   // set the window title
-   SDL_WM_SetCaption(title, 0);
-   // return the completed view object
-   return view;
-}
-
-
-void view_close(Viewer * view)
-{
-        // free the screen surface
-        SDL_FreeSurface(view->screen);
-        // free the view container
-        free(view);
-}
-
-void view_disp_image(Viewer * view, Image * img)
-{
-        // Blit the image to the window surface
-        SDL_BlitSurface(img->sdl_surface, NULL, view->screen, NULL);
-        
-        // Flip the screen to display the changes
-        SDL_Flip(view->screen);
-}
-
-
-/* 
- * make img RGB24 surfaces 
- * @TODO: enable YUV format!
- */
-Image * imgNew(unsigned int width, unsigned int height)
-{
-        // Allocate for the image container
-        Image *img = (Image *)malloc(sizeof(*img));
-        if(img == NULL){
-                fprintf(stderr, "Failed to allocate mem for image container\n");
-                return NULL;
-        }
-        img->width = width;
-        img->height = height;
-
-        // allocate image data, 3 byte per pixel, 8-Byte aligned 
-        img->mem_ptr = (char *)malloc(img->width * img->height * 3 + 8);
-        if(img->mem_ptr == NULL){
-                fprintf(stderr, "Memory allocation of image data failed\n");
-                free(img);
-                return NULL;
-        }
-
-       // make certain it is aligned to 8 bytes
-       unsigned int remainder = ((size_t)img->mem_ptr) % 8;
-       if(remainder == 0)
-          img->data = img->mem_ptr;
-       else 
-          img->data = img->mem_ptr + (8 - remainder);
-        
-        // Fill the SDL_Surface container
-        img->sdl_surface = SDL_CreateRGBSurfaceFrom(
-                                img->data,
-                                img->width,
-                                img->height,
-                                24, 
-                                img->width * 3,
-                                0xff0000,
-                                0x00ff00,
-                                0x0000ff,
-                                0x000000);
-
-       // check the surface was initialised
-        if(img->sdl_surface == NULL){
-                fprintf(stderr, "Failed to initialise RGB surface from pixel data\n");
-                SDL_FreeSurface(img->sdl_surface);
-                free(img->mem_ptr);
-                free(img);
-                return NULL;
-        }
-
-        return img;
-}
-
-
-/*
- * Destroys the image
- */
-void imgDestroy(Image * img)
-{
-  // Free the SDL surface
-   SDL_FreeSurface(img->sdl_surface);
-   if(img->mem_ptr != NULL)
-       free(img->mem_ptr);
-        
-   // free the image container
-   free(img);
-}
-
-/* 
- *  convert and re-scale 
- *  now only scale down to 320x240
- *  e.g.) 640x480 to 320x240
- *        1920x1080 to 320x240
- */
-void convertYUV2RGB(unsigned char *pY, unsigned char *pU, unsigned char *pV, 
-			int width, int height, 
-					Image *pI){
-   int scale = 1;
-   int x, y;
-
-   if(width == 640) 
-      scale = 2;
-
-   // Copy data across, converting to RGB along the way
-   char *pRGB = pI->data;
-
-   for(y = 0; y < 240; y++){
-	for(x = 0; x < 320; x++){ 
-
-           int dstidx = 3*(y*320 +x);
-           int srcidx_y = (y*640 +x)*2; //
-	   int srcidx_uv = y*320 +x;    // already subsampled
-  
-	   // avg of 4 pixels
-           int yy = (pY[srcidx_y] + pY[srcidx_y +1] 
-			+  pY[srcidx_y + 640] +  pY[srcidx_y + 641]) >> 2;
-	   int uu =  pU[srcidx_uv];
-	   int vv =  pV[srcidx_uv];
-
-           // yuv to rgb
-           int r = yy + ((357 * vv) >> 8) - 179;
-           int g = yy - (( 87 * uu) >> 8) +  44 - ((181 * vv) >> 8) + 91;
-           int b = yy + ((450 * uu) >> 8) - 226;
-           // clamp to 0 to 255
-           pRGB[dstidx +2] = r > 254 ? 255 : (r < 0 ? 0 : r);
-           pRGB[dstidx +1] = g > 254 ? 255 : (g < 0 ? 0 : g);
-           pRGB[dstidx +0] = b > 254 ? 255 : (b < 0 ? 0 : b);
-     }
-   } 
-
-#if 0 
-   // iterate 2 pixels at a time, so 4 bytes for YUV and 6 bytes for RGB^M
-   for(int i = 0; i < pI->width*pI->height/2; 
-	pY+=2*scale, pU+=scale, pV+=scale, pRGB+=6, i++){
-
-        // YCbCr to RGB conversion 
-	// (from: http://www.equasys.de/colorconversion.html);^M
-        int y0 = *pY, cb = *pU, y1 = *(pY +1), cr = *pV;
-        int r, g, b;
-        // first RGB
-        r = y0 + ((357 * cr) >> 8) - 179;
-        g = y0 - (( 87 * cb) >> 8) +  44 - ((181 * cr) >> 8) + 91;
-        b = y0 + ((450 * cb) >> 8) - 226;
-        // clamp to 0 to 255
-        pRGB[2] = r > 254 ? 255 : (r < 0 ? 0 : r);
-        pRGB[1] = g > 254 ? 255 : (g < 0 ? 0 : g);
-        pRGB[0] = b > 254 ? 255 : (b < 0 ? 0 : b);
-               
-        // second RGB
-        r = y1 + ((357 * cr) >> 8) - 179;
-        g = y1 - (( 87 * cb) >> 8) +  44 - ((181 * cr) >> 8) + 91;
-        b = y1 + ((450 * cb) >> 8) - 226;
-        pRGB[5] = r > 254 ? 255 : (r < 0 ? 0 : r);
-        pRGB[4] = g > 254 ? 255 : (g < 0 ? 0 : g);
-        pRGB[3] = b > 254 ? 255 : (b < 0 ? 0 : b);
-      }
-#endif
-
-
-}
-
-
 /*----------------------------------------------------------------------
  * demo how to use SDL  
  *
@@ -265,19 +65,362 @@ int demo(int argc, char *argv[])
   yuvviwer
 
   usage:  prog  <yuvfile> width height [timeintval]  
+
+  frames are shown at absolute deadlines (interval in ms, 0 = no wait),
+  frames already one interval late are dropped without conversion
+
+  three stages, so a slow disk read does not show up as stutter
+
+   reader  thread : file  -> yuv ring   (NREADAHEAD raw frames)
+   convert thread : yuv   -> image ring (NIMAGE RGB surfaces, triple buffer)
+   main (display) : blit and flip only, at the frame deadline
 --------------------------------------------------------------------------*/
+#define STATS_INTERVAL 30   // frames between stats updates
+#define NREADAHEAD     8    // raw yuv frames read ahead
+#define NIMAGE         3    // converted images (triple buffering)
+
+/* bounded ring of slots between one producer and one consumer */
+typedef struct {
+	int nslot;
+	int rd, wr, count;
+	int eof;                  // producer finished
+	pthread_mutex_t lock;
+	pthread_cond_t  cond;
+} Ring;
+
+static void ring_init(Ring *r, int nslot)
+{
+	memset(r, 0, sizeof(*r));
+	r->nslot = nslot;
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_cond_init(&r->cond, NULL);
+}
+
+static void ring_destroy(Ring *r)
+{
+	pthread_mutex_destroy(&r->lock);
+	pthread_cond_destroy(&r->cond);
+}
+
+// producer: wait for a free slot, return its index
+static int ring_get_free(Ring *r)
+{
+	int slot;
+	pthread_mutex_lock(&r->lock);
+	while(r->count == r->nslot)
+		pthread_cond_wait(&r->cond, &r->lock);
+	slot = r->wr;
+	pthread_mutex_unlock(&r->lock);
+	return slot;
+}
+
+// producer: the slot from ring_get_free() is filled (or eof)
+static void ring_put(Ring *r, int eof)
+{
+	pthread_mutex_lock(&r->lock);
+	if(eof)
+		r->eof = 1;
+	else{
+		r->wr = (r->wr + 1) % r->nslot;
+		r->count++;
+	}
+	pthread_cond_broadcast(&r->cond);
+	pthread_mutex_unlock(&r->lock);
+}
+
+// consumer: wait for a filled slot, -1 on end of stream
+static int ring_peek(Ring *r)
+{
+	int slot;
+	pthread_mutex_lock(&r->lock);
+	while(r->count == 0 && !r->eof)
+		pthread_cond_wait(&r->cond, &r->lock);
+	slot = r->count ? r->rd : -1;
+	pthread_mutex_unlock(&r->lock);
+	return slot;
+}
+
+// consumer: done with the slot from ring_peek()
+static void ring_release(Ring *r)
+{
+	pthread_mutex_lock(&r->lock);
+	r->rd = (r->rd + 1) % r->nslot;
+	r->count--;
+	pthread_cond_broadcast(&r->cond);
+	pthread_mutex_unlock(&r->lock);
+}
+
+// wait until the ring is full or the producer finished
+static void ring_wait_full(Ring *r)
+{
+	pthread_mutex_lock(&r->lock);
+	while(r->count < r->nslot && !r->eof)
+		pthread_cond_wait(&r->cond, &r->lock);
+	pthread_mutex_unlock(&r->lock);
+}
+
+/* pipeline context shared by the stages */
+typedef struct {
+	FILE *fptr;
+	int w, h;
+	Pacer pacer;
+
+	Ring yuvring;
+	char *yuv[NREADAHEAD];
+	unsigned long yuvfrm[NREADAHEAD];  // frame number in slot
+
+	Ring imgring;
+	Image *img[NIMAGE];
+	unsigned long imgfrm[NIMAGE];
+} ViewPipe;
+
+static void *reader_thread(void *arg)
+{
+	ViewPipe *vp = (ViewPipe *)arg;
+	int fsize = vp->w * vp->h * 3 / 2;
+	unsigned long nfrm;
+	int slot;
+
+	for(nfrm = 0; ; nfrm++){
+		slot = ring_get_free(&vp->yuvring);
+		if(fread(vp->yuv[slot], 1, fsize, vp->fptr) < fsize)
+			break;
+		vp->yuvfrm[slot] = nfrm;
+		ring_put(&vp->yuvring, 0);
+	}
+	ring_put(&vp->yuvring, 1);
+	return NULL;
+}
+
+static void *convert_thread(void *arg)
+{
+	ViewPipe *vp = (ViewPipe *)arg;
+	int slot, islot;
+	int x, y;
+	unsigned char *py;
+	Image *pI;
+
+	while((slot = ring_peek(&vp->yuvring)) >= 0){
+
+		// too late to be shown in time, skip the conversion
+		if(pacer_behind(&vp->pacer, vp->yuvfrm[slot])){
+			ring_release(&vp->yuvring);
+			continue;
+		}
+
+		islot = ring_get_free(&vp->imgring);
+		pI = vp->img[islot];
+		py = (unsigned char *)vp->yuv[slot];
+
+		/* FILL IMAGE */ /* note: BGR not RGB */
+		for(y = 0; y < vp->h; y++)
+			for(x = 0; x < vp->w; x++, py++){
+				int offset = 3*(vp->w*y +x);
+				// gray output, TODO, color!
+				pI->data[offset+0] = *py;
+				pI->data[offset+1] = *py;
+				pI->data[offset+2] = *py;
+			}
+
+		vp->imgfrm[islot] = vp->yuvfrm[slot];
+		ring_put(&vp->imgring, 0);
+		ring_release(&vp->yuvring);
+	}
+	ring_put(&vp->imgring, 1);
+	return NULL;
+}
+
+/*-------------------------------------------------------------------------
+  mosaic mode
+
+  usage:  prog -m <cols> <win_w> <win_h> <interval> <yuvfile> <w> <h> ...
+
+  N yuv files (or named pipes, e.g. fed by a decoder) tiled into one
+  window. one worker thread per tile reads its frame and converts and
+  downscales it straight into its region of the shared window image.
+  main and workers meet at two barriers per frame (start, done).
+--------------------------------------------------------------------------*/
+#define MAX_TILES 16
+
+typedef struct {
+	FILE *fptr;
+	int w, h;                 // source resolution
+	int dx, dy, dw, dh;       // region in the window image
+	char *yuv;
+	int eof;
+	pthread_t tid;
+	struct Mosaic *mo;
+} Tile;
+
+typedef struct Mosaic {
+	int ntile;
+	Tile tile[MAX_TILES];
+	Image *img;               // shared window surface
+	int skip;                 // frame is dropped, read but do not convert
+	int quit;
+	pthread_barrier_t start, done;
+} Mosaic;
+
+static void *tile_thread(void *arg)
+{
+	Tile *t = (Tile *)arg;
+	Mosaic *mo = t->mo;
+	int fsize = t->w * t->h * 3 / 2;
+
+	while(1){
+		pthread_barrier_wait(&mo->start);
+		if(mo->quit)
+			break;
+
+		if(!t->eof && fread(t->yuv, 1, fsize, t->fptr) < fsize)
+			t->eof = 1;   // keep showing the last picture
+
+		if(!t->eof && !mo->skip)
+			convertYUV2RGBRect((unsigned char *)t->yuv,
+				(unsigned char *)t->yuv + t->w*t->h,
+				(unsigned char *)t->yuv + t->w*t->h*5/4,
+				t->w, t->h, mo->img, t->dx, t->dy, t->dw, t->dh);
+
+		pthread_barrier_wait(&mo->done);
+	}
+	return NULL;
+}
+
+static int mosaic_main(int argc, char *argv[])
+{
+	Mosaic mo;
+	int cols, rows, winw, winh, tw, th;
+	long tintval;
+	int i, alive;
+	unsigned long nfrm;
+	Pacer pacer;
+	char caption[128];
+
+	if(argc < 9 || (argc - 6) % 3 != 0){
+		fprintf(stderr,"usage: %s -m <cols> <win_w> <win_h> <interval(ms)> "
+			"<yuvfile> <w> <h> [<yuvfile> <w> <h> ...]\n", argv[0]);
+		return 0;
+	}
+
+	memset(&mo, 0, sizeof(mo));
+	cols = atoi(argv[2]);
+	winw = atoi(argv[3]);
+	winh = atoi(argv[4]);
+	tintval = atol(argv[5]);
+	mo.ntile = (argc - 6) / 3;
+	if(mo.ntile > MAX_TILES){
+		fprintf(stderr,"too many tiles (max %d)\n", MAX_TILES);
+		return 0;
+	}
+	if(cols < 1)
+		cols = 1;
+	rows = (mo.ntile + cols - 1) / cols;
+	tw = winw / cols;
+	th = winh / rows;
+
+	/* INIT */
+   	viewsys_init();
+   	Viewer *pV = view_open(winw, winh, "SDLViewer");
+	mo.img = imgNew(winw, winh);
+	if(mo.img == NULL)
+		goto done;
+	memset(mo.img->data, 0, winw * winh * 3);
+
+	for(i = 0; i < mo.ntile; i++){
+		Tile *t = &mo.tile[i];
+		t->mo = &mo;
+		t->w  = atoi(argv[6 + 3*i + 1]);
+		t->h  = atoi(argv[6 + 3*i + 2]);
+		t->dx = (i % cols) * tw;
+		t->dy = (i / cols) * th;
+		t->dw = tw;
+		t->dh = th;
+		t->fptr = fopen(argv[6 + 3*i], "rb");
+		if(t->fptr == NULL){
+			fprintf(stderr,"Cannot open yuv file: %s\n", argv[6 + 3*i]);
+			t->eof = 1;
+		}
+		t->yuv = malloc(t->w * t->h * 3 / 2);
+		if(t->yuv == NULL){
+			fprintf(stderr,"Cannot allocate yuv buffer\n");
+			t->eof = 1;
+		}
+	}
+
+	pthread_barrier_init(&mo.start, NULL, mo.ntile + 1);
+	pthread_barrier_init(&mo.done,  NULL, mo.ntile + 1);
+	for(i = 0; i < mo.ntile; i++)
+		pthread_create(&mo.tile[i].tid, NULL, tile_thread, &mo.tile[i]);
+
+	pacer_init(&pacer, tintval);
+
+	for(nfrm = 0; ; nfrm++){
+
+		// all tiles read (and convert unless too late) in parallel
+		mo.skip = pacer_behind(&pacer, nfrm);
+		pthread_barrier_wait(&mo.start);
+		pthread_barrier_wait(&mo.done);
+
+		for(i = 0, alive = 0; i < mo.ntile; i++)
+			alive += !mo.tile[i].eof;
+		if(alive == 0)
+			break;
+		if(mo.skip)
+			continue;
+
+		/* DISPLAY at the deadline of this frame */
+		pacer_wait(&pacer, nfrm);
+     		view_disp_image(pV, mo.img);
+
+		/* STATS */
+		if(pacer.shown % STATS_INTERVAL == 0){
+			snprintf(caption, sizeof(caption), 
+				"SDLViewer %d tiles %.1f fps late %lu drop %lu",
+				mo.ntile, pacer_fps(&pacer), pacer.late, pacer_dropped(&pacer));
+			SDL_WM_SetCaption(caption, 0);
+			fprintf(stderr, "\r%s", caption);
+		}
+	}
+	fprintf(stderr, "\n");
+	pacer_report(&pacer, stderr);
+
+	mo.quit = 1;
+	pthread_barrier_wait(&mo.start);
+	for(i = 0; i < mo.ntile; i++)
+		pthread_join(mo.tile[i].tid, NULL);
+	pthread_barrier_destroy(&mo.start);
+	pthread_barrier_destroy(&mo.done);
+
+	for(i = 0; i < mo.ntile; i++){
+		if(mo.tile[i].fptr)
+			fclose(mo.tile[i].fptr);
+		free(mo.tile[i].yuv);
+	}
+	imgDestroy(mo.img);
+done:
+	/* FISNISH */
+   	view_close(pV);
+   	viewsys_quit();
+   	return 0;
+}
+
 int main(int argc, char *argv[])
 {
 	long tintval = 0;
 	int w, h; 
-	FILE *fptr;
-        char *pyuv, *py, *pu, *pv;
-	int x, y;
-	int n;
+	int i, islot;
+	ViewPipe vp;
+	pthread_t reader_tid, convert_tid;
+	char caption[128];
 
 
+	if(argc >= 2 && strcmp(argv[1], "-m") == 0)
+		return mosaic_main(argc, argv);
+
 	if(argc < 4){
 		fprintf(stderr,"usage: %s <yuvfile> width height [interval(ms)]\n", argv[0]);
+		fprintf(stderr,"       %s -m <cols> <win_w> <win_h> <interval(ms)> "
+			"<yuvfile> <w> <h> [...]\n", argv[0]);
 		return 0;
 	}
 	
@@ -286,60 +429,74 @@ int main(int argc, char *argv[])
 	tintval = 0L;	
 	if(argc >= 5)
 		tintval = atol(argv[4]);
-	tintval *= 1000; 
 	
 	/* INIT */
+	memset(&vp, 0, sizeof(vp));
+	vp.w = w;
+	vp.h = h;
+
    	viewsys_init();
    	Viewer *pV = view_open(w, h, "SDLViewer");
-   	Image *pI =  imgNew(w, h);
-
 
-	fptr = fopen(argv[1], "rb");
-	if(fptr == NULL){
+	vp.fptr = fopen(argv[1], "rb");
+	if(vp.fptr == NULL){
 		fprintf(stderr,"Cannot open yuv file: %s\n", argv[1]);
 		goto done2;
 	}
 
-	pyuv = malloc(w*h*3/2);
-	if(pyuv == NULL){
-		fprintf(stderr,"Cannot allocate yuv buffer\n");
-		goto done1;
+	for(i = 0; i < NREADAHEAD; i++){
+		vp.yuv[i] = malloc(w*h*3/2);
+		if(vp.yuv[i] == NULL){
+			fprintf(stderr,"Cannot allocate yuv buffer\n");
+			goto done1;
+		}
 	}
-	
-
-	while(!feof(fptr)){
-
-		// 1. read one YUV frame
-		n = fread(pyuv, 1, w*h*3/2, fptr); 
-		if( n < w*h*3/2)
-			break;
-
-		// YUV offset
-		py = pyuv;
-		pu = pyuv + w*h;
-		pv = pu + w*h/4;
-
-		/* FILL IMAGE */ /* note: BGR not RGB */
-		for(y=0;y<h;y++)
-        		for(x=0;x<w;x++, py++, pu++, pv++){
-          			int offset = 3*(w*y +x);
-				// gray output, TODO, color!
-              			pI->data[offset+0] = *py;    
-              			pI->data[offset+1] = *py;    
-              			pI->data[offset+2] = *py;  
-			}
-
-		/* DISPLAY */
-     		view_disp_image(pV, pI);
-     		viewsys_wait(tintval);
-
+	for(i = 0; i < NIMAGE; i++){
+		vp.img[i] = imgNew(w, h);
+		if(vp.img[i] == NULL)
+			goto done1;
 	}
+	ring_init(&vp.yuvring, NREADAHEAD);
+	ring_init(&vp.imgring, NIMAGE);
+
+	/* START: fill the read-ahead ring before the clock starts */
+	pthread_create(&reader_tid, NULL, reader_thread, &vp);
+	ring_wait_full(&vp.yuvring);
+
+	pacer_init(&vp.pacer, tintval);
+	pthread_create(&convert_tid, NULL, convert_thread, &vp);
+
+	/* DISPLAY at the deadline of each frame */
+	while((islot = ring_peek(&vp.imgring)) >= 0){
+
+		pacer_wait(&vp.pacer, vp.imgfrm[islot]);
+     		view_disp_image(pV, vp.img[islot]);
+		ring_release(&vp.imgring);
+
+		/* STATS */
+		if(vp.pacer.shown % STATS_INTERVAL == 0){
+			snprintf(caption, sizeof(caption), 
+				"SDLViewer %.1f fps late %lu drop %lu",
+				pacer_fps(&vp.pacer), vp.pacer.late, pacer_dropped(&vp.pacer));
+			SDL_WM_SetCaption(caption, 0);
+			fprintf(stderr, "\r%s", caption);
+		}
+	}
+	fprintf(stderr, "\n");
+	pacer_report(&vp.pacer, stderr);
 
-
-	free(pyuv);
+	pthread_join(convert_tid, NULL);
+	pthread_join(reader_tid, NULL);
+	ring_destroy(&vp.imgring);
+	ring_destroy(&vp.yuvring);
 
 done1:
-	fclose(fptr);
+	for(i = 0; i < NIMAGE; i++)
+		if(vp.img[i])
+			imgDestroy(vp.img[i]);
+	for(i = 0; i < NREADAHEAD; i++)
+		free(vp.yuv[i]);
+	fclose(vp.fptr);
 done2:
 	/* FISNISH */
    	view_close(pV);
@@ -347,4 +504,3 @@ done2:
    	return 0;
 
 }
-
@@ -0,0 +1,355 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "h264au.h"
+
+/*--------------------------------------------------------------------------
+   H.264 Annex-B access unit reader
+
+   read() (not fread()) is used so that a named pipe fed by the encoder
+   returns what is there instead of waiting for a full buffer.
+---------------------------------------------------------------------------*/
+
+#define READ_CHUNK  (64*1024)
+#define BUF_SIZE    (H264_MAX_AU_SIZE + READ_CHUNK)
+
+/* does the NAL at nal[] begin a new access unit ? */
+static int au_starts_new(const unsigned char *nal, int has_vcl)
+{
+	if(!has_vcl)
+		return 0;
+
+	switch(nal[0] & 0x1F){
+	case H264_NAL_SEI:
+	case H264_NAL_SPS:
+	case H264_NAL_PPS:
+	case H264_NAL_AUD:
+		return 1;
+	case H264_NAL_SLICE:
+	case H264_NAL_IDR:
+		return (nal[1] & 0x80) != 0;  // ue(v) first_mb_in_slice == 0
+	default:
+		return 0;
+	}
+}
+
+int h264_reader_open(H264Reader *rd, const char *path)
+{
+	struct stat st;
+
+	memset(rd, 0, sizeof(*rd));
+	if(strcmp(path, "-") == 0)
+		rd->fd = 0;
+	else
+		rd->fd = open(path, O_RDONLY);
+	if(rd->fd < 0){
+		fprintf(stderr, "Cannot open h264 stream: %s\n", path);
+		return -1;
+	}
+	if(fstat(rd->fd, &st) == 0 && S_ISREG(st.st_mode))
+		rd->isfile = 1;
+
+	rd->buf = malloc(BUF_SIZE);
+	if(rd->buf == NULL){
+		fprintf(stderr, "Cannot allocate h264 read buffer\n");
+		if(rd->fd > 0)
+			close(rd->fd);
+		return -1;
+	}
+	return 0;
+}
+
+void h264_reader_close(H264Reader *rd)
+{
+	if(rd->fd > 0)
+		close(rd->fd);
+	free(rd->buf);
+	rd->buf = NULL;
+}
+
+int h264_reader_rewind(H264Reader *rd)
+{
+	if(!rd->isfile || lseek(rd->fd, 0, SEEK_SET) < 0)
+		return -1;
+	rd->len = rd->scan = rd->has_vcl = rd->eof = 0;
+	return 0;
+}
+
+int h264_au_alloc(H264AU *au)
+{
+	memset(au, 0, sizeof(*au));
+	au->data = malloc(H264_MAX_AU_SIZE);
+	return au->data ? 0 : -1;
+}
+
+void h264_au_free(H264AU *au)
+{
+	free(au->data);
+	au->data = NULL;
+}
+
+int h264_parse_nals(H264AU *au)
+{
+	const unsigned char *p = au->data;
+	int i, start = -1;
+
+	au->nnal = 0;
+	au->idr = 0;
+	for(i = 0; i + 3 <= au->len; i++){
+		if(p[i] != 0 || p[i+1] != 0 || p[i+2] != 1)
+			continue;
+		if(start >= 0 && au->nnal < H264_MAX_NALS){
+			int end = i;
+			while(end > start && p[end-1] == 0)   // zero_byte / trailing zeros
+				end--;
+			au->nal[au->nnal].data = p + start;
+			au->nal[au->nnal].len  = end - start;
+			au->nnal++;
+		}
+		start = i + 3;
+		i += 2;
+	}
+	if(start >= 0 && start < au->len && au->nnal < H264_MAX_NALS){
+		au->nal[au->nnal].data = p + start;
+		au->nal[au->nnal].len  = au->len - start;
+		au->nnal++;
+	}
+
+	for(i = 0; i < au->nnal; i++)
+		if((au->nal[i].data[0] & 0x1F) == H264_NAL_IDR)
+			au->idr = 1;
+	return au->nnal;
+}
+
+/* move buf[0..end) into au, keep the rest in the read buffer
+   returns 0 if the access unit was too big and skipped */
+static int emit_au(H264Reader *rd, H264AU *au, int end)
+{
+	int ok = end <= H264_MAX_AU_SIZE;
+
+	if(ok){
+		memcpy(au->data, rd->buf, end);
+		au->len = end;
+		h264_parse_nals(au);
+	}else
+		fprintf(stderr, "h264 access unit too big, skipped\n");
+
+	memmove(rd->buf, rd->buf + end, rd->len - end);
+	rd->len -= end;
+	rd->scan = 0;
+	rd->has_vcl = 0;
+	return ok;
+}
+
+int h264_read_au(H264Reader *rd, H264AU *au)
+{
+	unsigned char *p = rd->buf;
+	int i, n;
+
+	while(1){
+		/* 1. look for the start of the next access unit */
+		for(i = rd->scan; i + 4 < rd->len; i++){
+			if(p[i] != 0 || p[i+1] != 0 || p[i+2] != 1)
+				continue;
+
+			if(au_starts_new(&p[i+3], rd->has_vcl)){
+				int end = (i > 0 && p[i-1] == 0) ? i - 1 : i;  // 4 byte start code
+				if(emit_au(rd, au, end))
+					return 1;
+				i = -1;   // skipped, scan the rest again
+				continue;
+			}
+			switch(p[i+3] & 0x1F){
+			case H264_NAL_SLICE:
+			case H264_NAL_IDR:
+				rd->has_vcl = 1;
+				break;
+			default:
+				break;
+			}
+			i += 2;
+		}
+		rd->scan = (rd->len > 4) ? rd->len - 4 : 0;
+
+		/* 2. end of stream: the rest is the last access unit */
+		if(rd->eof){
+			if(rd->len > 0 && rd->has_vcl && emit_au(rd, au, rd->len))
+				return 1;
+			return 0;
+		}
+
+		/* 3. need more data */
+		if(rd->len + READ_CHUNK > BUF_SIZE){
+			fprintf(stderr, "h264 access unit too big, skipped\n");
+			rd->len = rd->scan = rd->has_vcl = 0;
+		}
+		n = read(rd->fd, p + rd->len, READ_CHUNK);
+		if(n < 0){
+			if(errno == EINTR)
+				continue;
+			return -1;
+		}
+		if(n == 0)
+			rd->eof = 1;
+		rd->len += n;
+	}
+}
+
+void h264_params_update(H264Params *ps, const H264AU *au)
+{
+	int i, type, len = 0, sps = 0;
+
+	for(i = 0; i < au->nnal; i++)
+		if((au->nal[i].data[0] & 0x1F) == H264_NAL_SPS)
+			sps = 1;
+	if(!sps)
+		return;
+	for(i = 0; i < au->nnal; i++){
+		type = au->nal[i].data[0] & 0x1F;
+		if(type != H264_NAL_SPS && type != H264_NAL_PPS)
+			continue;
+		if(len + 4 + au->nal[i].len > H264_MAX_PARAMS)
+			return;                      // keep the old ones
+		memcpy(ps->data + len, "\0\0\0\1", 4);
+		memcpy(ps->data + len + 4, au->nal[i].data, au->nal[i].len);
+		len += 4 + au->nal[i].len;
+	}
+	ps->len = len;
+}
+
+int h264_params_insert(const H264Params *ps, H264AU *au)
+{
+	int i;
+
+	if(!au->idr || ps->len == 0 || au->len + ps->len > H264_MAX_AU_SIZE)
+		return 0;
+	for(i = 0; i < au->nnal; i++)
+		if((au->nal[i].data[0] & 0x1F) == H264_NAL_SPS)
+			return 0;
+	memmove(au->data + ps->len, au->data, au->len);
+	memcpy(au->data, ps->data, ps->len);
+	au->len += ps->len;
+	h264_parse_nals(au);
+	return 1;
+}
+
+/* capture time SEI ------------------------------------------------------*/
+
+#define SEI_USER_DATA_UNREGISTERED 5
+#define SEI_CAPTURE_PAYLOAD        (16 + 8)   // UUID, time
+
+static const unsigned char capture_uuid[16] = {
+	0x72, 0x70, 0x69, 0x2D, 0x63, 0x61, 0x70, 0x74,   // "rpi-capt"
+	0x75, 0x72, 0x65, 0x2D, 0x74, 0x69, 0x6D, 0x65,   // "ure-time"
+};
+
+int h264_sei_capture_build(unsigned char *buf, int64_t us)
+{
+	unsigned char rbsp[2 + SEI_CAPTURE_PAYLOAD + 1];
+	int i, n = 0, zeros = 0;
+
+	rbsp[0] = SEI_USER_DATA_UNREGISTERED;
+	rbsp[1] = SEI_CAPTURE_PAYLOAD;
+	memcpy(rbsp + 2, capture_uuid, 16);
+	for(i = 0; i < 8; i++)
+		rbsp[18 + i] = (uint64_t)us >> (56 - 8 * i);
+	rbsp[26] = 0x80;                         // rbsp_trailing_bits
+
+	memcpy(buf, "\0\0\0\1", 4);
+	buf[4] = H264_NAL_SEI;
+	n = 5;
+	for(i = 0; i < (int)sizeof(rbsp); i++){
+		if(zeros == 2 && rbsp[i] <= 3){      // emulation prevention
+			buf[n++] = 3;
+			zeros = 0;
+		}
+		buf[n++] = rbsp[i];
+		zeros = rbsp[i] == 0 ? zeros + 1 : 0;
+	}
+	return n;
+}
+
+/* the SEI payload of a NAL (header on), emulation prevention removed */
+static int sei_capture_parse(const unsigned char *nal, int len, int64_t *us)
+{
+	unsigned char rbsp[64];
+	int i, n = 0, zeros = 0, type, size, pos;
+
+	for(i = 1; i < len && n < (int)sizeof(rbsp); i++){
+		if(zeros == 2 && nal[i] == 3){
+			zeros = 0;
+			continue;
+		}
+		rbsp[n++] = nal[i];
+		zeros = nal[i] == 0 ? zeros + 1 : 0;
+	}
+
+	/* sei_message()s: type and size as 0xFF runs */
+	for(pos = 0; pos < n && rbsp[pos] != 0x80; pos += size){
+		for(type = 0; pos < n && rbsp[pos] == 0xFF; pos++)
+			type += 255;
+		if(pos < n)
+			type += rbsp[pos++];
+		for(size = 0; pos < n && rbsp[pos] == 0xFF; pos++)
+			size += 255;
+		if(pos < n)
+			size += rbsp[pos++];
+		if(type == SEI_USER_DATA_UNREGISTERED && size >= SEI_CAPTURE_PAYLOAD &&
+		   pos + SEI_CAPTURE_PAYLOAD <= n && memcmp(rbsp + pos, capture_uuid, 16) == 0){
+			for(*us = 0, i = 0; i < 8; i++)
+				*us = (*us << 8) | rbsp[pos + 16 + i];
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int h264_sei_capture_find(const unsigned char *data, int len, int64_t *us)
+{
+	int i, type;
+
+	/* the NALs before the first slice */
+	for(i = 0; i + 3 < len; i++){
+		if(data[i] != 0 || data[i + 1] != 0 || data[i + 2] != 1)
+			continue;
+		i += 3;
+		type = data[i] & 0x1F;
+		if(type == H264_NAL_SLICE || type == H264_NAL_IDR)
+			return 0;
+		if(type == H264_NAL_SEI && sei_capture_parse(data + i, len - i, us))
+			return 1;
+	}
+	return 0;
+}
+
+int h264_sei_capture_insert(H264AU *au, int64_t us)
+{
+	unsigned char sei[H264_SEI_CAPTURE_SIZE];
+	int64_t old;
+	int i, off = au->len, n, type;
+
+	if(h264_sei_capture_find(au->data, au->len, &old))
+		return 0;
+	for(i = 0; i < au->nnal; i++){
+		type = au->nal[i].data[0] & 0x1F;
+		if(type == H264_NAL_SLICE || type == H264_NAL_IDR){
+			off = au->nal[i].data - 3 - au->data;
+			if(off > 0 && au->data[off - 1] == 0)
+				off--;
+			break;
+		}
+	}
+	n = h264_sei_capture_build(sei, us);
+	if(off == au->len || au->len + n > H264_MAX_AU_SIZE)
+		return 0;
+	memmove(au->data + off + n, au->data + off, au->len - off);
+	memcpy(au->data + off, sei, n);
+	au->len += n;
+	h264_parse_nals(au);
+	return 1;
+}
@@ -0,0 +1,98 @@
+#ifndef H264AU_H
+#define H264AU_H
+
+#include <stdint.h>
+
+/*--------------------------------------------------------------------------
+   H.264 Annex-B access unit reader
+
+   reads a raw H.264 byte stream (file, named pipe or stdin) and returns
+   one access unit (all NALs of one picture) at a time.
+
+   H264Video = {Delim NAL}*
+   Delim     = 0x00 0x00 (0x00) 0x01
+   an access unit ends where a NAL begins a new one: AUD, SPS, PPS, SEI
+   or a slice with first_mb_in_slice == 0 after the slices of the current.
+---------------------------------------------------------------------------*/
+
+#define H264_MAX_AU_SIZE  (1024*1024)  // IDR of 2K at 10 Mbit/s fits well
+#define H264_MAX_NALS     64           // NALs per access unit
+#define H264_MAX_PARAMS   512          // SPS and PPS, Annex-B
+#define H264_SEI_CAPTURE_SIZE  48      // capture time SEI, Annex-B, at most
+
+#define H264_NAL_SLICE 1
+#define H264_NAL_IDR   5
+#define H264_NAL_SEI   6
+#define H264_NAL_SPS   7
+#define H264_NAL_PPS   8
+#define H264_NAL_AUD   9
+
+typedef struct {
+	const unsigned char *data;   // NAL header onwards, no start code
+	int len;
+} H264Nal;
+
+typedef struct {
+	unsigned char *data;         // Annex-B, start codes included
+	int len;
+	int nnal;
+	H264Nal nal[H264_MAX_NALS];
+	int idr;                     // contains an IDR slice
+} H264AU;
+
+/* the newest parameter sets of the stream (SPS, PPS), Annex-B */
+typedef struct {
+	unsigned char data[H264_MAX_PARAMS];
+	int len;                     // 0: none seen yet
+} H264Params;
+
+typedef struct {
+	int fd;
+	int isfile;                  // regular file: can rewind, should be paced
+	unsigned char *buf;          // read buffer
+	int len;                     // valid bytes in buf
+	int scan;                    // next position to scan for a start code
+	int has_vcl;                 // slices seen in the current AU
+	int eof;
+} H264Reader;
+
+/* open a file, named pipe or "-" for stdin, 0 on success */
+int  h264_reader_open(H264Reader *rd, const char *path);
+void h264_reader_close(H264Reader *rd);
+/* regular file only: restart from the beginning, 0 on success */
+int  h264_reader_rewind(H264Reader *rd);
+
+int  h264_au_alloc(H264AU *au);
+void h264_au_free(H264AU *au);
+
+/* read the next access unit: 1 got one, 0 end of stream, -1 error */
+int  h264_read_au(H264Reader *rd, H264AU *au);
+
+/* split an Annex-B buffer into au->nal[], returns the number of NALs */
+int  h264_parse_nals(H264AU *au);
+
+/*
+ * parameter sets: an encoder may send them once at the start of the
+ * stream (rpi-camera-encode2 does), a decoder joining later needs them
+ * before its first IDR.
+ * update keeps those of au if it has an SPS; insert puts them in front
+ * of an IDR that has none, returns 1 if it did
+ */
+void h264_params_update(H264Params *ps, const H264AU *au);
+int  h264_params_insert(const H264Params *ps, H264AU *au);
+
+/*
+ * capture time: an SEI (user data unregistered, a UUID of our own) with
+ * the time the camera took the picture, us since the epoch (CLOCK_REALTIME
+ * of the camera's host), in front of the picture's slices. every stage
+ * after the encoder (streamer, network, decoder, display) can tell how
+ * old a frame is; other decoders skip it.
+ * build writes it (start code included) to buf, returns its length;
+ * find returns 1 and *us if the access unit in data has one;
+ * insert puts one in front of the slices of au if it has none, 1 if it did
+ */
+int  h264_sei_capture_build(unsigned char *buf, int64_t us);
+int  h264_sei_capture_find(const unsigned char *data, int len, int64_t *us);
+int  h264_sei_capture_insert(H264AU *au, int64_t us);
+
+#endif
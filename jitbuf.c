@@ -0,0 +1,135 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "jitbuf.h"
+#include "rtp264.h"
+
+#define SLOT(s)        ((s) & (JB_WIN - 1))
+#define NS_PER_TICK(t) ((long long)(t) * 100000 / 9)   // 90 kHz ticks to ns
+
+static inline int seqdiff(uint16_t a, uint16_t b)
+{
+	return (int16_t)(a - b);
+}
+
+static inline int present(const JitterBuf *jb, uint16_t s)
+{
+	return jb->len[SLOT(s)] > 0 && jb->sseq[SLOT(s)] == s;
+}
+
+int jb_init(JitterBuf *jb)
+{
+	memset(jb, 0, sizeof(*jb));
+	jb->pkt = malloc((size_t)JB_WIN * JB_MAX_PKT);
+	return jb->pkt ? 0 : -1;
+}
+
+void jb_free(JitterBuf *jb)
+{
+	free(jb->pkt);
+	jb->pkt = NULL;
+}
+
+void jb_restart(JitterBuf *jb)
+{
+	memset(jb->len, 0, sizeof(jb->len));
+	jb->started = 0;
+	jb->hole_ns = jb->last_arr = 0;
+}
+
+/* reorder depth from the jitter and the late packets */
+static void update_depth(JitterBuf *jb)
+{
+	long long d = JB_JITTER_K * jb->jitter_ns;
+
+	if(jb->late_ns > JB_DEPTH_MAX_MS * 1000000LL)
+		jb->late_ns = JB_DEPTH_MAX_MS * 1000000LL;
+	if(d < jb->late_ns)
+		d = jb->late_ns;
+	if(d > JB_DEPTH_MAX_MS * 1000000LL)
+		d = JB_DEPTH_MAX_MS * 1000000LL;
+	jb->depth_ns = d;
+}
+
+int jb_push(JitterBuf *jb, const unsigned char *pkt, int len, long long now)
+{
+	uint16_t s;
+
+	if(len < RTP_HDR_SIZE || len > JB_MAX_PKT || (pkt[0] >> 6) != 2)
+		return -1;
+	s = rtp_seq(pkt);
+
+	/* 1. jitter: J += (|D| - J) / 16, D the change of the transit time */
+	if(jb->last_arr){
+		long long dt = (now - jb->last_arr) - NS_PER_TICK((int32_t)(rtp_ts(pkt) - jb->last_ts));
+		jb->jitter_ns += ((dt < 0 ? -dt : dt) - jb->jitter_ns) / 16;
+	}
+	jb->last_arr = now;
+	jb->last_ts  = rtp_ts(pkt);
+	update_depth(jb);
+
+	/* 2. a jump further than the window: the stream starts again there */
+	if(jb->started && seqdiff(s, jb->next) >= JB_WIN)
+		jb->started = 0;
+	if(!jb->started){
+		jb->started = 1;
+		jb->next = s;
+		jb->high = s - 1;
+		jb->hole_ns = 0;
+	}
+
+	/* 3. behind the window, or a duplicate: the recovery sorts it out */
+	if(seqdiff(s, jb->next) < 0 || present(jb, s))
+		return 1;
+
+	/* 4. hold it */
+	if(seqdiff(s, jb->high) < 0)
+		jb->reordered++;
+	else
+		jb->high = s;
+	memcpy(jb->pkt + SLOT(s) * JB_MAX_PKT, pkt, len);
+	jb->len[SLOT(s)]  = len;
+	jb->sseq[SLOT(s)] = s;
+	return 0;
+}
+
+void jb_late(JitterBuf *jb)
+{
+	jb->late++;
+	jb->late_ns += jb->late_ns / 2 + 1000000;
+	update_depth(jb);
+}
+
+const unsigned char *jb_pop(JitterBuf *jb, int *len, long long now)
+{
+	uint16_t s;
+
+	while(jb->started && seqdiff(jb->high, jb->next) >= 0){
+		s = jb->next;
+		if(present(jb, s)){
+			jb->next++;
+			jb->hole_ns = 0;
+			jb->late_ns -= jb->late_ns >> 10;
+			*len = jb->len[SLOT(s)];
+			return jb->pkt + SLOT(s) * JB_MAX_PKT;
+		}
+
+		/* a hole with packets behind it: wait while it may be reordered */
+		if(jb->hole_ns == 0)
+			jb->hole_ns = now;
+		if(now - jb->hole_ns < jb->depth_ns)
+			return NULL;
+		jb->next++;                     // the hole goes on to the recovery
+	}
+	return NULL;
+}
+
+int jb_timeout(const JitterBuf *jb, long long now)
+{
+	long long t;
+
+	if(!jb->started || jb->hole_ns == 0 || seqdiff(jb->high, jb->next) < 0)
+		return -1;
+	t = jb->hole_ns + jb->depth_ns - now;
+	return t > 0 ? (int)((t + 999999) / 1000000) : 0;
+}
@@ -0,0 +1,70 @@
+#ifndef JITBUF_H
+#define JITBUF_H
+
+#include <stdint.h>
+
+/*--------------------------------------------------------------------------
+   jitter buffer of the player
+
+   RTP media packets go in as they arrive and come out in sequence order,
+   before loss recovery (fec.h): a packet is held behind a hole for the
+   reorder depth, a packet late by less takes its place again and is
+   never asked for (NACK) or repaired. then the hole goes on to the
+   recovery as one, and a packet that comes after that still goes on at
+   once (it may fill the hole there).
+
+   the depth follows the interarrival jitter (RFC 3550, 6.4.1),
+   JB_JITTER_K times it; a packet that comes even after the recovery
+   gave its hole up raises it (jb_late()), in-order packets let it decay
+   again. one that comes in time for the recovery does not: it may be a
+   retransmission. repair packets do not go through it.
+---------------------------------------------------------------------------*/
+
+#define JB_WIN          1024     // packets held at most, power of 2
+#define JB_MAX_PKT      2048
+#define JB_JITTER_K     3        // reorder depth over the jitter
+#define JB_DEPTH_MAX_MS 100      // reorder depth at most
+
+typedef struct {
+	unsigned char *pkt;          // JB_WIN slots of JB_MAX_PKT
+	int      len[JB_WIN];        // 0: empty
+	uint16_t sseq[JB_WIN];       // sequence number in the slot
+
+	int      started;
+	uint16_t next;               // next sequence number out
+	uint16_t high;               // highest sequence number in
+	long long hole_ns;           // a packet waits behind a hole since
+
+	long long jitter_ns;         // interarrival jitter estimate
+	long long depth_ns;          // reorder depth: holes wait that long
+	long long late_ns;           // .. raised by late packets, decays
+	long long last_arr;          // arrival and timestamp of the last packet
+	uint32_t last_ts;
+
+	unsigned long reordered;     // packets that took their place again
+	unsigned long late;          // came after the recovery gave their hole up
+} JitterBuf;
+
+int  jb_init(JitterBuf *jb);
+void jb_free(JitterBuf *jb);
+
+/* a new stream (another SSRC): empty it, keep the counters and the depth */
+void jb_restart(JitterBuf *jb);
+
+/*
+ * one media packet: 0 held, 1 to be passed on now (it came after its
+ * hole went on, or a duplicate), -1 if not valid
+ */
+int  jb_push(JitterBuf *jb, const unsigned char *pkt, int len, long long now);
+
+/* a packet passed on was too late for the recovery too: wait longer */
+void jb_late(JitterBuf *jb);
+
+/* next packet in sequence order, NULL if there is none or it waits behind
+   a hole; valid until the next jb_push() */
+const unsigned char *jb_pop(JitterBuf *jb, int *len, long long now);
+
+/* ms until a held packet may go on (call jb_pop() then), -1 if none */
+int  jb_timeout(const JitterBuf *jb, long long now);
+
+#endif
@@ -0,0 +1,249 @@
+/*
+ * adaptive bitrate controller against a simulated link
+ *
+ * rpi-abr-sim [-c kbps:secs,..] [-q queue KB] [-d delay ms] [-l loss%] [-x kbps]
+ *
+ * the encoder makes frames of its target bitrate (an IDR each 2 s), the
+ * streamer paces them out, the link is a bottleneck of the capacity
+ * profile (-c) with a drop-tail queue (-q), a propagation delay (-d) and
+ * random loss (-l); the player's receiver reports go back over the same
+ * delay to the controller, which sets the next frames' target (abr.h).
+ *
+ * prints each second: capacity, target, receive rate, loss, frame delay;
+ * at the end how many frames came whole and in time. -x runs the same
+ * link at a fixed bitrate for comparison.
+ */
+
+/* std headers   ---------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "abr.h"
+#include "rtp264.h"
+
+#define FPS          25
+#define GOP          50           // frames per IDR
+#define IDR_SCALE    3            // an IDR is that many times the average frame
+#define PACE         1.25         // pacing rate over the frame's bitrate (-H 25)
+#define PAYLOAD      (RTP_PKT_SIZE - RTP_HDR_SIZE - 2)
+#define LATE_MS      200          // a frame later than that is a stall
+#define MAX_INFLIGHT 65536        // packets on the link, power of 2
+#define MAX_SEGS     32
+#define MS           1000000LL
+
+typedef struct {
+	long long t_recv;
+	int frame, len;
+	uint16_t seq;
+	uint32_t ts;
+} SimPkt;
+
+typedef struct {
+	long long t_sent, t_done;
+	int npkts, nrecv;
+} SimFrame;
+
+static struct {
+	int kbps[MAX_SEGS];
+	long long end[MAX_SEGS];   // segment ends (ns)
+	int n;
+} gLink;
+
+static int link_kbps(long long t)
+{
+	int i;
+	for(i = 0; i < gLink.n - 1 && t >= gLink.end[i]; i++)
+		;
+	return gLink.kbps[i];
+}
+
+static int parse_profile(const char *spec)
+{
+	long long t = 0;
+	int kbps, secs, n;
+
+	gLink.n = 0;
+	while(gLink.n < MAX_SEGS && sscanf(spec, "%d:%d%n", &kbps, &secs, &n) == 2 && kbps > 0 && secs > 0){
+		t += secs * 1000 * MS;
+		gLink.kbps[gLink.n] = kbps;
+		gLink.end[gLink.n++] = t;
+		spec += n;
+		if(*spec != ',')
+			break;
+		spec++;
+	}
+	return gLink.n > 0 && *spec == '\0' ? 0 : -1;
+}
+
+static int cmp_ll(const void *a, const void *b)
+{
+	long long x = *(const long long *)a, y = *(const long long *)b;
+	return x < y ? -1 : x > y;
+}
+
+int main(int argc, char **argv)
+{
+	const char *profile = "6000:20,2000:20,800:20,4000:30";
+	int queue_kb = 100, delay_ms = 20, fixed_kbps = 0, opt;
+	double loss = 0;
+
+	AbrRx rx;
+	AbrCtl ctl;
+	RtcpReport rep, pend[16];
+	long long pend_t[16];
+	int npend = 0;
+	SimPkt *fly;
+	SimFrame *frm;
+	unsigned head = 0, tail = 0;
+	long long t, end, link_free = 0, next_frame = 0, *lat;
+	int nframes, f = 0, i, k, n, bytes, kbps;
+	uint16_t seq = 0;
+	double target, rate, sec_bytes = 0, sec_loss = 0, sec_sent = 0;
+	unsigned long sent = 0, dropped = 0, recv_bytes = 0, whole = 0, in_time = 0, nlat = 0;
+	double cap_bits = 0, last_delay = 0;
+	unsigned char hdr[RTP_HDR_SIZE];
+
+	while((opt = getopt(argc, argv, "c:q:d:l:x:")) != -1){
+		switch(opt){
+		case 'c': profile = optarg; break;
+		case 'q': queue_kb = atoi(optarg); break;
+		case 'd': delay_ms = atoi(optarg); break;
+		case 'l': loss = atof(optarg) / 100; break;
+		case 'x': fixed_kbps = atoi(optarg); break;
+		default:  argc = 0; break;
+		}
+	}
+	if(argc == 0 || parse_profile(profile) < 0){
+		fprintf(stderr, "usage: %s [-c kbps:secs,..] [-q queue KB] [-d delay ms] [-l loss%%] [-x kbps]\n", argv[0]);
+		fprintf(stderr, "  -c  link capacity profile (default %s)\n", "6000:20,2000:20,800:20,4000:30");
+		fprintf(stderr, "  -q  bottleneck queue (default 100 KB)\n");
+		fprintf(stderr, "  -d  one-way delay (default 20 ms)\n");
+		fprintf(stderr, "  -l  random loss in %% (default 0)\n");
+		fprintf(stderr, "  -x  fixed bitrate, no rate control\n");
+		return 1;
+	}
+
+	end = gLink.end[gLink.n - 1];
+	nframes = end / (1000 * MS / FPS) + 1;
+	fly = malloc(MAX_INFLIGHT * sizeof(SimPkt));
+	frm = calloc(nframes, sizeof(SimFrame));
+	lat = malloc(nframes * sizeof(long long));
+	abr_rx_init(&rx);
+	abr_init(&ctl, 250000, 10000000, fixed_kbps ? fixed_kbps * 1000.0 : 10000000);
+	target = ctl.target;
+	srand(1);
+	memset(hdr, 0, sizeof(hdr));
+	hdr[0] = 0x80;
+	hdr[1] = RTP_PT_H264;
+
+	printf("   s   link  target    recv  loss%%  delay ms  (kbit/s)\n");
+	for(t = 0; t < end; t += MS){
+
+		/* 1. packets that reached the player */
+		while(tail != head && fly[tail & (MAX_INFLIGHT - 1)].t_recv <= t){
+			SimPkt *p = &fly[tail++ & (MAX_INFLIGHT - 1)];
+			SimFrame *fr = &frm[p->frame];
+
+			hdr[2] = p->seq >> 8;
+			hdr[3] = p->seq;
+			hdr[4] = p->ts >> 24;
+			hdr[5] = p->ts >> 16;
+			hdr[6] = p->ts >> 8;
+			hdr[7] = p->ts;
+			abr_rx_packet(&rx, hdr, p->len, p->t_recv);
+			recv_bytes += p->len;
+			sec_bytes += p->len;
+			if(++fr->nrecv == fr->npkts){
+				fr->t_done = p->t_recv;
+				last_delay = (fr->t_done - fr->t_sent) / 1e6;
+			}
+		}
+
+		/* 2. reports, back to the sender after the delay */
+		if(abr_rx_report(&rx, t, 0, &rep) && npend < 16){
+			pend[npend] = rep;
+			pend_t[npend++] = t + delay_ms * MS;
+		}
+		while(npend > 0 && pend_t[0] <= t){
+			if(!fixed_kbps)
+				target = abr_update(&ctl, &pend[0], t);
+			memmove(pend, pend + 1, --npend * sizeof(pend[0]));
+			memmove(pend_t, pend_t + 1, npend * sizeof(pend_t[0]));
+		}
+
+		/* 3. the next frame at the target, paced onto the link */
+		if(t >= next_frame && f < nframes){
+			bytes = target / 8 / FPS;
+			bytes = f % GOP == 0 ? bytes * IDR_SCALE : bytes * (GOP - IDR_SCALE) / (GOP - 1);
+			bytes = bytes * (80 + rand() % 41) / 100;
+			n = (bytes + PAYLOAD - 1) / PAYLOAD;
+			rate = (double)bytes * 8 * FPS * PACE;
+			frm[f].t_sent = t;
+			frm[f].npkts = n;
+			for(i = 0; i < n; i++){
+				int len = RTP_HDR_SIZE + 2 + (i < n - 1 ? PAYLOAD : bytes - (n - 1) * PAYLOAD);
+				long long ts = t + (long long)(i * (double)RTP_PKT_SIZE * 8 / rate * 1e9), dep;
+
+				kbps = link_kbps(ts);
+				sent++;
+				sec_sent++;
+				seq++;
+				/* drop-tail queue, then random loss */
+				if(link_free > ts && (link_free - ts) / 1e9 * kbps * 125 + len > queue_kb * 1024){
+					dropped++;
+					sec_loss++;
+					continue;
+				}
+				dep = (link_free > ts ? link_free : ts) + (long long)(len * 8.0 / kbps * 1e6);
+				link_free = dep;
+				if(loss > 0 && rand() < loss * RAND_MAX){
+					dropped++;
+					sec_loss++;
+					continue;
+				}
+				if(head - tail == MAX_INFLIGHT)
+					continue;
+				k = head++ & (MAX_INFLIGHT - 1);
+				fly[k].t_recv = dep + delay_ms * MS;
+				fly[k].frame  = f;
+				fly[k].len    = len;
+				fly[k].seq    = seq - 1;
+				fly[k].ts     = (uint32_t)f * (RTP_CLOCK / FPS);
+			}
+			f++;
+			next_frame += 1000 * MS / FPS;
+		}
+
+		/* 4. each second */
+		cap_bits += link_kbps(t);            // bits in this ms
+		if((t / MS) % 1000 == 999){
+			printf("%4lld %6d %7.0f %7.0f %5.1f %9.0f  %s\n", t / MS / 1000 + 1, link_kbps(t),
+			       target / 1000, sec_bytes * 8 / 1000, sec_sent ? 100 * sec_loss / sec_sent : 0.0, last_delay,
+			       fixed_kbps ? "" : ctl.state == ABR_DECREASE ? "down" : ctl.state == ABR_INCREASE ? "up" : "hold");
+			sec_bytes = sec_loss = sec_sent = 0;
+		}
+	}
+
+	/* frames: whole, in time */
+	for(i = 0; i < f; i++){
+		if(frm[i].nrecv != frm[i].npkts)
+			continue;
+		whole++;
+		lat[nlat++] = frm[i].t_done - frm[i].t_sent;
+		if(frm[i].t_done - frm[i].t_sent <= LATE_MS * MS)
+			in_time++;
+	}
+	qsort(lat, nlat, sizeof(lat[0]), cmp_ll);
+	printf("%s: link used %.0f%%, packets lost %.2f%%, frames whole %.1f%%, in %d ms %.1f%%,"
+	       " frame delay median %.0f ms 95%% %.0f ms\n",
+	       fixed_kbps ? "fixed" : "adaptive", 100 * recv_bytes * 8 / cap_bits, 100.0 * dropped / sent,
+	       100.0 * whole / f, LATE_MS, 100.0 * in_time / f,
+	       nlat ? lat[nlat / 2] / 1e6 : 0.0, nlat ? lat[nlat * 95 / 100] / 1e6 : 0.0);
+
+	free(fly);
+	free(frm);
+	free(lat);
+	return 0;
+}
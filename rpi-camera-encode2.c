@@ -24,6 +24,13 @@
 #include <unistd.h>
 #include <errno.h>
 #include <time.h>  
+#include <stdint.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <poll.h>
 
 #include <bcm_host.h>
 
@@ -35,6 +42,10 @@
 #include <IL/OMX_Video.h>
 #include <IL/OMX_Broadcom.h>
 
+#include "spscq.h"
+#include "shmring.h"
+#include "h264au.h"
+
 // Hard coded parameters
 #define VIDEO_WIDTH                     1920
 #define VIDEO_HEIGHT                    1080
@@ -53,6 +64,7 @@
 #define CAM_IMAGE_FILTER                OMX_ImageFilterNoise    // OMX_IMAGEFILTERTYPE
 #define CAM_FLIP_HORIZONTAL             OMX_FALSE
 #define CAM_FLIP_VERTICAL               OMX_FALSE
+#define ENCODER_NBUFFERS                4                       // output buffers per encoder, <= SPSCQ_SIZE
 
 // Dunno where this is originally stolen from...
 #define OMX_INIT_STRUCTURE(a) \
@@ -67,6 +79,9 @@
 // Global variable used by the signal handler and capture/encoding loop
 static int want_quit = 0;
 
+// -s: a capture time SEI in front of each picture (h264au.h)
+static int capture_sei = 0;
+
 // Our application context passed around
 // the main routine and callback handlers
 typedef struct {
@@ -76,9 +91,12 @@ typedef struct {
     int camera_ready;
 
     // 1st encoder
+    // filled output buffers go from the OMX callback to the writer thread
+    // through a lock-free queue, the writer writes them out in place
     OMX_HANDLETYPE encoder;
-    OMX_BUFFERHEADERTYPE *encoder_ppBuffer_out;
-    int encoder_output_buffer_available;  // flag for non-tunelling output port, how about tunneling to file sink ?? 
+    OMX_BUFFERHEADERTYPE *encoder_ppBuffer_out[ENCODER_NBUFFERS];
+    int encoder_nbuffers;
+    SpscQ encoder_filled;
 
 #ifndef ORIGINAL
     OMX_HANDLETYPE video_splitter;   
@@ -86,8 +104,9 @@ typedef struct {
 
     // 2nd encoder
     OMX_HANDLETYPE encoder2;
-    OMX_BUFFERHEADERTYPE *encoder_ppBuffer_out2;
-    int encoder_output_buffer_available2;  // flag for non-tunelling output port, how about tunneling to file sink ?? 
+    OMX_BUFFERHEADERTYPE *encoder_ppBuffer_out2[ENCODER_NBUFFERS];
+    int encoder_nbuffers2;
+    SpscQ encoder_filled2;
    
     OMX_HANDLETYPE write_media;   
 #endif
@@ -95,8 +114,12 @@ typedef struct {
     OMX_HANDLETYPE null_sink;
 
     int flushed;
-    FILE *fd_out;
-    FILE *fd_out2;
+    int fd_out;                // -1: the output is a shared memory ring
+    int fd_out2;
+    FILE *idx_out, *idx_out2;  // file outputs: their index "<file>.idx"
+    ShmRing ring, ring2;       // outputs "shm:/name"
+    int evfd;                  // eventfd: a filled buffer is queued
+    int fd_ctl;                // control fifo ("bitrate <bit/s>", "idr" lines), -1: none
     VCOS_SEMAPHORE_T handler_lock;
 } appctx;
 
@@ -505,17 +528,19 @@ static OMX_ERRORTYPE fill_output_buffer_done_handler(
         OMX_PTR pAppData,
         OMX_BUFFERHEADERTYPE* pBuffer) {
     appctx *ctx = ((appctx*)pAppData);
-    vcos_semaphore_wait(&ctx->handler_lock);
-    // The main loop can now flush the buffer to output file
+    uint64_t one = 1;
+
+    // The writer thread can now flush the buffer to output file
+    // (no lock: the queue has one producer, this callback)
     if(hComponent == ctx->encoder)
-    		ctx->encoder_output_buffer_available = 1;
+    		spscq_push(&ctx->encoder_filled, pBuffer);
 #ifndef ORIGNAL
     else if(hComponent == ctx->encoder2)
-    		ctx->encoder_output_buffer_available2 = 1;
+    		spscq_push(&ctx->encoder_filled2, pBuffer);
 #endif
 
-
-    vcos_semaphore_post(&ctx->handler_lock);
+    if(write(ctx->evfd, &one, sizeof(one)) < 0)
+        logprint("Failed to wake up the writer: %s", strerror(errno));
     return OMX_ErrorNone;
 }
 
@@ -677,6 +702,15 @@ static int rpiomx_camera_setup(appctx *pctx, OMX_PARAM_PORTDEFINITIONTYPE *pcame
     if((r = OMX_SetConfig(pctx->camera, OMX_IndexConfigCommonMirror, &mirror)) != OMX_ErrorNone) {
         omx_die(r, "Failed to set mirror configuration for camera video output port 71");
     }
+
+    // Stamp the frames with the STC as is (the default may be 0), the encoders
+    // keep it in nTimeStamp: the capture time of each access unit
+    OMX_PARAM_TIMESTAMPMODETYPE timestamp_mode;
+    OMX_INIT_STRUCTURE(timestamp_mode);
+    timestamp_mode.eTimestampMode = OMX_TimestampModeRawStc;
+    if((r = OMX_SetParameter(pctx->camera, OMX_IndexParamCommonUseStcTimestamps, &timestamp_mode)) != OMX_ErrorNone) {
+        say("Failed to set STC timestamps for camera, capture times are arrival times: 0x%08x", r);
+    }
     return 0;
 }
 
@@ -777,6 +811,9 @@ static int rpiomx_encoder_setup(OMX_HANDLETYPE hcomp, OMX_PARAM_PORTDEFINITIONTY
     encoder_portdef.format.video.nStride      = pcamera_portdef->format.video.nStride;
     // Which one is effective, this or the configuration just below?
     encoder_portdef.format.video.nBitrate     = VIDEO_BITRATE;
+    // More than one output buffer: the encoder goes on while we write
+    if(encoder_portdef.nBufferCountMin < ENCODER_NBUFFERS)
+        encoder_portdef.nBufferCountActual = ENCODER_NBUFFERS;
     if((r = OMX_SetParameter(hcomp, OMX_IndexParamPortDefinition, &encoder_portdef)) != OMX_ErrorNone) {
         omx_die(r, "Failed to set port definition for encoder output port 201");
     }
@@ -826,6 +863,8 @@ static int rpiomx_encoder2_setup(OMX_HANDLETYPE hcomp, OMX_PARAM_PORTDEFINITIONT
     encoder_portdef.format.video.nStride      = 320; 
     // Which one is effective, this or the configuration just below?
     encoder_portdef.format.video.nBitrate     = VIDEO_BITRATE/20;
+    if(encoder_portdef.nBufferCountMin < ENCODER_NBUFFERS)
+        encoder_portdef.nBufferCountActual = ENCODER_NBUFFERS;
     if((r = OMX_SetParameter(hcomp, OMX_IndexParamPortDefinition, &encoder_portdef)) != OMX_ErrorNone) {
         omx_die(r, "Failed to set port definition for encoder output port 201");
     }
@@ -1087,8 +1126,13 @@ static int rpiomx_graph_ready(appctx *pctx)
     if((r = OMX_GetParameter(pctx->encoder2, OMX_IndexParamPortDefinition, &encoder_portdef)) != OMX_ErrorNone) {
         omx_die(r, "Failed to get port definition for encoder2 output port 201");
     }
-    if((r = OMX_AllocateBuffer(pctx->encoder2, &pctx->encoder_ppBuffer_out2, 201, NULL, encoder_portdef.nBufferSize)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to allocate buffer for encoder 2 output port 201");
+    pctx->encoder_nbuffers2 = encoder_portdef.nBufferCountActual;
+    if(pctx->encoder_nbuffers2 > ENCODER_NBUFFERS)
+        die("Encoder 2 wants %d output buffers, %d at most", pctx->encoder_nbuffers2, ENCODER_NBUFFERS);
+    for(int i = 0; i < pctx->encoder_nbuffers2; i++) {
+        if((r = OMX_AllocateBuffer(pctx->encoder2, &pctx->encoder_ppBuffer_out2[i], 201, NULL, encoder_portdef.nBufferSize)) != OMX_ErrorNone) {
+            omx_die(r, "Failed to allocate buffer for encoder 2 output port 201");
+        }
     }
 #endif
 
@@ -1098,8 +1142,13 @@ static int rpiomx_graph_ready(appctx *pctx)
     if((r = OMX_GetParameter(pctx->encoder, OMX_IndexParamPortDefinition, &encoder_portdef)) != OMX_ErrorNone) {
         omx_die(r, "Failed to get port definition for encoder output port 201");
     }
-    if((r = OMX_AllocateBuffer(pctx->encoder, &pctx->encoder_ppBuffer_out, 201, NULL, encoder_portdef.nBufferSize)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to allocate buffer for encoder output port 201");
+    pctx->encoder_nbuffers = encoder_portdef.nBufferCountActual;
+    if(pctx->encoder_nbuffers > ENCODER_NBUFFERS)
+        die("Encoder wants %d output buffers, %d at most", pctx->encoder_nbuffers, ENCODER_NBUFFERS);
+    for(int i = 0; i < pctx->encoder_nbuffers; i++) {
+        if((r = OMX_AllocateBuffer(pctx->encoder, &pctx->encoder_ppBuffer_out[i], 201, NULL, encoder_portdef.nBufferSize)) != OMX_ErrorNone) {
+            omx_die(r, "Failed to allocate buffer for encoder output port 201");
+        }
     }
 
     return 0;
@@ -1193,15 +1242,20 @@ static int rpiomx_graph_shutdown(appctx *pctx)
     }
 
     // ???
-    // 2. Return the last full buffer back to the encoder component
-    pctx->encoder_ppBuffer_out->nFlags = OMX_BUFFERFLAG_EOS;
-    if((r = OMX_FillThisBuffer(pctx->encoder, pctx->encoder_ppBuffer_out)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to request filling of the output buffer on encoder output port 201");
+    // 2. Return the full buffers not written (still queued) back to the encoder component
+    OMX_BUFFERHEADERTYPE *buf;
+    while((buf = spscq_pop(&pctx->encoder_filled)) != NULL) {
+        buf->nFlags = OMX_BUFFERFLAG_EOS;
+        if((r = OMX_FillThisBuffer(pctx->encoder, buf)) != OMX_ErrorNone) {
+            omx_die(r, "Failed to request filling of the output buffer on encoder output port 201");
+        }
     }
 #ifndef ORIGINAL
-    pctx->encoder_ppBuffer_out2->nFlags = OMX_BUFFERFLAG_EOS;
-    if((r = OMX_FillThisBuffer(pctx->encoder2, pctx->encoder_ppBuffer_out2)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to request filling of the output buffer on encoder output port 201");
+    while((buf = spscq_pop(&pctx->encoder_filled2)) != NULL) {
+        buf->nFlags = OMX_BUFFERFLAG_EOS;
+        if((r = OMX_FillThisBuffer(pctx->encoder2, buf)) != OMX_ErrorNone) {
+            omx_die(r, "Failed to request filling of the output buffer on encoder output port 201");
+        }
     }
 #endif
 
@@ -1388,12 +1442,16 @@ static int rpiomx_graph_teardown(appctx *pctx)
         omx_die(r, "Failed to free buffer for camera input port 73");
     }
 #ifndef ORIGINAL
-    if((r = OMX_FreeBuffer(pctx->encoder2, 201, pctx->encoder_ppBuffer_out2)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to free buffer for encoder output port 201");
+    for(int i = 0; i < pctx->encoder_nbuffers2; i++) {
+        if((r = OMX_FreeBuffer(pctx->encoder2, 201, pctx->encoder_ppBuffer_out2[i])) != OMX_ErrorNone) {
+            omx_die(r, "Failed to free buffer for encoder output port 201");
+        }
     }
 #endif
-    if((r = OMX_FreeBuffer(pctx->encoder, 201, pctx->encoder_ppBuffer_out)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to free buffer for encoder output port 201");
+    for(int i = 0; i < pctx->encoder_nbuffers; i++) {
+        if((r = OMX_FreeBuffer(pctx->encoder, 201, pctx->encoder_ppBuffer_out[i])) != OMX_ErrorNone) {
+            omx_die(r, "Failed to free buffer for encoder output port 201");
+        }
     }
 
     // 3. Transition all the components to idle and then to loaded states
@@ -1480,6 +1538,342 @@ static int rpiomx_graph_teardown(appctx *pctx)
 
 }
 
+/*-----------------------------------------
+   writer thread
+
+   takes the filled encoder output buffers from the queues and writes
+   them out in place (write(2) from the OMX buffer, no copy into stdio),
+   then hands them back to the encoder. sleeps on the eventfd between
+   buffers instead of polling.
+
+   on exit request it stops at a key frame boundary of each encoder and
+   leaves the rest in the queue for rpiomx_graph_shutdown()
+------------------------------------------*/
+typedef struct {
+    const char *name;
+    OMX_HANDLETYPE hcomp;
+    SpscQ *filled;
+    int fd;
+    ShmRing *ring;             // instead of fd
+    FILE *idx;                 // index of the file, NULL: none
+    int nframe;
+
+    // the access unit being written
+    int in_frame;
+    int64_t capture_us;
+    uint32_t frame_flags;
+    uint64_t offset, frame_offset;
+    int quit_detected, quit_in_keyframe;
+    int done;
+} encoder_output;
+
+static void write_all(int fd, const unsigned char *p, size_t len)
+{
+    while(len > 0) {
+        ssize_t n = write(fd, p, len);
+        if(n < 0) {
+            if(errno == EINTR)
+                continue;
+            die("Failed to write to output file: %s", strerror(errno));
+        }
+        p += n;
+        len -= n;
+    }
+}
+
+/*-----------------------------------------
+   an output "shm:/name" is a shared memory ring (shmring.h): each access
+   unit, put together from the encoder buffers up to END_OF_FRAME, is
+   copied once into it with its flags and capture time, and any number of
+   local readers (rpi-streamer <port> shm:/name, rpi-shmcat) take it from
+   there without a pipe or socket in between. anything else is a file;
+   a regular file gets an index next to it, "<file>.idx", a line per
+   access unit: offset, size, flags (K key, C codec config) and capture
+   time (us, CLOCK_REALTIME)
+------------------------------------------*/
+static int output_open(const char *path, ShmRing *ring, FILE **idx)
+{
+    char name[PATH_MAX];
+    struct stat st;
+    int fd;
+
+    *idx = NULL;
+    if(strncmp(path, "shm:", 4) == 0) {
+        if(shmring_create(ring, path + 4, SHMRING_SIZE, SHMRING_SLOTS) < 0)
+            die("Failed to create shared memory ring %s", path + 4);
+        return -1;
+    }
+    if((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+        die("Failed to open file %s: %s", path, strerror(errno));
+    if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        snprintf(name, sizeof(name), "%s.idx", path);
+        if((*idx = fopen(name, "w")) == NULL)
+            die("Failed to open index file %s: %s", name, strerror(errno));
+        fprintf(*idx, "# offset size flags capture_us\n");
+    }
+    return fd;
+}
+
+static int64_t ticks_us(OMX_TICKS t)
+{
+#ifdef OMX_SKIP64BIT
+    return ((int64_t)t.nHighPart << 32) | t.nLowPart;
+#else
+    return t;
+#endif
+}
+
+static int64_t realtime_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*-----------------------------------------
+   capture time of an access unit
+
+   nTimeStamp is the STC (us) of the camera frame, with no relation to
+   the wall clock: it is mapped to CLOCK_REALTIME (what other hosts can
+   compare with, NTP synced) by the smallest offset (arrival - STC) seen,
+   the frame that got through the encoder fastest, so the time spent in
+   the encoder does not count as capture. both encoders share the STC.
+   a frame stamped 0 (no STC) has its arrival time.
+------------------------------------------*/
+static int64_t capture_time(OMX_TICKS t)
+{
+    static int64_t offset;
+    static int have_offset = 0;
+    int64_t stc = ticks_us(t), now = realtime_us();
+
+    if(stc == 0)
+        return now;
+    if(!have_offset || now - stc < offset) {
+        offset = now - stc;
+        have_offset = 1;
+    }
+    return stc + offset;
+}
+
+static void ring_write(ShmRing *ring, OMX_BUFFERHEADERTYPE *buf, int64_t capture_us)
+{
+    uint32_t flags = 0;
+    unsigned long dropped = ring->dropped;
+
+    if(buf->nFlags & OMX_BUFFERFLAG_SYNCFRAME)
+        flags |= SHMRING_KEY;
+    if(buf->nFlags & OMX_BUFFERFLAG_CODECCONFIG)
+        flags |= SHMRING_CONFIG;
+    shmring_append(ring, buf->pBuffer + buf->nOffset, buf->nFilledLen, flags);
+    if(buf->nFlags & OMX_BUFFERFLAG_ENDOFFRAME) {
+        shmring_commit(ring, capture_us);
+        if(ring->dropped != dropped)
+            say("Access unit too large for the shared memory ring, dropped");
+    }
+}
+
+/* one encoder buffer to the output, the capture time SEI (-s) in front
+   of the first buffer of a picture, an index line after the last */
+static void output_write(encoder_output *out, OMX_BUFFERHEADERTYPE *buf)
+{
+    unsigned char sei[H264_SEI_CAPTURE_SIZE];
+    int nsei = 0;
+
+    if(!out->in_frame) {
+        out->in_frame = 1;
+        out->capture_us = capture_time(buf->nTimeStamp);
+        out->frame_flags = 0;
+        out->frame_offset = out->offset;
+        if(capture_sei && !(buf->nFlags & OMX_BUFFERFLAG_CODECCONFIG))
+            nsei = h264_sei_capture_build(sei, out->capture_us);
+    }
+    out->frame_flags |= buf->nFlags;
+
+    if(out->ring != NULL) {
+        if(nsei > 0)
+            shmring_append(out->ring, sei, nsei, 0);
+        ring_write(out->ring, buf, out->capture_us);
+    } else {
+        if(nsei > 0)
+            write_all(out->fd, sei, nsei);
+        write_all(out->fd, buf->pBuffer + buf->nOffset, buf->nFilledLen);
+    }
+    out->offset += nsei + buf->nFilledLen;
+
+    if(buf->nFlags & OMX_BUFFERFLAG_ENDOFFRAME) {
+        out->in_frame = 0;
+        if(out->idx != NULL)
+            fprintf(out->idx, "%llu %llu %s %lld\n",
+                    (unsigned long long)out->frame_offset,
+                    (unsigned long long)(out->offset - out->frame_offset),
+                    out->frame_flags & OMX_BUFFERFLAG_CODECCONFIG ? "C" :
+                    out->frame_flags & OMX_BUFFERFLAG_SYNCFRAME ? "K" : "-",
+                    (long long)out->capture_us);
+    }
+}
+
+static void drain_encoder_output(encoder_output *out)
+{
+    OMX_BUFFERHEADERTYPE *buf;
+    OMX_ERRORTYPE r;
+
+    while(!out->done && (buf = spscq_peek(out->filled)) != NULL) {
+
+        // Print a message if the user wants to quit, but don't exit
+        // the loop until we are certain that we have processed
+        // a full frame till end of the frame, i.e. we're at the end
+        // of the current key frame if processing one or until
+        // the next key frame is detected. This way we should always
+        // avoid corruption of the last encoded at the expense of
+        // small delay in exiting.
+        if(want_quit && !out->quit_detected) {
+            say("Exit signal detected, waiting for next key frame boundry before exiting...");
+            out->quit_detected = 1;
+            out->quit_in_keyframe = buf->nFlags & OMX_BUFFERFLAG_SYNCFRAME;
+        }
+        if(out->quit_detected && (out->quit_in_keyframe ^ (buf->nFlags & OMX_BUFFERFLAG_SYNCFRAME))) {
+            say("%s: Key frame boundry reached, exiting loop...", out->name);
+            out->done = 1;
+            break;
+        }
+
+        // Flush buffer to output file (or ring)
+        output_write(out, buf);
+        out->nframe++;
+
+        // Buffer flushed, request it to be filled again by the encoder component
+        spscq_pop(out->filled);
+        if((r = OMX_FillThisBuffer(out->hcomp, buf)) != OMX_ErrorNone) {
+            omx_die(r, "Failed to request filling of the output buffer on encoder output port 201");
+        }
+    }
+}
+
+/*-----------------------------------------
+   control fifo (3rd argument)
+
+   the streamer (rpi-streamer -E) writes one command per line;
+   "bitrate <bit/s>" (its rate control, -A) sets the target of encoder 1
+   at runtime (OMX_IndexConfigVideoBitrate), encoder 2 keeps its 1/20 of
+   it; "idr" (a player joined or lost sync) makes both encode the next
+   frame as an IDR (OMX_IndexConfigBrcmVideoRequestIFrame) instead of
+   waiting for the periodic one. the streamer rate limits the requests.
+   opened read-write: the fifo never reports end of file when the
+   streamer closes it or restarts.
+------------------------------------------*/
+static void encoder_set_bitrate(OMX_HANDLETYPE hcomp, OMX_U32 bps)
+{
+    OMX_ERRORTYPE r;
+    OMX_VIDEO_CONFIG_BITRATETYPE bitrate;
+    OMX_INIT_STRUCTURE(bitrate);
+    bitrate.nPortIndex = 201;
+    bitrate.nEncodeBitrate = bps;
+    if((r = OMX_SetConfig(hcomp, OMX_IndexConfigVideoBitrate, &bitrate)) != OMX_ErrorNone) {
+        say("Failed to set bitrate %u for encoder output port 201: 0x%08x", bps, r);
+    }
+}
+
+static void encoder_request_idr(OMX_HANDLETYPE hcomp)
+{
+    OMX_ERRORTYPE r;
+    OMX_CONFIG_PORTBOOLEANTYPE idr;
+    OMX_INIT_STRUCTURE(idr);
+    idr.nPortIndex = 201;
+    idr.bEnabled = OMX_TRUE;
+    if((r = OMX_SetConfig(hcomp, OMX_IndexConfigBrcmVideoRequestIFrame, &idr)) != OMX_ErrorNone) {
+        say("Failed to request an IDR on encoder output port 201: 0x%08x", r);
+    }
+}
+
+static void control_input(appctx *ctx)
+{
+    static char line[128];
+    static int len = 0;
+    char *nl;
+    long bps;
+    ssize_t n;
+
+    while((n = read(ctx->fd_ctl, line + len, sizeof(line) - 1 - len)) > 0) {
+        len += n;
+        line[len] = '\0';
+        while((nl = strchr(line, '\n')) != NULL) {
+            *nl = '\0';
+            if(sscanf(line, "bitrate %ld", &bps) == 1 && bps > 0) {
+                encoder_set_bitrate(ctx->encoder, bps);
+#ifndef ORIGINAL
+                encoder_set_bitrate(ctx->encoder2, bps / 20);
+#endif
+                say("Bitrate set to %ld kbit/s", bps / 1000);
+            } else if(strcmp(line, "idr") == 0) {
+                encoder_request_idr(ctx->encoder);
+#ifndef ORIGINAL
+                encoder_request_idr(ctx->encoder2);
+#endif
+            }
+            len -= nl + 1 - line;
+            memmove(line, nl + 1, len + 1);
+        }
+        if(len == sizeof(line) - 1)
+            len = 0;                    // no newline in sight: drop it
+    }
+}
+
+static void *output_writer(void *arg)
+{
+    appctx *ctx = (appctx *)arg;
+    encoder_output out[2] = {
+        { "encoder 1", ctx->encoder,  &ctx->encoder_filled,  ctx->fd_out,
+          ctx->fd_out < 0 ? &ctx->ring : NULL, ctx->idx_out },
+#ifndef ORIGINAL
+        { "encoder 2", ctx->encoder2, &ctx->encoder_filled2, ctx->fd_out2,
+          ctx->fd_out2 < 0 ? &ctx->ring2 : NULL, ctx->idx_out2 },
+#endif
+    };
+#ifndef ORIGINAL
+    int nout = 2;
+#else
+    int nout = 1;
+#endif
+    uint64_t cnt;
+    int i, ndone = 0;
+    struct pollfd pfd[2] = { { ctx->evfd, POLLIN }, { ctx->fd_ctl, POLLIN } };
+
+    struct timespec spec;
+    clock_gettime (CLOCK_MONOTONIC, &spec);
+    long now_in_ms = spec.tv_sec*1000 + spec.tv_nsec/1.0e6;
+    long elapsed_in_ms = 0;
+    int frame_per_sec = 0, last_nframe = 0;
+
+    while(ndone < nout) {
+        // wait for the callback, a control command (or a signal)
+        if(poll(pfd, ctx->fd_ctl < 0 ? 1 : 2, -1) < 0 && errno != EINTR)
+            die("Failed to wait for encoder output: %s", strerror(errno));
+        if(pfd[1].revents & POLLIN)
+            control_input(ctx);
+        if(!(pfd[0].revents & POLLIN))
+            continue;
+        if(read(ctx->evfd, &cnt, sizeof(cnt)) < 0 && errno != EINTR)
+            die("Failed to wait for encoder output: %s", strerror(errno));
+
+        for(i = 0, ndone = 0; i < nout; i++) {
+            drain_encoder_output(&out[i]);
+            ndone += out[i].done;
+        }
+
+        if(out[0].nframe != last_nframe) {
+            last_nframe = out[0].nframe;
+            if(last_nframe%10 == 0){
+    	       clock_gettime (CLOCK_MONOTONIC, &spec);
+               elapsed_in_ms = spec.tv_sec*1000 + spec.tv_nsec/1.0e6 - now_in_ms;
+	       frame_per_sec = last_nframe*1000/elapsed_in_ms; 
+            }
+            fprintf(stderr,"\rfn=%4d (%3d)", last_nframe, frame_per_sec);
+        }
+    }
+    say("Cleaning up...(%d, %d)", out[0].nframe, nout > 1 ? out[1].nframe : 0);
+    return NULL;
+}
+
 /*--------------------------------------------------------------------	/
 /  main ()                                                               	/
 /                                                                    	/ 
@@ -1493,11 +1887,24 @@ static int rpiomx_graph_teardown(appctx *pctx)
 int main(int argc, char **argv) 
 {
     OMX_ERRORTYPE r;
+    int opt;
 
-    if(argc < 3){
-	printf("usage: %s file1 file2\n", argv[0]);
+    while((opt = getopt(argc, argv, "s")) != -1) {
+        switch(opt) {
+        case 's': capture_sei = 1; break;
+        default:  argc = 0; break;
+        }
+    }
+    if(argc - optind < 2){
+	printf("usage: %s [-s] file1 file2 [control]\n", argv[0]);
+	printf("  -s: a capture time SEI in front of each picture, for latency from capture downstream\n");
+	printf("  file: or shm:/name, a shared memory ring for local readers (rpi-streamer <port> shm:/name)\n");
+	printf("        a file gets an index <file>.idx: offset, size, flags, capture time of each access unit\n");
+	printf("  control: fifo for runtime commands (\"bitrate <bit/s>\", \"idr\", rpi-streamer -E)\n");
 	return 0;
     }
+    argv += optind - 1;
+    argc -= optind - 1;
 
     // 0.1 system init
     bcm_host_init();
@@ -1514,6 +1921,18 @@ int main(int argc, char **argv)
     if(vcos_semaphore_create(&ctx.handler_lock, "handler_lock", 1) != VCOS_SUCCESS) {
         die("Failed to create handler lock semaphore");
     }
+    spscq_init(&ctx.encoder_filled);
+    spscq_init(&ctx.encoder_filled2);
+    if((ctx.evfd = eventfd(0, 0)) < 0) {
+        die("Failed to create eventfd: %s", strerror(errno));
+    }
+    ctx.fd_ctl = -1;
+    if(argc > 3) {
+        if(mkfifo(argv[3], 0644) < 0 && errno != EEXIST)
+            die("Failed to create control fifo %s: %s", argv[3], strerror(errno));
+        if((ctx.fd_ctl = open(argv[3], O_RDWR | O_NONBLOCK)) < 0)
+            die("Failed to open control fifo %s: %s", argv[3], strerror(errno));
+    }
 
     // 1.1 Init component handles
     OMX_CALLBACKTYPE callbacks;
@@ -1614,13 +2033,9 @@ int main(int argc, char **argv)
     // Just use stdout for output
     say("Opening output file...");
     //ctx.fd_out = stdout;
-    ctx.fd_out  = fopen(argv[1], "wb"); 
-    if(ctx.fd_out == NULL)
-	omx_die(r, "Failed to open file: %s", argv[1]); 
+    ctx.fd_out  = output_open(argv[1], &ctx.ring, &ctx.idx_out);
 #ifndef ORIGINAL
-    ctx.fd_out2  = fopen(argv[2], "wb"); 
-    if(ctx.fd_out2 == NULL)
-	omx_die(r, "Failed to open file: %s", argv[2]); 
+    ctx.fd_out2 = output_open(argv[2], &ctx.ring2, &ctx.idx_out2);
 #endif
 
     // 1.5 kick off the graph  
@@ -1659,129 +2074,30 @@ int main(int argc, char **argv)
 
     say("Enter capture and encode loop, press Ctrl-C to quit...");
 
-    int quit_detected = 0, quit_in_keyframe = 0, need_next_buffer_to_be_filled = 1;
-    int quit_detected2 = 0, quit_in_keyframe2 = 0, need_next_buffer_to_be_filled2 = 1;
-    size_t output_written;
-    //size_t output_written2;
-    int break_ready1 = 0, break_ready2 = 0;
-
     signal(SIGINT,  signal_handler);
     signal(SIGTERM, signal_handler);
     signal(SIGQUIT, signal_handler);
 
-    int nframe = 0;
-    int nframe2 = 0;
-
-    struct timespec spec;
-    clock_gettime (CLOCK_MONOTONIC, &spec);
-    long now_in_ms = spec.tv_sec*1000 + spec.tv_nsec/1.0e6;
-    long elapsed_in_ms = 0;
-    int frame_per_sec = 0;
-    //long end = now + 30000;
-
-    while(1) {
-
-
-	// encoder # 1
-        // fill_output_buffer_done_handler() has marked that there's
-        // a buffer for us to flush
-        if(ctx.encoder_output_buffer_available) {
-
-            // Print a message if the user wants to quit, but don't exit
-            // the loop until we are certain that we have processed
-            // a full frame till end of the frame, i.e. we're at the end
-            // of the current key frame if processing one or until
-            // the next key frame is detected. This way we should always
-            // avoid corruption of the last encoded at the expense of
-            // small delay in exiting.
-            if(want_quit && !quit_detected) {
-                say("Exit signal detected, waiting for next key frame boundry before exiting...");
-                quit_detected = 1;
-                quit_in_keyframe = ctx.encoder_ppBuffer_out->nFlags & OMX_BUFFERFLAG_SYNCFRAME;
-            }
-            if(quit_detected && (quit_in_keyframe ^ (ctx.encoder_ppBuffer_out->nFlags & OMX_BUFFERFLAG_SYNCFRAME))) {
-                say("encoder 1: Key frame boundry reached, exiting loop...");
-		break_ready1= 1;
-            	if(break_ready1 && break_ready2) {
-                   break;
-		}
-            }
-            // Flush buffer to output file
-            output_written = fwrite(ctx.encoder_ppBuffer_out->pBuffer + ctx.encoder_ppBuffer_out->nOffset, 1, ctx.encoder_ppBuffer_out->nFilledLen, ctx.fd_out);
-            if(output_written != ctx.encoder_ppBuffer_out->nFilledLen) {
-                die("Failed to write to output file: %s", strerror(errno));
-            }
-
-            //say("enc1: Read from output buffer and wrote to output file %d/%d", ctx.encoder_ppBuffer_out->nFilledLen, ctx.encoder_ppBuffer_out->nAllocLen);
-	    ++nframe;
-            //say("fn=%d",++nframe);
-            if(nframe%10 == 0){
-    	       clock_gettime (CLOCK_MONOTONIC, &spec);
-               elapsed_in_ms = spec.tv_sec*1000 + spec.tv_nsec/1.0e6 - now_in_ms;
-	       frame_per_sec = nframe*1000/elapsed_in_ms; 
-            }
-		
-            fprintf(stderr,"\rfn=%4d (%3d)", nframe, frame_per_sec);
-            need_next_buffer_to_be_filled = 1;
-        }
-        // Buffer flushed, request a new buffer to be filled by the encoder component
-        if(need_next_buffer_to_be_filled) {
-            need_next_buffer_to_be_filled = 0;
-            ctx.encoder_output_buffer_available = 0;
-            if((r = OMX_FillThisBuffer(ctx.encoder, ctx.encoder_ppBuffer_out)) != OMX_ErrorNone) {
-                omx_die(r, "Failed to request filling of the output buffer on encoder output port 201");
-            }
-        }
-
-	// encoder # 2
-        // fill_output_buffer_done_handler() has marked that there's
-        // a buffer for us to flush
-        if(ctx.encoder_output_buffer_available2) {
-
-            // Print a message if the user wants to quit, but don't exit
-            // the loop until we are certain that we have processed
-            // a full frame till end of the frame, i.e. we're at the end
-            // of the current key frame if processing one or until
-            // the next key frame is detected. This way we should always
-            // avoid corruption of the last encoded at the expense of
-            // small delay in exiting.
-            if(want_quit && !quit_detected2) {
-                say("Exit signal detected, waiting for next key frame boundry before exiting...");
-                quit_detected2 = 1;
-                quit_in_keyframe2 = ctx.encoder_ppBuffer_out2->nFlags & OMX_BUFFERFLAG_SYNCFRAME;
-            }
-            if(quit_detected2 && (quit_in_keyframe2 ^ (ctx.encoder_ppBuffer_out2->nFlags & OMX_BUFFERFLAG_SYNCFRAME))) {
-                say("encoder 2: Key frame boundry reached, exiting loop...");
-		break_ready2= 1;
-            	if(break_ready1 && break_ready2) {
-                   break;
-		}
-            }
-            // Flush buffer to output file
-            output_written = fwrite(ctx.encoder_ppBuffer_out2->pBuffer + ctx.encoder_ppBuffer_out2->nOffset, 1, ctx.encoder_ppBuffer_out2->nFilledLen, ctx.fd_out2);
-            if(output_written != ctx.encoder_ppBuffer_out2->nFilledLen) {
-                die("Failed to write to output file: %s", strerror(errno));
-            }
-
-            //say("enc2: Read from output buffer and wrote to output file %d/%d", ctx.encoder_ppBuffer_out2->nFilledLen, ctx.encoder_ppBuffer_out2->nAllocLen);
-            //say("fn2=%d",++nframe2);
-	    ++nframe2;
-            need_next_buffer_to_be_filled2 = 1;
+    // Hand all the output buffers to the encoders, the writer thread
+    // gets them back one by one through the queues
+    for(int i = 0; i < ctx.encoder_nbuffers; i++) {
+        if((r = OMX_FillThisBuffer(ctx.encoder, ctx.encoder_ppBuffer_out[i])) != OMX_ErrorNone) {
+            omx_die(r, "Failed to request filling of the output buffer on encoder output port 201");
         }
-        // Buffer flushed, request a new buffer to be filled by the encoder component
-        if(need_next_buffer_to_be_filled2) {
-            need_next_buffer_to_be_filled2 = 0;
-            ctx.encoder_output_buffer_available2 = 0;
-            if((r = OMX_FillThisBuffer(ctx.encoder2, ctx.encoder_ppBuffer_out2)) != OMX_ErrorNone) {
-                omx_die(r, "Failed to request filling of the output buffer on encoder output port 201");
-            }
+    }
+#ifndef ORIGINAL
+    for(int i = 0; i < ctx.encoder_nbuffers2; i++) {
+        if((r = OMX_FillThisBuffer(ctx.encoder2, ctx.encoder_ppBuffer_out2[i])) != OMX_ErrorNone) {
+            omx_die(r, "Failed to request filling of the output buffer on encoder output port 201");
         }
+    }
+#endif
 
-
-        // Would be better to use signaling here but hey this works too
-        usleep(1000);
+    pthread_t writer;
+    if(pthread_create(&writer, NULL, output_writer, &ctx) != 0) {
+        die("Failed to create the writer thread");
     }
-    say("Cleaning up...(%d, %d)", nframe, nframe2);
+    pthread_join(writer, NULL);
 
     // Restore signal handlers
     signal(SIGINT,  SIG_DFL);
@@ -1822,10 +2138,21 @@ int main(int argc, char **argv)
 #endif
 
     // 3.4 release all resources from system
-    fclose(ctx.fd_out);
+    if(ctx.fd_out >= 0)
+        close(ctx.fd_out);
+    if(ctx.idx_out != NULL)
+        fclose(ctx.idx_out);
+    shmring_close(&ctx.ring);
 #ifndef ORIGINAL
-    fclose(ctx.fd_out2);
+    if(ctx.fd_out2 >= 0)
+        close(ctx.fd_out2);
+    if(ctx.idx_out2 != NULL)
+        fclose(ctx.idx_out2);
+    shmring_close(&ctx.ring2);
 #endif
+    close(ctx.evfd);
+    if(ctx.fd_ctl >= 0)
+        close(ctx.fd_ctl);
 
     vcos_semaphore_delete(&ctx.handler_lock);
     if((r = OMX_Deinit()) != OMX_ErrorNone) {
@@ -0,0 +1,259 @@
+/*
+ * FEC kernels and schemes: throughput and recovery
+ *
+ * rpi-fec-bench [-F scheme] [-l loss%] [-b burst] [-f frames] [-p pkts/frame]
+ *
+ * 1. kernel throughput: XOR and GF(256) multiply-add, table and SIMD
+ * 2. per scheme (-F, or a set of them): encode and receive throughput on
+ *    frames of RTP-sized packets, with packets lost on the way (Gilbert
+ *    model: -l average loss, -b average burst length), and the loss left
+ *    after repair
+ *
+ * run it on the target to pick a scheme and its overhead for the link;
+ * on the RPi 2/3 build with -mfpu=neon, on x86 with -mssse3, else the
+ * plain table kernels are measured.
+ */
+
+/* std headers   ---------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "fec.h"
+
+#define PKT_SIZE     RTP_PKT_SIZE
+#define KERNEL_MB    256          // data through each kernel
+#define FRAME_NS     40000000LL   // link clock: a frame each 40 ms (RTP ts 3600)
+
+static long long now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static double mbps(double bytes, long long ns)
+{
+	return ns > 0 ? bytes / 1e6 / (ns / 1e9) : 0.0;
+}
+
+/*-------------------------------------------------------------------------
+  kernels
+--------------------------------------------------------------------------*/
+
+static void bench_kernels(void)
+{
+	unsigned char *src = malloc(PKT_SIZE), *dst = calloc(1, PKT_SIZE);
+	long i, n = (long)KERNEL_MB * 1000000 / PKT_SIZE;
+	long long t;
+
+	for(i = 0; i < PKT_SIZE; i++)
+		src[i] = rand();
+
+	printf("kernels, %d byte packets, %d MB each\n", PKT_SIZE, KERNEL_MB);
+
+	t = now_ns();
+	for(i = 0; i < n; i++)
+		fec_xor(dst, src, PKT_SIZE);
+	printf("  xor                %8.0f MB/s\n", mbps((double)n * PKT_SIZE, now_ns() - t));
+
+	t = now_ns();
+	for(i = 0; i < n; i++)
+		fec_gf_muladd_table(dst, src, 2 + (i % 250), PKT_SIZE);
+	printf("  gf muladd table    %8.0f MB/s\n", mbps((double)n * PKT_SIZE, now_ns() - t));
+
+	/* without SIMD it is the table kernel again */
+	if(strcmp(fec_gf_impl(), "table") != 0){
+		t = now_ns();
+		for(i = 0; i < n; i++)
+			fec_gf_muladd(dst, src, 2 + (i % 250), PKT_SIZE);
+		printf("  gf muladd %-8s %8.0f MB/s\n", fec_gf_impl(), mbps((double)n * PKT_SIZE, now_ns() - t));
+	}
+
+	free(src);
+	free(dst);
+}
+
+/*-------------------------------------------------------------------------
+  schemes
+--------------------------------------------------------------------------*/
+
+/* Gilbert model: good and bad (all lost) states, mean burst length burst */
+typedef struct {
+	double p_gb, p_bg;
+	int bad;
+} Channel;
+
+static void channel_init(Channel *ch, double loss, double burst)
+{
+	ch->p_bg = 1.0 / burst;
+	ch->p_gb = loss < 1.0 ? ch->p_bg * loss / (1.0 - loss) : 1.0;
+	ch->bad = 0;
+}
+
+static int channel_lost(Channel *ch)
+{
+	double u = rand() / (RAND_MAX + 1.0);
+
+	ch->bad = ch->bad ? u >= ch->p_bg : u < ch->p_gb;
+	return ch->bad;
+}
+
+static void put_rtp(unsigned char *p, uint16_t seq, uint32_t ts)
+{
+	p[0] = 0x80;
+	p[1] = RTP_PT_H264;
+	p[2] = seq >> 8;
+	p[3] = seq;
+	p[4] = ts >> 24;
+	p[5] = ts >> 16;
+	p[6] = ts >> 8;
+	p[7] = ts;
+	memset(p + 8, 0x5A, 4);
+}
+
+/* packets come out in order and as sent, 1 if not */
+static int check_pkt(const unsigned char *p, int len, int ppf, uint16_t *last)
+{
+	uint16_t s = rtp_seq(p);
+	int f = rtp_ts(p) / 3600, i = (uint16_t)(s - f * ppf), bad;
+
+	bad = (uint16_t)(s - *last) > 0x8000 || s == *last || i >= ppf ||
+	      p[len - 1] != (unsigned char)(f + i) ||
+	      (i < ppf - 1 && len != PKT_SIZE - FEC_OVERHEAD);
+	*last = s;
+	return bad;
+}
+
+static void bench_scheme(const char *spec, int frames, int ppf, double loss, double burst)
+{
+	FecConfig fc;
+	FecEncoder fe;
+	FecRx fr;
+	Channel ch;
+	RtpPkt *src, *out;
+	unsigned char *arena, *rep;
+	const unsigned char *p;
+	int f, i, n, len, nrep = 0, maxout;
+	unsigned long sent = 0, lost = 0, got = 0, bad = 0;
+	long long t, t_enc = 0, t_rx = 0, now;     // now: link clock, not the cpu's
+	uint16_t seq = 0, last = 0xFFFF;
+	double src_bytes = 0;
+
+	if(fec_parse(&fc, spec) < 0){
+		fprintf(stderr, "bad FEC scheme: %s\n", spec);
+		return;
+	}
+	fec_encoder_init(&fe, &fc);
+	if(fec_rx_init(&fr, 1000) < 0){
+		fprintf(stderr, "out of memory\n");
+		return;
+	}
+	channel_init(&ch, loss, burst);
+
+	maxout = ppf + fec_max_repair(&fc, ppf);
+	src   = malloc(ppf * sizeof(RtpPkt));
+	out   = malloc(maxout * sizeof(RtpPkt));
+	arena = malloc((size_t)ppf * (PKT_SIZE - FEC_OVERHEAD));
+	rep   = malloc((size_t)maxout * PKT_SIZE);
+
+	for(f = 0; f < frames; f++){
+		/* 1. a frame: full packets, a shorter last one */
+		for(i = 0; i < ppf; i++){
+			src[i].data = arena + i * (PKT_SIZE - FEC_OVERHEAD);
+			src[i].len  = i < ppf - 1 ? PKT_SIZE - FEC_OVERHEAD : RTP_HDR_SIZE + 1 + rand() % 1000;
+			put_rtp(src[i].data, seq++, f * 3600);
+			memset(src[i].data + RTP_HDR_SIZE, f + i, src[i].len - RTP_HDR_SIZE);
+			src_bytes += src[i].len;
+		}
+
+		/* 2. encode */
+		if(fc.scheme == FEC_NONE){
+			memcpy(out, src, ppf * sizeof(RtpPkt));
+			n = ppf;
+		}else{
+			t = now_ns();
+			n = fec_encode(&fe, src, ppf, rep, PKT_SIZE, out, maxout);
+			t_enc += now_ns() - t;
+		}
+		nrep += n - ppf;
+
+		/* 3. the link, the receiver */
+		t = now_ns();
+		for(i = 0; i < n; i++){
+			if(channel_lost(&ch)){
+				lost += (out[i].data[1] & 0x7F) != RTP_PT_FEC;
+				continue;
+			}
+			now = f * FRAME_NS + i * FRAME_NS / n;
+			fec_rx_push(&fr, out[i].data, out[i].len, now);
+			while((p = fec_rx_pop(&fr, &len, now)) != NULL){
+				bad += check_pkt(p, len, ppf, &last);
+				got++;
+			}
+		}
+		t_rx += now_ns() - t;
+		sent += ppf;
+	}
+	/* the end: give up what is still missing */
+	now = (long long)frames * FRAME_NS + 2000000000LL;
+	while((p = fec_rx_pop(&fr, &len, now)) != NULL){
+		bad += check_pkt(p, len, ppf, &last);
+		got++;
+	}
+
+	printf("  %-10s overhead %5.1f%%  encode %7.0f MB/s  receive %7.0f MB/s"
+	       "  lost %5.2f%% -> %5.2f%%  (%lu repaired)\n",
+	       spec, 100.0 * nrep / sent, mbps(src_bytes, t_enc), mbps(src_bytes, t_rx),
+	       100.0 * lost / sent, 100.0 * (sent - got) / sent, fr.recovered);
+	if(bad)
+		printf("  %-10s %lu packets out of order or corrupt\n", spec, bad);
+
+	fec_rx_free(&fr);
+	free(src);
+	free(out);
+	free(arena);
+	free(rep);
+}
+
+int main(int argc, char **argv)
+{
+	static const char *schemes[] = { "none", "row:10", "col:10:5", "2d:10:5", "rs:20:2", "rs:20:4", "rs:50:10", NULL };
+	const char *spec = NULL;
+	double loss = 2.0, burst = 2.0;
+	int frames = 2000, ppf = 40, opt, i;
+
+	while((opt = getopt(argc, argv, "F:l:b:f:p:")) != -1){
+		switch(opt){
+		case 'F': spec = optarg; break;
+		case 'l': loss = atof(optarg); break;
+		case 'b': burst = atof(optarg); break;
+		case 'f': frames = atoi(optarg); break;
+		case 'p': ppf = atoi(optarg); break;
+		default:
+			fprintf(stderr, "usage: %s [-F scheme] [-l loss%%] [-b burst] [-f frames] [-p pkts/frame]\n", argv[0]);
+			fprintf(stderr, "  -F  row:L col:L:D 2d:L:D rs:K:M or none (default: a set of them)\n");
+			fprintf(stderr, "  -l  average packet loss in %% (default 2)\n");
+			fprintf(stderr, "  -b  average loss burst in packets (default 2)\n");
+			return 1;
+		}
+	}
+	if(burst < 1.0)
+		burst = 1.0;
+	if(ppf < 1)
+		ppf = 1;
+
+	bench_kernels();
+
+	printf("schemes, %d frames of %d packets, loss %.1f%% in bursts of %.1f\n", frames, ppf, loss, burst);
+	if(spec)
+		bench_scheme(spec, frames, ppf, loss / 100, burst);
+	else
+		for(i = 0; schemes[i]; i++){
+			srand(1);
+			bench_scheme(schemes[i], frames, ppf, loss / 100, burst);
+		}
+	return 0;
+}
@@ -7,61 +7,684 @@
 #include <stdio.h>
 #include <unistd.h> /* close() */
 #include <string.h> /* memset() */
+#include <errno.h>
+#include <time.h>
 #include <pthread.h>
+#include <poll.h>
+#include <net/if.h> /* if_nametoindex() */
+
+#include "ff264dec.h"
+#include "view.h"
+#include "rtp264.h"
+#include "jitbuf.h"
+#include "fec.h"
+#include "rtcp.h"
+#include "abr.h"
+#include "ctlmsg.h"
 
 /*--------------------------------------------------------------------------
    DESC
 
 
-   TCP cli for controling (video) streaming start and end 
-   UDP cli for recieving  (video) data 
+   TCP cli for controling (video) streaming start and end
+   UDP cli for recieving  (video) data, or the same TCP connection where
+   udp is blocked (-t: 't' instead of 's', RTP packets framed as in
+   RFC 4571, no NACKs or reports: TCP loses nothing), or from a
+   multicast group the streamer sends to once for all (-M: joins it,
+   NACKs still go to the streamer, no reports)
 
-   main                 : listen socket 
-     |               
-   stream_control  	: tcp control socket 
-     | 
-   stream_loop          : udp stream (separate thread) 
+   main                 : display (newest decoded frame only)
+     |
+   stream_control  	: tcp control socket, commands from stdin and
+     |                    key frame requests of the decoder (thread)
+     |
+   stream_loop          : RTP/H.264 stream: jitter buffer, FEC repair,
+     |                    NACKs, receiver reports, assemble access
+     |                    units (thread)
+     |
+   decode_loop          : H.264 decoding (thread)
 
----------------------------------------------------------------------------*/ 
+
+   stream_loop --[AU queue, NAUQ]--> decode_loop --[newest frame]--> main
+
+   queues are small and bounded: when the decoder is behind, new access
+   units are dropped and decoding resumes at the next IDR, when the display
+   is behind, only the newest decoded frame is shown. waiting for an IDR,
+   at the start or after a loss, the decoder asks the streamer for one
+   ('k') rather than for the encoder's next periodic one, unless -K.
+
+   latency is reported from the first packet of an access unit to its
+   decoding and display, and from its capture too when the stream carries
+   the capture time (SEI, h264au.h; the clocks of camera and player
+   synced, NTP or PTP, or it is off by their difference).
+
+---------------------------------------------------------------------------*/
 /* GLOBAL -----------------------------------------------------------------*/
 
 
 /* STATIC -----------------------------------------------------------------*/
-static volatile int gStreamStopReq = 0;  // multitheaded  
+static volatile int gStreamStopReq = 0;  // multitheaded
+static int gNack = 1;                    // ask for lost packets again
+static int gKeyReq = 1;                  // ask for key frames
+static int gIdrPipe[2];                  // decode_loop -> stream_control: 'k'
+static volatile long long gStartTime;    // 's' sent
+static int gTcp = 0;                     // the stream over the control connection
+static int gTcpSock = -1;
+static volatile int gTcpOn = 0;          // 't' acked: the connection carries the stream
+static const char *gMcastGroup = NULL;   // -M group[:port]: the stream from a multicast group
+static const char *gMcastIf = NULL;      // -I interface to join on (name or address)
+static int gLayer = -1;                  // -l the streamer's layer to get, -1: its default
 
 #define LOCAL_SERVER_PORT  1500
-#define STREAM_CLIENT_PORT 1501   
+#define STREAM_CLIENT_PORT 1501
 #define MAX_MSG 100
- 
+
+#define MAX_PKT        2048           // udp datagram
+#define MAX_AU_SIZE    H264_MAX_AU_SIZE
+#define AU_PADDING     RTP_AU_PADDING // FF_INPUT_BUFFER_PADDING_SIZE
+#define NAUQ           4              // access units between recv and decoder
+#define MAX_VIEW_WIDTH 1280           // larger pictures are scaled down
+#define MAX_FRAME_SIZE (1920*1088*3/2)
+#define FEC_HOLD_MS    40             // packets wait for repairs at most (a frame)
+#define NACK_HOLD_MS   80             // .. for retransmissions (RTT + a frame)
+#define NACK_RETRY_MS  25             // a lost packet is asked for again after
+#define RECV_WAKE_MS   20             // stop request, NACK timers
+#define KEY_RETRY_MS   500            // a key frame is asked for again after
+#define TCP_RXBUF      (64*1024)      // -t: framed packets received, not yet taken
+#define SSRC_LATE_MS   200            // packets of the stream before a switch dropped for
+
 /* LOCAL ------------------------------------------------------------------*/
 
+static long long now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* the clock of capture times (us) */
+static long long realtime_us(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (long long)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/* access unit queue (stream_loop -> decode_loop) ------------------------*/
+typedef struct {
+  unsigned char *data;    // MAX_AU_SIZE + AU_PADDING
+  int len;
+  int idr;                // contains an IDR slice
+  long long t_recv;       // first byte received
+  long long t_cap;        // captured, on the clock of t_recv, 0: not known
+} AccessUnit;
+
+static struct {
+  AccessUnit au[NAUQ];
+  int rd, wr, count;
+  unsigned long dropped;  // AUs dropped: queue full or packets lost
+  pthread_mutex_t lock;
+  pthread_cond_t  cond;
+} gAUQ = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+/* newest decoded frame (decode_loop -> main), triple buffer mailbox ------*/
+typedef struct {
+  unsigned char *yuv;     // I420
+  int w, h;
+  long long t_recv, t_dec, t_cap;
+} Frame;
+
+static struct {
+  Frame frm[3];
+  int wr, ready, rd;      // owned by decoder, newest complete, owned by display
+  unsigned long seq;      // number of decoded frames
+  pthread_mutex_t lock;
+  pthread_cond_t  cond;
+} gFrame = { .wr = 0, .ready = 1, .rd = 2,
+             .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+/* the access unit being decoded, for the decoder callback */
+static AccessUnit *gDecAU = NULL;
+
+/* latency statistics (ms), reset every report --------------------------*/
+typedef struct {
+  unsigned long n;
+  double sum, max;
+} LatStat;
+
+static void lat_add(LatStat *ls, long long ns)
+{
+  double ms = ns / 1.0e6;
+  ls->n++;
+  ls->sum += ms;
+  if(ms > ls->max) ls->max = ms;
+}
+
+static void lat_print(const char *name, LatStat *ls)
+{
+  fprintf(stderr, " %s %.1f/%.1f", name, ls->n ? ls->sum / ls->n : 0.0, ls->max);
+  memset(ls, 0, sizeof(*ls));
+}
+
+
+/* queue a complete access unit, drop it when the decoder is behind
+   the buffer is not copied: *data (padded) goes to the queue and gets
+   the free slot's buffer back */
+static void au_push(unsigned char **data, int len, int idr, long long t_recv)
+{
+  AccessUnit *au;
+  unsigned char *tmp;
+  long long t_cap = 0;
+  int64_t us;
+
+  if(h264_sei_capture_find(*data, len, &us))
+    t_cap = now_ns() - (realtime_us() - us) * 1000;
+
+  pthread_mutex_lock(&gAUQ.lock);
+  if(gAUQ.count == NAUQ){
+     gAUQ.dropped++;
+     pthread_mutex_unlock(&gAUQ.lock);
+     return;
+  }
+  au = &gAUQ.au[gAUQ.wr];
+  tmp = au->data;
+  au->data = *data;
+  *data = tmp;
+  au->len = len;
+  au->idr = idr;
+  au->t_recv = t_recv;
+  au->t_cap = t_cap;
+  gAUQ.wr = (gAUQ.wr + 1) % NAUQ;
+  gAUQ.count++;
+  pthread_cond_signal(&gAUQ.cond);
+  pthread_mutex_unlock(&gAUQ.lock);
+}
+
+/* an access unit with lost packets: not decodable, the decoder waits for an IDR */
+static void au_drop(void)
+{
+  pthread_mutex_lock(&gAUQ.lock);
+  gAUQ.dropped++;
+  pthread_mutex_unlock(&gAUQ.lock);
+}
 
 
-/* UDP streamer ----------------------------------------------------------
+/* UDP receiver ----------------------------------------------------------
 
-   send UDP packets (now dummy data, later video)
-   IN:  arg (dest udp socket address)  
-   GLOBAL: use gStreamStopReq 
-   OUT: success or not  
+   receive RTP packets and assemble access units (marker bit ends one)
+   packets are put back in order by the jitter buffer (jitbuf.h): a
+   packet waits behind a hole for the reorder depth, which adapts to the
+   jitter seen; an access unit goes to the decoder with its last packet.
+   repair packets (if the streamer sends them, -F) rebuild lost packets
+   before they reach the depacketizer; lost packets are also asked for
+   again (RTCP NACK to the streamer's udp port) unless -N; a receiver
+   report (loss, receive rate, delay trend) goes there each
+   ABR_REPORT_MS for the streamer's rate control
+   with -t the packets come over the control connection, a 2 byte
+   length in front of each, into the same jitter buffer
+   IN:  arg: streamer's address
+   GLOBAL: use gStreamStopReq
+   OUT: success or not
 
 */
-   
+
+typedef struct {
+  uint32_t cur, old;           // SSRC of the stream, of the one before
+  long long t_new;             // cur since
+} SsrcTrack;
+
+/* an RTP packet's SSRC against the stream's: 0 the same, 1 a new stream
+   (the streamer switched layers), -1 a late packet of the one before
+   (after SSRC_LATE_MS it is a switch back) */
+static int ssrc_check(SsrcTrack *s, uint32_t ssrc, long long now)
+{
+  if(s->cur == ssrc)
+    return 0;
+  if(s->cur && ssrc == s->old && now - s->t_new < SSRC_LATE_MS * 1000000LL)
+    return -1;
+  s->old = s->cur;
+  s->cur = ssrc;
+  s->t_new = now;
+  return s->old != 0;
+}
+
+typedef struct {
+  unsigned char buf[TCP_RXBUF];
+  int off, len;                // unread: buf[off .. len)
+} TcpRx;
+
+static int tcp_ready(const TcpRx *t)
+{
+  return t->len - t->off >= 2 &&
+         t->len - t->off >= 2 + ((t->buf[t->off] << 8) | t->buf[t->off + 1]);
+}
+
+/* the next framed packet in pkt: its length, 0 if it is not complete
+   yet, -1 if the connection is gone */
+static int tcp_recv(TcpRx *t, int sock, unsigned char *pkt)
+{
+  int n, plen;
+
+  if(!tcp_ready(t)){
+    memmove(t->buf, t->buf + t->off, t->len - t->off);
+    t->len -= t->off;
+    t->off = 0;
+    n = recv(sock, t->buf + t->len, TCP_RXBUF - t->len, MSG_DONTWAIT);
+    if(n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR))
+      return -1;
+    if(n > 0)
+      t->len += n;
+    if(!tcp_ready(t))
+      return 0;
+  }
+  plen = (t->buf[t->off] << 8) | t->buf[t->off + 1];
+  if(plen > MAX_PKT)
+    return -1;
+  memcpy(pkt, t->buf + t->off + 2, plen);
+  t->off += 2 + plen;
+  return plen;
+}
+
+/* -M group[:port]: the group to join and the port to bind, 0 on success */
+static int mcast_parse(struct ip_mreqn *mreq, int *port)
+{
+  char group[64], *colon;
+
+  snprintf(group, sizeof(group), "%s", gMcastGroup);
+  if((colon = strchr(group, ':')) != NULL){
+    *colon = '\0';
+    *port = atoi(colon + 1);
+  }
+  memset(mreq, 0, sizeof(*mreq));
+  if(inet_aton(group, &mreq->imr_multiaddr) == 0 || !IN_MULTICAST(ntohl(mreq->imr_multiaddr.s_addr))){
+    fprintf(stderr, "Error: %s is no multicast group\n", group);
+    return -1;
+  }
+  if(gMcastIf && inet_aton(gMcastIf, &mreq->imr_address) == 0 &&
+     (mreq->imr_ifindex = if_nametoindex(gMcastIf)) == 0){
+    fprintf(stderr, "Error: no interface %s\n", gMcastIf);
+    return -1;
+  }
+  return 0;
+}
+
 static void *stream_loop(void *arg) {
-  
 
+  int sock, rc, n, len, timeout, one = 1, port = STREAM_CLIENT_PORT;
+  struct sockaddr_in servAddr;
+  struct ip_mreqn mreq;
+  struct pollfd pfd;
+  unsigned char pkt[MAX_PKT];
+  const unsigned char *p;
+  RtpDepacketizer rtp;
+  JitterBuf jb;
+  FecRx fec;
+  int qlen;
+  const unsigned char *q;
+  long long now, t_recv = 0;     // first packet of the access unit
+  struct sockaddr_in *srvaddr = (struct sockaddr_in *)arg;
+  unsigned char nack[RTCP_MAX_SIZE];
+  uint16_t lost[RTCP_MAX_NACK];
+  AbrRx abr;
+  RtcpReport rep;
+  uint32_t ssrc = rand(), media_ssrc = 0;
+  SsrcTrack media = { 0 }, repair = { 0 };
+  static TcpRx tcp;
+
+  if(rtp264_depacketizer_init(&rtp) < 0 || jb_init(&jb) < 0 ||
+     fec_rx_init(&fec, gNack ? NACK_HOLD_MS : FEC_HOLD_MS) < 0){
+    fprintf(stderr, "Error: cannot allocate assembly buffer\n");
+    pthread_exit((void *)-1);
+  }
+  fec.nack = gNack;
+  abr_rx_init(&abr);
+
+  /* 1. socket creation (-t: the control connection) */
+  sock = gTcp ? dup(gTcpSock) : socket(AF_INET, SOCK_DGRAM, 0);
+  if(sock<0) {
+    fprintf(stderr, "Error:cannot open udp socket (%d)\n", STREAM_CLIENT_PORT);
+    pthread_exit((void *)-1);
+  }
+
+  /* 2. bind local client port (-M: the group's, shared with other players here) */
+  if(gMcastGroup && (mcast_parse(&mreq, &port) < 0 ||
+                     setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0))
+    pthread_exit((void *)-1);
+  servAddr.sin_family = AF_INET;
+  servAddr.sin_addr.s_addr = htonl(INADDR_ANY);
+  servAddr.sin_port = htons(port);
+  rc = gTcp ? 0 : bind (sock, (struct sockaddr *) &servAddr,sizeof(servAddr));
+  if(rc<0) {
+    fprintf(stderr, "Error: cannot bind port number %d\n", port);
+    pthread_exit((void *)-1);
+  }
+  if(gMcastGroup && setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0){
+    fprintf(stderr, "Error: cannot join multicast group %s\n", gMcastGroup);
+    pthread_exit((void *)-1);
+  }
+
+  pfd.fd = sock;
+  pfd.events = POLLIN;
+
+  /* 3. receive loop */
+  while(gStreamStopReq != 1) {
+
+    /* wake up for a packet, a held packet due, or now and then */
+    now = now_ns();
+    timeout = fec_rx_timeout(&fec, now);
+    if((n = jb_timeout(&jb, now)) >= 0 && (timeout < 0 || n < timeout))
+      timeout = n;
+    if(timeout < 0 || timeout > RECV_WAKE_MS)
+      timeout = RECV_WAKE_MS;
+    n = 0;
+    if(gTcp && !gTcpOn)
+      poll(NULL, 0, timeout);   // the answer to 't' is not read here
+    else if(gTcp){
+      if(tcp_ready(&tcp) || poll(&pfd, 1, timeout) > 0)
+        n = tcp_recv(&tcp, sock, pkt);
+      if(n < 0){
+        fprintf(stderr, "STREAM> tcp stream closed\n");
+        break;
+      }
+    }else if(poll(&pfd, 1, timeout) > 0)
+      n = recv(sock, pkt, MAX_PKT, 0);
+    now = now_ns();
+
+    /* a new SSRC: another layer from its IDR on, the old one's packets
+       still in the window will never be complete */
+    if(n >= RTP_HDR_SIZE && (pkt[1] & 0x7F) == RTP_PT_FEC){
+      if(ssrc_check(&repair, rtp_ssrc(pkt), now) < 0)
+        n = 0;                  // late, of the stream before
+    }else if(n >= RTP_HDR_SIZE){
+      rc = ssrc_check(&media, rtp_ssrc(pkt), now);
+      if(rc < 0)
+        n = 0;
+      else if(rc > 0){
+        fprintf(stderr, "STREAM> new stream, SSRC %08x\n", media.cur);
+        jb_restart(&jb);
+        fec_rx_restart(&fec);
+        if(rtp.len)
+          au_drop();
+        rtp264_depacketizer_reset(&rtp);
+        rtp.have_seq = 0;
+        abr_rx_init(&abr);
+        media_ssrc = 0;
+      }
+    }
+    if(n > 0){
+      if(((pkt[1] & 0x7F) == RTP_PT_FEC || jb_push(&jb, pkt, n, now) != 0) &&
+         fec_rx_push(&fec, pkt, n, now) > 0)   // repair, late, duplicate
+        jb_late(&jb);
+      abr_rx_packet(&abr, pkt, n, now);
+    }
+    while((q = jb_pop(&jb, &qlen, now)) != NULL)
+      fec_rx_push(&fec, q, qlen, now);
+
+    /* 3.1 ask for the lost packets, report */
+    if(gNack && media_ssrc && (n = fec_rx_missing(&fec, lost, RTCP_MAX_NACK, now, NACK_RETRY_MS * 1000000LL)) > 0){
+      n = rtcp_nack_build(nack, ssrc, media_ssrc, lost, n);
+      sendto(sock, nack, n, 0, (struct sockaddr *)srvaddr, sizeof(*srvaddr));
+    }
+    if(!gTcp && !gMcastGroup && media_ssrc && abr_rx_report(&abr, now, jb.jitter_ns * RTP_CLOCK / 1000000000LL, &rep)){
+      n = rtcp_report_build(nack, ssrc, media_ssrc, &rep);
+      sendto(sock, nack, n, 0, (struct sockaddr *)srvaddr, sizeof(*srvaddr));
+    }
+
+    /* 3.2 media packets in order, lost ones repaired or given up */
+    while((p = fec_rx_pop(&fec, &len, now)) != NULL){
+      if(rtp.len == 0)
+        t_recv = now;
+      media_ssrc = rtp_ssrc(p);
+
+      rc = rtp264_depacketize(&rtp, p, len);
+      if(rc <= 0)
+        continue;
+
+      /* 3.3 complete access unit */
+      if(rtp.broken || rtp.len == 0)
+        au_drop();
+      else
+        au_push(&rtp.au, rtp.len, rtp.idr, t_recv);
+      rtp264_depacketizer_reset(&rtp);
+    }
+  }
+
+  /* 4. finish */
+  fprintf(stderr, "STREAM> %lu RTP packets, %lu lost %lu late %lu duplicate,"
+          " %lu reordered, jitter %.1f ms, reorder depth %.1f ms\n",
+          fec.received, rtp.lost, fec.late, fec.duplicates, jb.reordered,
+          jb.jitter_ns / 1e6, jb.depth_ns / 1e6);
+  if(fec.repairs)
+    fprintf(stderr, "FEC> %lu repair packets, %lu packets repaired, %lu not\n",
+            fec.repairs, fec.recovered, fec.unrecovered);
+  if(fec.nacked)
+    fprintf(stderr, "NACK> %lu packets asked for\n", fec.nacked);
+  close(sock);
+  fec_rx_free(&fec);
+  jb_free(&jb);
+  rtp264_depacketizer_free(&rtp);
+  pthread_exit((void *)0); // user-requested-stop
+}
+
+
+/* decoder ---------------------------------------------------------------
+
+   decode access units in its own thread, keep the newest picture
+*/
+
+/* called by H264DecoderDecode() for each decoded picture */
+static void on_decoded(unsigned char *y, unsigned char *u, unsigned char *v, int w, int h)
+{
+  Frame *f = &gFrame.frm[gFrame.wr];
+  int tmp;
+
+  if(w * h * 3 / 2 > MAX_FRAME_SIZE)
+     return;
+
+  memcpy(f->yuv, y, w*h);
+  memcpy(f->yuv + w*h, u, w*h/4);
+  memcpy(f->yuv + w*h*5/4, v, w*h/4);
+  f->w = w;
+  f->h = h;
+  f->t_recv = gDecAU->t_recv;
+  f->t_cap  = gDecAU->t_cap;
+  f->t_dec  = now_ns();
+
+  pthread_mutex_lock(&gFrame.lock);
+  tmp = gFrame.ready;
+  gFrame.ready = gFrame.wr;
+  gFrame.wr = tmp;
+  gFrame.seq++;
+  pthread_cond_signal(&gFrame.cond);
+  pthread_mutex_unlock(&gFrame.lock);
+}
+
+/* waiting for an IDR: ask for one now and then (KEY_RETRY_MS) */
+static void key_request(long long *t_asked)
+{
+  long long now = now_ns();
+
+  if(!gKeyReq || now - *t_asked < KEY_RETRY_MS * 1000000LL)
+    return;
+  *t_asked = now;
+  if(write(gIdrPipe[1], "k", 1) != 1)
+    *t_asked = 0;       // ask again with the next access unit
+}
+
+static void *decode_loop(void *arg)
+{
+  struct timespec ts;
+  int need_idr = 1;     // decoding starts (and restarts after loss) at an IDR
+  unsigned long dropped = 0;
+  long long t_need = 0;         // decoding stopped, 0: at the start
+  long long t_asked = 0;        // key frame last asked for
+
+  H264DecoderInit();
+
+  while(gStreamStopReq != 1){
+
+    /* 1. wait for an access unit */
+    pthread_mutex_lock(&gAUQ.lock);
+    while(gAUQ.count == 0 && gStreamStopReq != 1){
+      clock_gettime(CLOCK_REALTIME, &ts);
+      ts.tv_nsec += 100000000L;
+      if(ts.tv_nsec >= 1000000000L){ ts.tv_sec++; ts.tv_nsec -= 1000000000L; }
+      pthread_cond_timedwait(&gAUQ.cond, &gAUQ.lock, &ts);
+    }
+    if(gAUQ.count == 0){
+      pthread_mutex_unlock(&gAUQ.lock);
+      break;
+    }
+    if(gAUQ.dropped != dropped){  // lost a reference, wait for the next IDR
+      dropped = gAUQ.dropped;
+      if(!need_idr)
+        t_need = now_ns();
+      need_idr = 1;
+    }
+    gDecAU = &gAUQ.au[gAUQ.rd];
+    pthread_mutex_unlock(&gAUQ.lock);
+
+    /* 2. decode (the queue slot stays ours until released); the time
+          decoding stood still is the time to the first frame */
+    if(need_idr && gDecAU->idr){
+      need_idr = 0;
+      if(t_need == 0)
+        fprintf(stderr, "\nPLAY> first frame %.0f ms after start\n",
+                (now_ns() - gStartTime) / 1e6);
+      else
+        fprintf(stderr, "\nPLAY> decoding again %.0f ms after a loss\n",
+                (now_ns() - t_need) / 1e6);
+    }else if(need_idr)
+      key_request(&t_asked);
+    if(!need_idr)
+      H264DecoderDecode(gDecAU->data, gDecAU->len, false, on_decoded);
+
+    /* 3. release the slot */
+    pthread_mutex_lock(&gAUQ.lock);
+    gAUQ.rd = (gAUQ.rd + 1) % NAUQ;
+    gAUQ.count--;
+    pthread_mutex_unlock(&gAUQ.lock);
+  }
+
+  H264DecoderClose();
+  return NULL;
 }
 
-/* stream control module ----------------------------------------------- 
+
+/* stream control module -----------------------------------------------
    control via TCP connection (to reliable communicaiton and detect connection loss)
-   command : start streaming and stop
-   response: ack and nack 
+   command : start streaming and stop (read from stdin, the first character
+             of a line), key frame ('k', also from the decoder), a digit
+             the streamer's layer (CTL_LAYER message, -l before 's')
+   response: ack and nack
+   one command at a time, so each response is the one of the command sent
 */
+
+/* send one command, returns the response or -1 if the connection is gone */
+static int send_command(int sock, char cmd)
+{
+    char txbuf[1], rxbuf[1];
+
+    // 1. send the one byte command ('t': start over this connection)
+    txbuf[0] = (cmd == 's' && gTcp) ? 't' : cmd;
+    if(cmd == 's')
+        gStartTime = now_ns();
+    if(write(sock, txbuf, 1) != 1){
+        fprintf(stderr, "write error: connection closed\n");
+        return -1;
+    }
+    if(gTcpOn)
+        return 'a';       // the connection carries the stream, no answers
+
+    // 2. wait for ack or nack
+    if(recv(sock, rxbuf, 1, 0) <= 0){
+        fprintf(stderr, "read error: connection closed\n");
+        return -1;
+    }
+    fprintf(stdout, "CNTL> '%c' %s\n", txbuf[0], rxbuf[0] == 'a' ? "ack" : "nack");
+    if(txbuf[0] == 't' && rxbuf[0] == 'a')
+        gTcpOn = 1;
+    return rxbuf[0];
+}
+
+/* pick layer (ctlmsg.h): the answer is a message, 'a' or 'n' */
+static int send_layer(int sock, int layer)
+{
+    unsigned char txbuf[CTL_HDR_SIZE + 1], rxbuf[CTL_HDR_SIZE];
+    const unsigned char *payload;
+    int len, type, plen;
+
+    txbuf[CTL_HDR_SIZE] = layer;
+    len = ctl_msg_build(txbuf, CTL_LAYER, txbuf + CTL_HDR_SIZE, 1);
+    if(write(sock, txbuf, len) != len){
+        fprintf(stderr, "write error: connection closed\n");
+        return -1;
+    }
+    if(gTcpOn)
+        return 'a';       // the connection carries the stream, no answers
+    if(recv(sock, rxbuf, sizeof(rxbuf), MSG_WAITALL) != sizeof(rxbuf) ||
+       ctl_msg_parse(rxbuf, sizeof(rxbuf), &type, &payload, &plen) != sizeof(rxbuf)){
+        fprintf(stderr, "read error: connection closed\n");
+        return -1;
+    }
+    fprintf(stdout, "CNTL> layer %d %s\n", layer, type == 'a' ? "ack" : "nack");
+    return type;
+}
+
 static int stream_control(int sock) //, struct sockaddr_in *pCliAddr)
 {
+    struct pollfd pfd[2];
+    char buf[128], cmd = 0;
+    int n, i, rsp, bol = 1;    // at the beginning of a line
+
+    pfd[0].fd = 0;             // stdin
+    pfd[0].events = POLLIN;
+    pfd[1].fd = gIdrPipe[0];
+    pfd[1].events = POLLIN;
+    if(gLayer >= 0 && send_layer(sock, gLayer) < 0){
+        gStreamStopReq = 1;
+        return 0;
+    }
+
+    while(1){
+        if(poll(pfd, 2, -1) < 0){
+            if(errno == EINTR)
+                continue;
+            break;
+        }
+
+        // 1. key frame for the decoder
+        if(pfd[1].revents & POLLIN){
+            if(read(gIdrPipe[0], &cmd, 1) == 1 && send_command(sock, cmd) < 0)
+                break;
+        }
+
+        // 2. commands from stdin, a line each
+        if(pfd[0].revents & (POLLIN | POLLHUP)){
+            n = read(0, buf, sizeof(buf));
+            if(n <= 0)
+                break;
+            for(i = 0, rsp = 0; i < n && rsp >= 0; i++){
+                if(bol && buf[i] >= '0' && buf[i] <= '9')
+                    rsp = send_layer(sock, buf[i] - '0');
+                else if(bol && buf[i] != '\n')
+                    rsp = send_command(sock, cmd = buf[i]);
+                bol = buf[i] == '\n';
+            }
+            if(rsp < 0 || (cmd == 'c' && rsp == 'a'))
+                break;     // connection lost or normal finish
+        }
+    }
 
+    gStreamStopReq = 1;
     return 0;
 }
 
+static void *control_thread(void *arg)
+{
+    stream_control(*(int *)arg);
+    return NULL;
+}
 
 
 /*
@@ -72,35 +695,216 @@ static int stream_control(int sock) //, struct sockaddr_in *pCliAddr)
  */
 int open_clientfd(char *hostname, int port)
 {
+    int clientfd;
+    struct hostent *hp;
+    struct sockaddr_in serveraddr;
+
+    if ((clientfd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+        return -1; /* check errno for cause of error */
+
+    /* Fill in the server's IP address and port */
+    if ((hp = gethostbyname(hostname)) == NULL){
+        close(clientfd);
+        return -2; /* check h_errno for cause of error */
+    }
+    memset(&serveraddr, 0, sizeof(serveraddr));
+    serveraddr.sin_family = AF_INET;
+    memcpy(&serveraddr.sin_addr.s_addr, hp->h_addr_list[0], hp->h_length);
+    serveraddr.sin_port = htons(port);
+
+    /* Establish a connection with the server */
+    if (connect(clientfd, (struct sockaddr *) &serveraddr, sizeof(serveraddr)) < 0){
+        close(clientfd);
+        return -1;
+    }
     return clientfd;
 }
 
 /* $end open_clientfd */
 
 
-/* main 
+/* display ---------------------------------------------------------------
 
-   main thread for control (tcp) server 
-   command from client: 0x1 for start 0x0 for stop
-   respnse to  client:  0x1 for ack   0x0 for nack (not used) 
+   show the newest decoded frame as soon as it is there, print latency
+   every second:  recv->decoded, recv->displayed (avg/max ms)
+*/
+static void display_loop(void)
+{
+  Viewer *pV = NULL;
+  Image  *pI = NULL;
+  int sw = 0, sh = 0;      // stream resolution
+  int vw = 0, vh = 0, tmp; // window
+  unsigned long lastseq = 0, shown = 0, skipped = 0;
+  long long t_report = now_ns(), t_disp;
+  LatStat ldec = {0}, ldisp = {0};
+  LatStat lcrecv = {0}, lcdec = {0}, lcdisp = {0};   // from capture
+  struct timespec ts;
+  SDL_Event ev;
+  Frame *f;
+
+  viewsys_init();
+
+  while(gStreamStopReq != 1){
+
+    /* 1. wait for a newer frame */
+    pthread_mutex_lock(&gFrame.lock);
+    if(gFrame.seq == lastseq){
+      clock_gettime(CLOCK_REALTIME, &ts);
+      ts.tv_nsec += 20000000L;
+      if(ts.tv_nsec >= 1000000000L){ ts.tv_sec++; ts.tv_nsec -= 1000000000L; }
+      pthread_cond_timedwait(&gFrame.cond, &gFrame.lock, &ts);
+    }
+    f = NULL;
+    if(gFrame.seq != lastseq){
+      skipped += gFrame.seq - lastseq - 1;   // never shown, a newer one came
+      lastseq = gFrame.seq;
+      tmp = gFrame.rd;
+      gFrame.rd = gFrame.ready;
+      gFrame.ready = tmp;
+      f = &gFrame.frm[gFrame.rd];
+    }
+    pthread_mutex_unlock(&gFrame.lock);
+
+    while(SDL_PollEvent(&ev))
+      if(ev.type == SDL_QUIT)
+        gStreamStopReq = 1;
+
+    /* 2. (re)open the window for the stream resolution, then show */
+    if(f){
+      if(pV == NULL || f->w != sw || f->h != sh){
+        sw = vw = f->w;
+        sh = vh = f->h;
+        while(vw > MAX_VIEW_WIDTH){ vw /= 2; vh /= 2; }
+        if(pI) imgDestroy(pI);
+        if(pV) view_close(pV);
+        pV = view_open(vw, vh, "rpi-player");
+        pI = imgNew(vw, vh);
+        if(pV == NULL || pI == NULL){
+          gStreamStopReq = 1;
+          break;
+        }
+      }
+      convertYUV2RGBRect(f->yuv, f->yuv + f->w*f->h, f->yuv + f->w*f->h*5/4,
+                         f->w, f->h, pI, 0, 0, vw, vh);
+      view_disp_image(pV, pI);
+      t_disp = now_ns();
+      shown++;
+      lat_add(&ldec,  f->t_dec - f->t_recv);
+      lat_add(&ldisp, t_disp - f->t_recv);
+      if(f->t_cap){
+        lat_add(&lcrecv, f->t_recv - f->t_cap);
+        lat_add(&lcdec,  f->t_dec - f->t_cap);
+        lat_add(&lcdisp, t_disp - f->t_cap);
+      }
+    }
+
+    /* 3. latency report */
+    if(now_ns() - t_report >= 1000000000LL){
+      t_report = now_ns();
+      fprintf(stderr, "\rPLAY> shown %lu skipped %lu dropped AU %lu, ms recv->",
+              shown, skipped, gAUQ.dropped);
+      lat_print("dec", &ldec);
+      lat_print("disp", &ldisp);
+      if(lcrecv.n){
+        fprintf(stderr, ", capture->");
+        lat_print("recv", &lcrecv);
+        lat_print("dec", &lcdec);
+        lat_print("disp", &lcdisp);
+      }
+    }
+  }
+  fprintf(stderr, "\n");
+
+  if(pI) imgDestroy(pI);
+  if(pV) view_close(pV);
+  viewsys_quit();
+}
+
+
+/* main
+
+   main thread for display
+   command to server  : 's' for start 'c' for stop 'k' for a key frame
+   respnse from server: 'a' for ack   'n' for nack
 */
 int main(int argc, char **argv)
 {
-    int clientfd, port;
+    int clientfd, port, i, opt;
     char *host;
-
-    if (argc != 3) {
-        fprintf(stderr, "usage: %s <host> <port>\n", argv[0]);
+    pthread_t rx_tid, dec_tid, ctl_tid;
+    struct sockaddr_in srvaddr;
+    socklen_t srvlen = sizeof(srvaddr);
+
+    while ((opt = getopt(argc, argv, "NKtM:I:l:")) != -1) {
+        switch (opt) {
+        case 'N': gNack = 0; break;
+        case 't': gTcp = 1; gNack = 0; break;
+        case 'K': gKeyReq = 0; break;
+        case 'M': gMcastGroup = optarg; break;
+        case 'I': gMcastIf = optarg; break;
+        case 'l': gLayer = atoi(optarg); break;
+        default:  argc = 0; break;
+        }
+    }
+    if (gTcp && gMcastGroup) {
+        fprintf(stderr, "Error: -t or -M, not both\n");
+        argc = 0;
+    }
+    if (argc - optind != 2) {
+        fprintf(stderr, "usage: %s [-N] [-K] [-t] [-l layer] [-M group[:port] [-I interface]] <host> <port>\n", argv[0]);
+        fprintf(stderr, "  -N  do not ask for lost packets again (NACK)\n");
+        fprintf(stderr, "  -K  do not ask for key frames, wait for the periodic ones\n");
+        fprintf(stderr, "  -t  the stream over the tcp control connection (udp blocked)\n");
+        fprintf(stderr, "  -l  the streamer's layer (its sources, 0 ..), a digit line switches\n");
+        fprintf(stderr, "  -M  join the multicast group the streamer sends to (its -M)\n");
+        fprintf(stderr, "  -I  interface to join on, name or address (default: the route's)\n");
         exit(0);
     }
-    host = argv[1];
-    port = atoi(argv[2]);
+    host = argv[optind];
+    port = atoi(argv[optind + 1]);
 
     clientfd = open_clientfd(host, port);
+    if(clientfd < 0){
+        fprintf(stderr, "Cannot connect to %s:%d\n", host, port);
+        exit(1);
+    }
+    gTcpSock = clientfd;
+    /* NACKs go to the streamer's udp port */
+    getpeername(clientfd, (struct sockaddr *)&srvaddr, &srvlen);
+    srvaddr.sin_port = htons(LOCAL_SERVER_PORT);
+
+    if(pipe(gIdrPipe) < 0){
+        fprintf(stderr, "Cannot create pipe\n");
+        exit(1);
+    }
 
-    fprintf(stdout, "command: 's' for start streaming, 'c' close streaming\n"); 
+    /* preallocated buffers for the bounded queues */
+    for(i = 0; i < NAUQ; i++){
+        gAUQ.au[i].data = malloc(MAX_AU_SIZE + AU_PADDING);
+        if(gAUQ.au[i].data == NULL){
+            fprintf(stderr, "Cannot allocate access unit buffers\n");
+            exit(1);
+        }
+    }
+    for(i = 0; i < 3; i++){
+        gFrame.frm[i].yuv = malloc(MAX_FRAME_SIZE);
+        if(gFrame.frm[i].yuv == NULL){
+            fprintf(stderr, "Cannot allocate frame buffers\n");
+            exit(1);
+        }
+    }
+
+    pthread_create(&rx_tid,  NULL, stream_loop, &srvaddr);
+    pthread_create(&dec_tid, NULL, decode_loop, NULL);
+    pthread_create(&ctl_tid, NULL, control_thread, &clientfd);
+    pthread_detach(ctl_tid);   // may block on stdin
+
+    fprintf(stdout, "command: 's' for start streaming, 'c' close streaming, a digit the layer\n");
 
-    stream_control(clientfd);
+    display_loop();
+
+    pthread_join(rx_tid, NULL);
+    pthread_join(dec_tid, NULL);
 
     close(clientfd);
 
@@ -108,5 +912,3 @@ int main(int argc, char **argv)
 
     return 0;
 }
-
-
@@ -0,0 +1,228 @@
+/*
+ * local reader of an encoder's shared memory ring (shmring.h)
+ *
+ * rpi-shmcat [-v] </name> [out.h264]
+ * rpi-shmcat -p [-f fps] </name> <in.h264>
+ *
+ * follows the ring that rpi-camera-encode2 writes (output "shm:/name")
+ * from its newest key frame, the codec config first, and writes the
+ * access units to a file or stdout (a recorder next to the streamer),
+ * until the encoder goes. -v prints each record: size, flags and how
+ * long after the encoder wrote it this reader got it.
+ *
+ * -p is the other side without a camera: publishes a file into the ring
+ * at fps (default 25), the parameter sets as config records, as the
+ * encoder does, each access unit with the time it was read as capture
+ * time.
+ */
+
+/* std headers   ---------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+
+#include "h264au.h"
+#include "shmring.h"
+
+static volatile sig_atomic_t want_quit = 0;
+
+static void signal_handler(int sig)
+{
+	want_quit = 1;
+}
+
+static long long now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static long long realtime_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (long long)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static int write_all(int fd, const unsigned char *p, int len)
+{
+	int n;
+
+	while(len > 0){
+		if((n = write(fd, p, len)) < 0){
+			if(errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* where the first slice's start code is, au->len if there is none */
+static int first_vcl(const H264AU *au)
+{
+	const unsigned char *p;
+	int i, type;
+
+	for(i = 0; i < au->nnal; i++){
+		type = au->nal[i].data[0] & 0x1F;
+		if(type == H264_NAL_SLICE || type == H264_NAL_IDR){
+			p = au->nal[i].data - 3;
+			if(p > au->data && p[-1] == 0)
+				p--;
+			return p - au->data;
+		}
+	}
+	return au->len;
+}
+
+static int publish(const char *name, const char *path, int fps)
+{
+	H264Reader reader;
+	H264AU au;
+	ShmRing ring;
+	struct timespec next;
+	long long frames = 0, pts;
+	int cfg;
+
+	if(h264_reader_open(&reader, path) < 0 || h264_au_alloc(&au) < 0){
+		fprintf(stderr, "Cannot open %s\n", path);
+		return 1;
+	}
+	if(shmring_create(&ring, name, SHMRING_SIZE, SHMRING_SLOTS) < 0)
+		return 1;
+	clock_gettime(CLOCK_MONOTONIC, &next);
+
+	while(!want_quit && h264_read_au(&reader, &au) > 0){
+		pts = realtime_us();
+		if((cfg = first_vcl(&au)) > 0 && au.nal[0].len > 0 &&
+		   (au.nal[0].data[0] & 0x1F) == H264_NAL_SPS){
+			shmring_append(&ring, au.data, cfg, SHMRING_CONFIG);
+			shmring_commit(&ring, pts);
+		}else
+			cfg = 0;
+		shmring_append(&ring, au.data + cfg, au.len - cfg, au.idr ? SHMRING_KEY : 0);
+		shmring_commit(&ring, pts);
+		frames++;
+
+		next.tv_nsec += 1000000000L / fps;
+		if(next.tv_nsec >= 1000000000L){
+			next.tv_nsec -= 1000000000L;
+			next.tv_sec++;
+		}
+		while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) != 0 && !want_quit)
+			;
+	}
+	fprintf(stderr, "SHM> %lld access units published to %s, %lu dropped\n",
+		frames, name, ring.dropped);
+	shmring_close(&ring);
+	h264_au_free(&au);
+	h264_reader_close(&reader);
+	return 0;
+}
+
+static int follow(const char *name, const char *path, int verbose)
+{
+	static unsigned char cfg[SHMRING_MAX_CONFIG];
+	static unsigned char buf[H264_MAX_AU_SIZE];
+	ShmRing ring;
+	ShmRec rec;
+	uint64_t cursor;
+	unsigned long records = 0, overruns = 0;
+	long long bytes = 0, lat, lat_sum = 0, lat_max = 0;
+	int fd = 1, n, rc;
+
+	if(path && (fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0){
+		fprintf(stderr, "Cannot open %s\n", path);
+		return 1;
+	}
+	if(shmring_open(&ring, name) < 0)
+		return 1;
+	cursor = shmring_start(&ring);
+	if((n = shmring_config(&ring, cfg, sizeof(cfg))) > 0 && write_all(fd, cfg, n) < 0)
+		want_quit = 1;
+
+	while(!want_quit){
+		rc = shmring_next(&ring, &cursor, &rec);
+		if(rc == 0){
+			if(shmring_closed(&ring))
+				break;
+			shmring_wait(&ring, cursor, 1000);
+			continue;
+		}
+		if(rc > 0 && rec.len > (int)sizeof(buf)){
+			fprintf(stderr, "SHM> record #%llu of %d bytes too large, skipped\n",
+				(unsigned long long)rec.seq, rec.len);
+			continue;
+		}
+		/* copied out first: in place it is valid only as long as the
+		   encoder did not get round to it, torn bytes must not be written */
+		if(rc > 0){
+			memcpy(buf, rec.data, rec.len);
+			if(!shmring_valid(&ring, &rec)){
+				cursor = shmring_start(&ring);
+				rc = -1;
+			}
+		}
+		if(rc < 0){
+			overruns++;
+			continue;
+		}
+		if(write_all(fd, buf, rec.len) < 0){
+			fprintf(stderr, "SHM> write error: %s\n", strerror(errno));
+			break;
+		}
+		lat = now_ns() - rec.t_ns;
+		lat_sum += lat;
+		if(lat > lat_max)
+			lat_max = lat;
+		records++;
+		bytes += rec.len;
+		if(verbose)
+			fprintf(stderr, "SHM> #%llu %6d bytes%s%s %.3f ms after capture, %.3f ms after the writer\n",
+				(unsigned long long)rec.seq, rec.len,
+				rec.flags & SHMRING_KEY ? " key" : "", rec.flags & SHMRING_CONFIG ? " config" : "",
+				(realtime_us() - rec.pts) / 1e3, lat / 1e6);
+	}
+	fprintf(stderr, "SHM> %lu records, %lld bytes, %lu overruns, latency %.3f ms mean %.3f ms max\n",
+		records, bytes, overruns, records ? lat_sum / 1e6 / records : 0, lat_max / 1e6);
+	shmring_close(&ring);
+	if(fd != 1)
+		close(fd);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int opt, pub = 0, fps = 25, verbose = 0;
+
+	while((opt = getopt(argc, argv, "pf:v")) != -1){
+		switch(opt){
+		case 'p': pub = 1; break;
+		case 'f': fps = atoi(optarg); break;
+		case 'v': verbose = 1; break;
+		default:  argc = 0; break;
+		}
+	}
+	if(argc - optind < 1 + pub || argc - optind > 2 || fps <= 0){
+		fprintf(stderr, "usage: %s [-v] </name> [out.h264]\n", argv[0]);
+		fprintf(stderr, "       %s -p [-f fps] </name> <in.h264>\n", argv[0]);
+		fprintf(stderr, "  -v  each record to stderr\n");
+		fprintf(stderr, "  -p  publish a file into the ring at fps (default 25)\n");
+		return 1;
+	}
+	signal(SIGINT,  signal_handler);
+	signal(SIGTERM, signal_handler);
+	signal(SIGPIPE, SIG_IGN);
+	if(pub)
+		return publish(argv[optind], argv[optind + 1], fps);
+	return follow(argv[optind], argv[optind + 1], verbose);
+}
@@ -0,0 +1,136 @@
+/*
+ * link health of a running rpi-streamer, from the ground station
+ *
+ * rpi-stats [-i interval ms] [-n count] <host> <port>
+ *
+ * polls the streamer's stats over its control connection (ctlmsg.h), one
+ * small query and one answer per interval, and prints the encoder's
+ * frame rate and bitrate and a line per client: queue, packets sent and
+ * dropped, loss and RTT. the connection is a client of its own, shown
+ * as not streaming.
+ */
+
+/* std headers   ---------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+
+#include "ctlmsg.h"
+
+static long long now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int open_clientfd(const char *hostname, int port)
+{
+	struct hostent *hp;
+	struct sockaddr_in addr;
+	int fd;
+
+	if((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+		return -1;
+	if((hp = gethostbyname(hostname)) == NULL){
+		close(fd);
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	memcpy(&addr.sin_addr.s_addr, hp->h_addr_list[0], hp->h_length);
+	addr.sin_port = htons(port);
+	if(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0){
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* one query, the answer in *st; -1 if the connection is gone */
+static int stats_query(int fd, CtlStats *st)
+{
+	static unsigned char buf[CTL_MAX_MSG];
+	const unsigned char *payload;
+	int len = 0, n, type, plen, used;
+
+	n = ctl_msg_build(buf, CTL_STATS_REQ, NULL, 0);
+	if(write(fd, buf, n) != n)
+		return -1;
+	while((used = ctl_msg_parse(buf, len, &type, &payload, &plen)) == 0){
+		n = read(fd, buf + len, sizeof(buf) - len);
+		if(n <= 0)
+			return -1;
+		len += n;
+	}
+	if(used < 0 || type != CTL_STATS)
+		return -1;
+	return ctl_stats_parse(payload, plen, st);
+}
+
+int main(int argc, char **argv)
+{
+	int fd, opt, i, interval = 1000, count = -1;
+	long long t;
+	struct in_addr a;
+	CtlStats st;
+	CtlClientStats *c;
+
+	while((opt = getopt(argc, argv, "i:n:")) != -1){
+		switch(opt){
+		case 'i': interval = atoi(optarg); break;
+		case 'n': count = atoi(optarg); break;
+		default:  argc = 0; break;
+		}
+	}
+	if(argc - optind != 2){
+		fprintf(stderr, "usage: %s [-i interval ms] [-n count] <host> <port>\n", argv[0]);
+		fprintf(stderr, "  -i  poll interval (default 1000 ms)\n");
+		fprintf(stderr, "  -n  polls, then exit (default: until the streamer goes)\n");
+		return 1;
+	}
+	fd = open_clientfd(argv[optind], atoi(argv[optind + 1]));
+	if(fd < 0){
+		fprintf(stderr, "Cannot connect to %s:%s\n", argv[optind], argv[optind + 1]);
+		return 1;
+	}
+
+	while(count != 0){
+		t = now_ns();
+		if(stats_query(fd, &st) < 0){
+			fprintf(stderr, "STATS> connection lost\n");
+			break;
+		}
+		t = now_ns() - t;
+		printf("STATS> up %.1f s, %u frames, encoder %.1f fps %u kbit/s",
+		       st.uptime_ms / 1000.0, st.frames, st.fps100 / 100.0, st.kbps);
+		if(st.target_kbps)
+			printf(" (target %u)", st.target_kbps);
+		printf(", query %.2f ms\n", t / 1e6);
+		for(i = 0; i < st.nclients; i++){
+			c = &st.client[i];
+			if(!c->streaming)
+				continue;
+			a.s_addr = c->addr;
+			printf("  %-15s layer %u, queue %u pkts %u frames, sent %u dropped %u, skipped %u frames,"
+			       " resent %u, loss %.1f%% recv %u kbit/s, rtt %.1f/%.1f ms\n",
+			       inet_ntoa(a), c->layer, c->queue_pkts, c->queue_frames, c->sent, c->dropped, c->skipped,
+			       c->resent, c->fraction_lost * 100 / 256.0, c->recv_kbps,
+			       c->rtt_us / 1000.0, c->rttvar_us / 1000.0);
+		}
+		fflush(stdout);
+		if(count > 0)
+			count--;
+		if(count != 0)
+			usleep(interval * 1000);
+	}
+	close(fd);
+	return 0;
+}
@@ -0,0 +1,336 @@
+/*
+ * end to end streaming benchmark on loopback, no Pi or camera needed
+ *
+ * rpi-stream-bench [-d secs] [-w secs] [-p port] [-s streamer] [-v] [h264file] [-- streamer options]
+ *
+ * starts rpi-streamer on the file (default ffmpeg/test.h264, paced at the
+ * streamer's frame rate, looped), connects as a player and receives the
+ * RTP stream on 127.0.0.1 through the same loss recovery and depacketizer
+ * as rpi-player-template. after a warm-up (-w: the GOP cache catch-up,
+ * socket buffers) it measures for -d seconds
+ *
+ *   latency     per frame, from its send time to its last packet received
+ *               and the access unit reassembled
+ *   throughput  RTP bytes, packets and frames received per second
+ *   cpu         of the streamer process (/proc/<pid>/stat) and of the
+ *               receiver (getrusage), % of one core
+ *
+ * the stream carries no send time: a frame's is its RTP timestamp on the
+ * streamer's clock (frames go out as they are published, file frames on
+ * a fixed schedule), and the offset between the two clocks is that of
+ * the fastest frame (its first packet saw no queue). so latency is
+ * exact up to the loopback delay of that packet, a few us.
+ *
+ * prints one JSON object to stdout, the same fields each run, to keep
+ * with the tree's history and compare; the streamer's output goes to
+ * /dev/null unless -v.
+ */
+
+/* std headers   ---------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "rtp264.h"
+#include "fec.h"
+
+#define STREAM_CLIENT_PORT 1501     // where the streamer sends to
+#define MAX_PKT            2048
+#define CONNECT_MS         3000     // for the streamer to listen
+#define HOLD_MS            40       // recovery hold, as the player with FEC
+
+static long long now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int cmp_ll(const void *a, const void *b)
+{
+	long long x = *(const long long *)a, y = *(const long long *)b;
+	return x < y ? -1 : x > y;
+}
+
+/* user + system time of a process (s), -1 if it is gone */
+static double proc_cpu(pid_t pid)
+{
+	char path[64], buf[1024], *p;
+	unsigned long ut, st;
+	int fd, n;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+	if((fd = open(path, O_RDONLY)) < 0)
+		return -1;
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if(n <= 0)
+		return -1;
+	buf[n] = '\0';
+	/* after "(comm)": state ppid .. utime is the 12th field, stime the 13th */
+	if((p = strrchr(buf, ')')) == NULL ||
+	   sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &ut, &st) != 2)
+		return -1;
+	return (double)(ut + st) / sysconf(_SC_CLK_TCK);
+}
+
+static double self_cpu(void)
+{
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+	       ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+static pid_t start_streamer(const char *streamer, const char *file, int port,
+			    char **opts, int nopts, int verbose)
+{
+	char portstr[16], **argv;
+	pid_t pid;
+	int i, fd;
+
+	snprintf(portstr, sizeof(portstr), "%d", port);
+	argv = calloc(nopts + 4, sizeof(char *));
+	argv[0] = (char *)streamer;
+	for(i = 0; i < (unsigned long)nopts; i++)
+		argv[1 + i] = opts[i];
+	argv[1 + nopts] = portstr;
+	argv[2 + nopts] = (char *)file;
+
+	pid = fork();
+	if(pid == 0){
+		if(!verbose && (fd = open("/dev/null", O_WRONLY)) >= 0){
+			dup2(fd, 1);
+			dup2(fd, 2);
+		}else
+			dup2(2, 1);              // stdout is the JSON's
+		execv(streamer, argv);
+		fprintf(stderr, "Cannot run %s: %s\n", streamer, strerror(errno));
+		_exit(127);
+	}
+	free(argv);
+	return pid;
+}
+
+/* the control connection, once the streamer listens */
+static int connect_streamer(int port)
+{
+	struct sockaddr_in addr;
+	long long t_end = now_ns() + CONNECT_MS * 1000000LL;
+	int fd;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(port);
+	while(now_ns() < t_end){
+		if((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+			return -1;
+		if(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+			return fd;
+		close(fd);
+		usleep(20000);
+	}
+	return -1;
+}
+
+static int command(int fd, char cmd)
+{
+	char rsp;
+	if(write(fd, &cmd, 1) != 1 || read(fd, &rsp, 1) != 1)
+		return -1;
+	return rsp == 'a' ? 0 : -1;
+}
+
+int main(int argc, char **argv)
+{
+	const char *streamer = "./rpi-streamer", *file = "ffmpeg/test.h264";
+	int secs = 10, warmup = 2, port = 9500, verbose = 0, opt, nopts = 0;
+	char **opts = NULL;
+
+	int ctl, sock, n, len, rc, rcvbuf = 1024 * 1024;
+	pid_t pid;
+	struct sockaddr_in addr;
+	struct pollfd pfd;
+	unsigned char pkt[MAX_PKT];
+	const unsigned char *p;
+	RtpDepacketizer rtp;
+	FecRx fec;
+	long long now, t_start, t_end, *lat, offset = 0, sum = 0, ext_ts = 0;
+	unsigned long nlat = 0, maxlat, frames = 0, broken = 0, packets = 0, bytes = 0;
+	unsigned long lost0 = 0, i;
+	uint32_t ts = 0, last_ts = 0;
+	double cpu_s0, cpu_s1, cpu_r0, cpu_r1, wall;
+	int status, have_ts = 0;
+
+	while((opt = getopt(argc, argv, "+d:w:p:s:v")) != -1){   // stop at the file
+		switch(opt){
+		case 'd': secs = atoi(optarg); break;
+		case 'w': warmup = atoi(optarg); break;
+		case 'p': port = atoi(optarg); break;
+		case 's': streamer = optarg; break;
+		case 'v': verbose = 1; break;
+		default:  argc = 0; break;
+		}
+	}
+	if(argc == 0 || secs <= 0 || warmup < 0){
+		fprintf(stderr, "usage: %s [-d secs] [-w secs] [-p port] [-s streamer] [-v] [h264file] [-- streamer options]\n", argv[0]);
+		fprintf(stderr, "  -d  measure that long (default 10 s)\n");
+		fprintf(stderr, "  -w  warm-up before (default 2 s)\n");
+		fprintf(stderr, "  -p  the streamer's control port (default 9500)\n");
+		fprintf(stderr, "  -s  the streamer (default ./rpi-streamer)\n");
+		fprintf(stderr, "  -v  show the streamer's output (on stderr)\n");
+		fprintf(stderr, "  --  options for the streamer, RTP only (no -T)\n");
+		return 1;
+	}
+	if(optind < argc && strcmp(argv[optind - 1], "--") != 0 && strcmp(argv[optind], "--") != 0)
+		file = argv[optind++];
+	if(optind < argc && strcmp(argv[optind], "--") == 0)
+		optind++;
+	opts = argv + optind;
+	nopts = argc - optind;
+	for(i = 0; i < (unsigned long)nopts; i++)
+		if(opts[i][0] == '-' && opts[i][1] != '-' && strchr(opts[i] + 1, 'T')){
+			fprintf(stderr, "Error: the bench receives RTP only, not MPEG-TS (-T)\n");
+			return 1;
+		}
+
+	/* 1. receiver first: the streamer sends as soon as 's' is acked */
+	sock = socket(AF_INET, SOCK_DGRAM, 0);
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(STREAM_CLIENT_PORT);
+	if(sock < 0 || bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0){
+		fprintf(stderr, "Error: cannot bind udp port %d (a player running?)\n", STREAM_CLIENT_PORT);
+		return 1;
+	}
+	setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+	if(rtp264_depacketizer_init(&rtp) < 0 || fec_rx_init(&fec, HOLD_MS) < 0){
+		fprintf(stderr, "Error: cannot allocate the receiver\n");
+		return 1;
+	}
+	maxlat = (unsigned long)secs * 1000;              // frames, plenty
+	lat = malloc(maxlat * sizeof(long long));
+
+	/* 2. streamer, start streaming */
+	signal(SIGPIPE, SIG_IGN);
+	pid = start_streamer(streamer, file, port, opts, nopts, verbose);
+	if(pid < 0 || (ctl = connect_streamer(port)) < 0 || command(ctl, 's') < 0){
+		fprintf(stderr, "Error: the streamer did not start streaming\n");
+		if(pid > 0)
+			kill(pid, SIGTERM);
+		return 1;
+	}
+
+	/* 3. receive: warm-up, then measure */
+	pfd.fd = sock;
+	pfd.events = POLLIN;
+	t_start = now_ns() + warmup * 1000000000LL;
+	t_end = t_start + secs * 1000000000LL;
+	cpu_s0 = cpu_r0 = -1;
+	while((now = now_ns()) < t_end){
+		if(cpu_s0 < 0 && now >= t_start){
+			cpu_s0 = proc_cpu(pid);
+			cpu_r0 = self_cpu();
+			lost0  = rtp.lost;
+		}
+		n = 0;
+		if(poll(&pfd, 1, 10) > 0)
+			n = recv(sock, pkt, sizeof(pkt), 0);
+		now = now_ns();
+		if(n > 0){
+			fec_rx_push(&fec, pkt, n, now);
+			if(now >= t_start){
+				packets++;
+				bytes += n;
+			}
+		}
+		while((p = fec_rx_pop(&fec, &len, now)) != NULL){
+			if(rtp.len == 0)
+				ts = rtp_ts(p);
+			rc = rtp264_depacketize(&rtp, p, len);
+			if(rc <= 0)
+				continue;
+			/* the timestamp may wrap (it starts at random) */
+			ext_ts = have_ts ? ext_ts + (int32_t)(ts - last_ts) : ts;
+			last_ts = ts;
+			have_ts = 1;
+			if(now >= t_start){
+				frames++;
+				if(rtp.broken || rtp.len == 0)
+					broken++;
+				else if(nlat < maxlat){
+					/* reassembled on the receiver's clock less the frame's
+					   time on the streamer's: latency + clock offset */
+					lat[nlat] = now - (long long)(ext_ts * 1e9 / RTP_CLOCK);
+					if(nlat == 0 || lat[nlat] < offset)
+						offset = lat[nlat];
+					nlat++;
+				}
+			}
+			rtp264_depacketizer_reset(&rtp);
+		}
+	}
+	cpu_s1 = proc_cpu(pid);
+	cpu_r1 = self_cpu();
+	wall = (now_ns() - t_start) / 1e9;
+
+	/* 4. stop */
+	command(ctl, 'c');
+	close(ctl);
+	kill(pid, SIGTERM);
+	waitpid(pid, &status, 0);
+
+	if(nlat == 0){
+		fprintf(stderr, "Error: no frames received\n");
+		return 1;
+	}
+
+	/* 5. latency: less the offset, that of the fastest frame */
+	for(i = 0; i < nlat; i++){
+		lat[i] -= offset;
+		sum += lat[i];
+	}
+	qsort(lat, nlat, sizeof(lat[0]), cmp_ll);
+
+	printf("{\n");
+	printf("  \"benchmark\": \"rpi-stream-bench\",\n");
+	printf("  \"file\": \"%s\",\n", file);
+	printf("  \"streamer_options\": \"");
+	for(n = 0; n < nopts; n++)
+		printf("%s%s", n ? " " : "", opts[n]);
+	printf("\",\n");
+	printf("  \"duration_s\": %.3f,\n", wall);
+	printf("  \"frames\": %lu,\n", frames);
+	printf("  \"frames_broken\": %lu,\n", broken);
+	printf("  \"packets_lost\": %lu,\n", rtp.lost - lost0);
+	printf("  \"fps\": %.2f,\n", frames / wall);
+	printf("  \"throughput_kbps\": %.1f,\n", bytes * 8 / wall / 1000);
+	printf("  \"packets_per_s\": %.1f,\n", packets / wall);
+	printf("  \"latency_ms\": { \"mean\": %.3f, \"median\": %.3f, \"p95\": %.3f, \"p99\": %.3f, \"max\": %.3f },\n",
+	       sum / 1e6 / nlat, lat[nlat / 2] / 1e6, lat[nlat * 95 / 100] / 1e6,
+	       lat[nlat * 99 / 100] / 1e6, lat[nlat - 1] / 1e6);
+	printf("  \"cpu_pct\": { \"streamer\": %.2f, \"receiver\": %.2f }\n",
+	       cpu_s0 >= 0 && cpu_s1 >= 0 ? 100 * (cpu_s1 - cpu_s0) / wall : -1.0,
+	       100 * (cpu_r1 - cpu_r0) / wall);
+	printf("}\n");
+
+	free(lat);
+	fec_rx_free(&fec);
+	rtp264_depacketizer_free(&rtp);
+	close(sock);
+	return 0;
+}
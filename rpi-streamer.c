@@ -1,3 +1,4 @@
+#define _GNU_SOURCE   /* sendmmsg() */
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -7,7 +8,31 @@
 #include <stdio.h>
 #include <unistd.h> /* close() */
 #include <string.h> /* memset() */
+#include <time.h>
 #include <pthread.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h> /* SIOCOUTQ */
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <netinet/tcp.h> /* TCP_INFO, TCP_NOTSENT_LOWAT */
+#include <net/if.h>         /* if_nametoindex() */
+
+#include "h264au.h"
+#include "rtp264.h"
+#include "udptx.h"
+#include "tbucket.h"
+#include "fec.h"
+#include "rtcp.h"
+#include "abr.h"
+#include "ctlmsg.h"
+#include "shmring.h"
+#include "tsmux.h"
 
 /*--------------------------------------------------------------------------
    DESC
@@ -15,94 +40,1201 @@
 
    TCP server for control video streaming start and end 
    UDP server for sendind Video data 
+   (RTP/H.264, MPEG-TS with -T; over the control connection with 't',
+   to a multicast group with -M)
 
-   main                 : listen socket 
-     |               
-   stream_control  	: tcp control socket 
-     | 
-   stream_loop          : udp stream (separate thread) 
+   main                 : event loop (epoll): control sockets, sends,
+     |                    pacing timer, NACKs and reports (rtcp.h)
+     |
+   source_loop          : packetizes a source once into a ring of shared
+                          frames (thread per layer), wakes the event loop
 
 ---------------------------------------------------------------------------*/ 
 /* GLOBAL -----------------------------------------------------------------*/
 
 
 /* STATIC -----------------------------------------------------------------*/
-static volatile int gStreamStopReq = 0;  // multitheaded  
+static int gPaceKbps = 0;                // pacing rate, 0: from the frame size
+static int gPaceHeadroom = 25;           // % above the rate, -1: no pacing
+static FecConfig gFec;                   // repair packets, FEC_NONE: off
+static int gRtxKbps = 4000;              // retransmission rate, 0: no retransmission
+static int gGopSpeed = 4;                // GOP cache catch-up speed, 0: no cache
+static const char *gEncPath;             // encoder control fifo, NULL: none
+static int gEncFd = -1;
+static int gAbr = 0;                     // rate control
+static int gTs = 0;                      // MPEG-TS instead of RTP
+static const char *gMcastGroup;          // -M group[:port], NULL: unicast only
+static const char *gMcastIf;             // -I interface (name or address), NULL: the route's
+static int gMcastTtl = 1;                // -L hops, 1: this LAN
+static double gAbrBitrate;               // the encoder's, last set
+static long long gStartNs;               // for the uptime
 
 #define LOCAL_SERVER_PORT  1500
 #define STREAM_CLIENT_PORT 1501   
-#define MAX_MSG 100
+#define STREAM_FRAMERATE   25     // pacing of a file source
+#define MAX_PKTS_PER_AU    (H264_MAX_AU_SIZE/(RTP_PKT_SIZE-FEC_OVERHEAD-RTP_HDR_SIZE-2) + H264_MAX_NALS + 1)
+#define NSEC_PER_SEC       1000000000L
+#define PACE_BURST_PKTS    8      // packets sent back to back (bucket depth)
+#define MAX_CLIENTS        64
+#define MAX_EVENTS         16
+#define UDP_SNDBUF         (1024*1024)
+#define BCAST_RING         8      // frames kept for the clients
+#define GOP_CACHE_FRAMES   128    // frames from the newest IDR on, at most
+#define GOP_CACHE_BYTES    (4*1024*1024)
+#define BCAST_POOL         (BCAST_RING + GOP_CACHE_FRAMES + MAX_CLIENTS + 1)
+#define RTX_DEADLINE_MS    100    // older packets are not sent again
+#define ABR_MIN_KBPS       250
+#define ABR_MAX_KBPS       10000  // rpi-camera-encode2 VIDEO_BITRATE
+#define ABR_STEP           0.05   // smaller bitrate changes are not passed on
+#define IDR_MIN_INTERVAL_MS 500   // key frame requests to the encoder at most
+#define IDR_TIMEOUT_MS     1000   // a requested key frame that did not come
+#define TCP_LOWAT          (16*1024)  // unsent bytes in a tcp stream's socket
+#define TCP_MAX_IOV        512    // per sendmsg(), 2 per packet
+#define MAX_LAYERS         4      // sources (simulcast layers)
  
 /* LOCAL ------------------------------------------------------------------*/
 
+static long long now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/* the clock of capture times (us) */
+static long long realtime_us(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (long long)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static void timespec_add_ns(struct timespec *t, long ns)
+{
+  t->tv_nsec += ns;
+  while(t->tv_nsec >= NSEC_PER_SEC){
+    t->tv_nsec -= NSEC_PER_SEC;
+    t->tv_sec++;
+  }
+}
+
+/* shared frames ---------------------------------------------------------
+
+   a pool of frames, each one the RTP packets of one access unit.
+   the ring holds one reference to each of the last BCAST_RING frames,
+   the GOP cache one to each frame from the newest IDR on, a sending
+   client one more; the last reference returns it to the pool.
+
+   a client keeps a cursor (frame number) into the ring; one that falls
+   behind it jumps to the newest frame and its player waits for the next
+   IDR. the GOP cache lets a new client start at its IDR at once, no IDR
+   is asked of the encoder for it; the source repeats SPS/PPS in front of
+   each IDR, so the cached one is enough to start decoding.
+
+   one of each per source: a layer (simulcast, the encoder's outputs of
+   different sizes), with its own frame numbers, RTP sequence numbers
+   and SSRC. every layer wakes the event loop through the same eventfd.
+*/
+
+struct Bcast;
+
+typedef struct BFrame {
+  int refcnt;
+  unsigned long seq;      // frame number
+  int idr;
+  int ref;                // a reference frame (not to be dropped)
+  int npkts;
+  RtpPkt *pkts;           // in send order, FEC repairs after their blocks
+  uint16_t seq0;          // sequence number of the first media packet
+  int nmedia;             // media packets (seq0 ..)
+  int bytes;              // all packets
+  long long t_pub;        // published
+  int64_t capture_us;     // captured (CLOCK_REALTIME), 0: not known
+  unsigned char *arena;   // packets, RTP_PKT_SIZE at most each
+  int cap;                // packets the arena can hold
+  struct Bcast *bc;       // the layer whose pool it is in
+  struct BFrame *next;    // free list
+} BFrame;
+
+typedef struct Bcast {
+  int id;                     // layer number
+  const char *path;           // h264 file, fifo, "-" or "shm:/name"
+  BFrame  pool[BCAST_POOL];
+  BFrame *freelist;
+  BFrame *ring[BCAST_RING];   // frame seq is in ring[seq % BCAST_RING]
+  unsigned long next_seq;     // number of the next frame published
+  unsigned long last_idr;     // number of the newest IDR + 1, 0: none yet
+  BFrame *gop[GOP_CACHE_FRAMES];  // frames gop[0] (an IDR) .. in order
+  int gop_n;                  // 0: no IDR yet or the GOP outgrew the cache
+  int gop_bytes;
+  long long t_win;            // frame rate and bitrate of the source: this
+  unsigned long win_frames, win_bytes;   // second so far, the last one
+  double fps, kbps;
+  int eof;                    // the source ended
+  pthread_mutex_t lock;
+} Bcast;
+
+static Bcast gBcast[MAX_LAYERS];
+static int gNumLayers;
+static int gBcastEvfd;        // eventfd, written on each new frame of any layer
+
+static void bcast_init(Bcast *b, int id, const char *path)
+{
+  int i;
+
+  b->id = id;
+  b->path = path;
+  pthread_mutex_init(&b->lock, NULL);
+  for(i = 0; i < BCAST_POOL; i++){
+    b->pool[i].bc = b;
+    b->pool[i].next = b->freelist;
+    b->freelist = &b->pool[i];
+  }
+}
+
+/* a free frame with room for npkts packets (never fails for lack of frames:
+   the pool covers the ring, every client and the source) */
+static BFrame *frame_alloc(Bcast *b, int npkts)
+{
+  BFrame *f;
+
+  pthread_mutex_lock(&b->lock);
+  f = b->freelist;
+  b->freelist = f->next;
+  pthread_mutex_unlock(&b->lock);
+
+  if(npkts > f->cap){
+    free(f->arena);
+    free(f->pkts);
+    f->arena = malloc((size_t)npkts * RTP_PKT_SIZE);
+    f->pkts  = malloc(npkts * sizeof(RtpPkt));
+    f->cap   = (f->arena && f->pkts) ? npkts : 0;
+  }
+  f->refcnt = 1;
+  return f;
+}
+
+/* drop a reference, the caller holds its layer's lock */
+static void frame_unref_locked(BFrame *f)
+{
+  if(--f->refcnt == 0){
+    f->next = f->bc->freelist;
+    f->bc->freelist = f;
+  }
+}
+
+static void frame_put(BFrame *f)
+{
+  Bcast *b = f->bc;
+
+  pthread_mutex_lock(&b->lock);
+  frame_unref_locked(f);
+  pthread_mutex_unlock(&b->lock);
+}
+
+/* wake up the event loop */
+static void bcast_wakeup(void)
+{
+  uint64_t one = 1;
+  if(write(gBcastEvfd, &one, sizeof(one)) < 0)
+    fprintf(stderr, "SOURCE> eventfd write failed\n");
+}
+
+/* the GOP cache: an IDR starts it again, a frame that does not fit ends
+   it until the next IDR; the caller holds the layer's lock */
+static void gop_add_locked(Bcast *b, BFrame *f)
+{
+  if(f->idr || b->gop_n == GOP_CACHE_FRAMES ||
+     b->gop_bytes + f->bytes > GOP_CACHE_BYTES){
+    while(b->gop_n > 0)
+      frame_unref_locked(b->gop[--b->gop_n]);
+    b->gop_bytes = 0;
+  }
+  if(!f->idr && b->gop_n == 0)
+    return;
+  f->refcnt++;
+  b->gop[b->gop_n++] = f;
+  b->gop_bytes += f->bytes;
+}
+
+/* hand the source's reference over to the ring, wake up the clients */
+static void frame_publish(BFrame *f)
+{
+  Bcast *b = f->bc;
+  BFrame **slot;
+  int i;
+
+  f->t_pub = now_ns();
+  for(i = 0, f->bytes = 0; i < f->npkts; i++)
+    f->bytes += f->pkts[i].len;
+  pthread_mutex_lock(&b->lock);
+  f->seq = b->next_seq++;
+  if(f->idr)
+    b->last_idr = f->seq + 1;
+  if(f->t_pub - b->t_win >= NSEC_PER_SEC){
+    if(b->t_win){
+      b->fps  = b->win_frames * 1e9 / (f->t_pub - b->t_win);
+      b->kbps = b->win_bytes * 8e6 / (f->t_pub - b->t_win);
+    }
+    b->t_win = f->t_pub;
+    b->win_frames = b->win_bytes = 0;
+  }
+  b->win_frames++;
+  b->win_bytes += f->bytes;
+  if(gGopSpeed > 0)
+    gop_add_locked(b, f);
+  slot = &b->ring[f->seq % BCAST_RING];
+  if(*slot)
+    frame_unref_locked(*slot);
+  *slot = f;
+  pthread_mutex_unlock(&b->lock);
+  bcast_wakeup();
+}
+
+/* 
+   get a reference to frame *cursor of layer b if it is published, else NULL
+   a cursor older than the ring moves to the newest frame (*skipped frames),
+   unless gop is set and the frame is in the GOP cache
+*/
+static BFrame *frame_try_get(Bcast *b, unsigned long *cursor, unsigned long *skipped, int gop)
+{
+  BFrame *f = NULL;
+  unsigned long first;
+
+  pthread_mutex_lock(&b->lock);
+  if(*cursor < b->next_seq){
+    first = b->gop_n ? b->gop[0]->seq : b->next_seq;
+    if(*cursor + BCAST_RING >= b->next_seq)
+      f = b->ring[*cursor % BCAST_RING];
+    else if(gop && *cursor >= first)
+      f = b->gop[*cursor - first];
+    else{
+      *skipped += b->next_seq - 1 - *cursor;
+      *cursor = b->next_seq - 1;
+      f = b->ring[*cursor % BCAST_RING];
+    }
+    f->refcnt++;
+  }
+  pthread_mutex_unlock(&b->lock);
+  return f;
+}
+
+/* 
+   get a reference to the frame in layer b's ring with media packet seq,
+   NULL if it is gone; the packet in *pkt
+*/
+static BFrame *frame_find_pkt(Bcast *b, uint16_t seq, const RtpPkt **pkt)
+{
+  BFrame *f;
+  int i, k;
+
+  pthread_mutex_lock(&b->lock);
+  for(i = 0; i < BCAST_RING; i++){
+    f = b->ring[i];
+    if(f == NULL || (uint16_t)(seq - f->seq0) >= f->nmedia)
+      continue;
+    /* media packets are in order, repairs (other PT) may be in between */
+    for(k = (uint16_t)(seq - f->seq0); k < f->npkts; k++)
+      if(rtp_seq(f->pkts[k].data) == seq && (f->pkts[k].data[1] & 0x7F) != RTP_PT_FEC)
+        break;
+    if(k == f->npkts)
+      continue;
+    *pkt = &f->pkts[k];
+    f->refcnt++;
+    pthread_mutex_unlock(&b->lock);
+    return f;
+  }
+  pthread_mutex_unlock(&b->lock);
+  return NULL;
+}
+
+
+/* video source ----------------------------------------------------------
+
+   read access units, packetize them once, add the FEC repairs (-F) and
+   publish them; an IDR without SPS/PPS gets the stream's last ones
+   a regular file is paced at STREAM_FRAMERATE and loops forever,
+   a pipe is read as fast as the encoder writes it, so is the encoder's
+   shared memory ring ("shm:/name", rpi-camera-encode2)
+   IN:  arg: the layer (its source path), one thread each
+   GLOBAL: gBcastEvfd
+   the blocking reads stay out of the event loop, which is woken through
+   gBcastEvfd
+   capture time: the encoder's SEI (rpi-camera-encode2 -s, h264au.h) or
+   the shared memory ring's record time, put in an SEI if the access
+   unit has none; a live source's RTP (and TS) timestamps are the
+   capture time at 90 kHz, a file's the frame count
+*/
+
+/* slices with nal_ref_idc 0: no other frame is predicted from it */
+static int au_is_reference(const H264AU *au)
+{
+  int i, type;
+
+  for(i = 0; i < au->nnal; i++){
+    type = au->nal[i].data[0] & 0x1F;
+    if((type == H264_NAL_SLICE || type == H264_NAL_IDR) && (au->nal[i].data[0] & 0x60))
+      return 1;
+  }
+  return 0;
+}
+
+/* the ring from its newest key frame on, with the stream's codec config */
+static int ring_open(ShmRing *ring, const char *name, uint64_t *cursor, H264Params *params)
+{
+  unsigned char buf[SHMRING_MAX_CONFIG];
+  H264AU cfg = { .data = buf };
+
+  if(shmring_open(ring, name) < 0)
+    return -1;
+  *cursor = shmring_start(ring);
+  if((cfg.len = shmring_config(ring, buf, sizeof(buf))) > 0){
+    h264_parse_nals(&cfg);
+    h264_params_update(params, &cfg);
+  }
+  return 0;
+}
+
+/* the next access unit of the ring and its capture time: 1 got one,
+   0 the encoder is gone; codec config records only update params */
+static int ring_read_au(ShmRing *ring, uint64_t *cursor, H264AU *au, H264Params *params,
+                        int64_t *capture_us)
+{
+  ShmRec rec;
+  int rc;
+
+  while(1){
+    rc = shmring_next(ring, cursor, &rec);
+    if(rc == 0){
+      if(shmring_closed(ring))
+        return 0;
+      shmring_wait(ring, *cursor, 1000);
+      continue;
+    }
+    if(rc > 0 && rec.len <= H264_MAX_AU_SIZE){
+      memcpy(au->data, rec.data, rec.len);
+      if(!shmring_valid(ring, &rec)){
+        *cursor = shmring_start(ring);
+        rc = -1;
+      }
+    }
+    if(rc < 0){
+      fprintf(stderr, "SOURCE> behind the encoder's ring, again at its newest key frame\n");
+      continue;
+    }
+    if(rec.len > H264_MAX_AU_SIZE)
+      continue;
+    au->len = rec.len;
+    h264_parse_nals(au);
+    if((rec.flags & (SHMRING_CONFIG | SHMRING_KEY)) == SHMRING_CONFIG){
+      h264_params_update(params, au);
+      continue;
+    }
+    *capture_us = rec.pts;
+    return 1;
+  }
+}
+
+static void *source_loop(void *arg)
+{
+  Bcast *b = (Bcast *)arg;
+  H264Reader reader;
+  ShmRing ring;
+  uint64_t cursor = 0;
+  int shm = strncmp(b->path, "shm:", 4) == 0;
+  H264AU au;
+  H264Params params = { .len = 0 };
+  RtpPacketizer rtp;
+  TsMuxer tsm;
+  FecEncoder fec;
+  RtpPkt *src = NULL;                   // media packets, before FEC
+  BFrame *f;
+  uint32_t ts0, ts;
+  uint64_t pts;                         // 90 kHz
+  int64_t capture_us;
+  unsigned long frames = 0;
+  struct timespec next;
+  int rc, n, nmax, live;
+
+  if((shm ? ring_open(&ring, b->path + 4, &cursor, &params) : h264_reader_open(&reader, b->path)) < 0 ||
+     h264_au_alloc(&au) < 0){
+    fprintf(stderr, "Error: cannot open the video source %s\n", b->path);
+    goto out;
+  }
+  if(gFec.scheme != FEC_NONE){
+    /* smaller media packets: a repair (largest packet + FEC_OVERHEAD) fits RTP_PKT_SIZE */
+    rtp264_packetizer_init(&rtp, RTP_PKT_SIZE - FEC_OVERHEAD);
+    fec_encoder_init(&fec, &gFec);
+    src = malloc(MAX_PKTS_PER_AU * sizeof(RtpPkt));
+  }else
+    rtp264_packetizer_init(&rtp, RTP_PKT_SIZE);
+  ts_muxer_init(&tsm);
+  ts0 = rand();
+  /* the layers start within the same second: same seed, so an SSRC of
+     their own (the player restarts its jitter buffer on a new one) */
+  rtp.ssrc ^= (uint32_t)b->id << 24;
+  if(gFec.scheme != FEC_NONE)
+    fec.ssrc ^= (uint32_t)b->id << 24;
+  clock_gettime(CLOCK_MONOTONIC, &next);
+
+  live = shm || !reader.isfile;
+
+  while(1){
+    capture_us = 0;
+    rc = shm ? ring_read_au(&ring, &cursor, &au, &params, &capture_us) : h264_read_au(&reader, &au);
+    if(rc == 0 && !shm && h264_reader_rewind(&reader) == 0)
+      continue;                         // file: loop the clip
+    if(rc <= 0){
+      fprintf(stderr, "SOURCE> end of video source %s\n", b->path);
+      break;
+    }
+    h264_params_update(&params, &au);
+    h264_params_insert(&params, &au);
+
+    /* 0. the capture time: the encoder's SEI, else the ring's, passed on */
+    if(!h264_sei_capture_find(au.data, au.len, &capture_us) && capture_us > 0)
+      h264_sei_capture_insert(&au, capture_us);
+    if(live && capture_us > 0)
+      pts = (uint64_t)(capture_us / 1000000) * RTP_CLOCK +
+            (uint64_t)(capture_us % 1000000) * RTP_CLOCK / 1000000;   // us * 90000 overflows
+    else
+      pts = (unsigned long long)frames * RTP_CLOCK / STREAM_FRAMERATE;
+
+    /* 1. packetize straight into a shared frame */
+    nmax = gTs ? ts_max_dgrams(au.len) : au.len / (rtp.pktsize - RTP_HDR_SIZE - 2) + au.nnal + 1;
+    f = frame_alloc(b, nmax + fec_max_repair(&gFec, nmax));
+    ts = ts0 + (uint32_t)pts;
+    f->seq0 = rtp.seq;
+    if(gTs){
+      /* 1.1 datagrams of TS packets, not NACKed: no media packets to resend */
+      f->npkts = ts_mux(&tsm, &au, pts, f->arena, RTP_PKT_SIZE, f->pkts, f->cap);
+      f->nmedia = 0;
+    }else if(gFec.scheme == FEC_NONE)
+      f->npkts = f->nmedia = rtp264_packetize(&rtp, &au, ts, f->arena, f->pkts, f->cap);
+    else if(src && (n = rtp264_packetize(&rtp, &au, ts, f->arena, src, nmax < f->cap ? nmax : f->cap)) >= 0){
+      /* 1.2 the repairs after the media packets, f->pkts in send order */
+      f->nmedia = n;
+      f->npkts = fec_encode(&fec, src, n, f->arena + n * rtp.pktsize, RTP_PKT_SIZE, f->pkts, f->cap);
+    }else
+      f->npkts = -1;
+    if(f->npkts < 0){
+      fprintf(stderr, "SOURCE> access unit of %d bytes not packetized\n", au.len);
+      frame_put(f);
+      continue;
+    }
+    f->idr = au.idr;
+    f->ref = au_is_reference(&au);
+    f->capture_us = live ? capture_us : 0;   // a file's are of its recording
+    frame_publish(f);
+    frames++;
+
+    /* 2. a file has no clock of its own */
+    if(!shm && reader.isfile){
+      timespec_add_ns(&next, NSEC_PER_SEC/STREAM_FRAMERATE);
+      while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) != 0)
+        ;
+    }
+  }
+
+  free(src);
+  h264_au_free(&au);
+  if(shm)
+    shmring_close(&ring);
+  else
+    h264_reader_close(&reader);
+out:
+  pthread_mutex_lock(&b->lock);
+  b->eof = 1;
+  pthread_mutex_unlock(&b->lock);
+  bcast_wakeup();
+  return NULL;
+}
+
+
+/* clients ---------------------------------------------------------------
+
+   no thread per client: a client is a control socket and a send state
+   (frame, next packet, token bucket), served by the event loop. one
+   timerfd is armed for the earliest wake-up of them all.
+*/
+
+typedef struct {
+  unsigned long frames;
+  double sum_ms, max_ms;  // frame send duration
+  unsigned long cap_frames;
+  double cap_sum_ms, cap_max_ms;   // capture to sent
+  int max_qpkts;          // packets waiting in the pacer
+  int max_outq;           // bytes in the socket send queue (SIOCOUTQ)
+} PaceStat;
+
+typedef struct {
+  int inuse;
+  int ctlsock;                 // tcp control connection (non-blocking)
+  unsigned char rx[64];        // .. a message received in part
+  int rxlen;
+  struct sockaddr_in addr;     // udp destination
+  char name[32];
+
+  /* send state, while streaming */
+  int streaming;
+  int tcp;                     // over ctlsock ('t'), not udp
+  Bcast *bc;                   // the layer sent
+  Bcast *want;                 // .. switching to, from its first IDR on
+  unsigned long want_seq;      // .. number (or later) in want
+  int pkt_off;                 // tcp: bytes of packet pkt written (length included)
+  int blocked;                 // tcp: the socket is full, waits for EPOLLOUT
+  UdpTx *tx;
+  TokenBucket tb;
+  unsigned long cursor;        // next frame number
+  BFrame *f;                   // frame being sent
+  int pkt;                     // next packet of f
+  long long t_frame;           // f started
+  long long wake_ns;           // waits for tokens until, 0: not waiting
+  int catchup;                 // sending the GOP cache (frames behind at the start)
+  long long t_start;
+
+  unsigned long frames, skipped;
+  unsigned long dropped;       // packets the udp socket refused
+  PaceStat ps;
+
+  /* retransmissions (NACK) */
+  TokenBucket rtx_tb;
+  unsigned long rtx_sent, rtx_stale, rtx_limited, rtx_gone;
+
+  /* rate control */
+  AbrCtl abr;
+  RtcpReport rep;              // last receiver report
+  unsigned long rtx_reported;  // rtx_sent at that report
+} Client;
+
+static Client gClients[MAX_CLIENTS];
+static int gUdpSock;           // shared by all clients
+static int gEpfd;              // the event loop's, tcp streams wait there to write
+static Client gMcast;          // the multicast stream (-M), no control connection
+static int gMcastSock = -1;    // .. its own socket: TTL, interface
+
+static int set_nonblock(int fd)
+{
+  int fl = fcntl(fd, F_GETFL, 0);
+  return fl < 0 ? -1 : fcntl(fd, F_SETFL, fl | O_NONBLOCK);
+}
+
+/* tcp stream: wait for the socket to take more (EPOLLOUT), or stop waiting */
+static void tcp_block(Client *cl, int on)
+{
+  struct epoll_event ev;
+
+  ev.events = on ? EPOLLIN | EPOLLOUT : EPOLLIN;
+  ev.data.u32 = cl - gClients;
+  epoll_ctl(gEpfd, EPOLL_CTL_MOD, cl->ctlsock, &ev);
+  cl->blocked = on;
+}
 
 
 /* UDP streamer ----------------------------------------------------------
 
-   send UDP packets (now dummy data, later video)
-   IN:  arg (dest udp socket address)  
-   GLOBAL: use gStreamStopReq 
-   OUT: success or not  
+   send the shared frames to a client as RTP packets, from the newest
+   frame on; the packets are sent in bursts (sendmmsg, UDP GSO), see
+   udptx.h
 
+   packets of a frame are paced by a token bucket: an IDR is hundreds of
+   KB and one burst of it overflows router and radio queues. the rate is
+   the target (-r) or the frame's own bitrate, whichever is higher, plus
+   headroom (-H) so that each frame leaves within its frame interval.
+   a client without tokens does not sleep: it sets wake_ns and returns.
+   a new client starts at the GOP cache's IDR and catches up at -G times
+   the rate until it reaches the newest frame.
 */
-   
-static void *stream_loop(void *arg) {
-  
-  int sock, rc, n, cliLen, flags;
-  struct sockaddr_in servAddr;
-  char msg[MAX_MSG];
-  short localport = LOCAL_SERVER_PORT;
-  struct sockaddr_in cliAddr = *(struct sockaddr_in *)arg; // make a copy for modified
 
-  /* 1. socket creation */
-  sock=socket(AF_INET, SOCK_DGRAM, 0);
-  if(sock<0) {
-    fprintf(stderr, "Error:cannot open udp socket (%d)\n",localport);
-    pthread_exit((void *)-1);
+static int stream_start(Client *cl, int tcp)
+{
+  int one = 1, lowat = TCP_LOWAT;
+
+  if(cl->streaming)
+    return 0;
+  if(tcp && (setsockopt(cl->ctlsock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) < 0 ||
+             setsockopt(cl->ctlsock, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat)) < 0)){
+    fprintf(stderr, "Error: cannot set up tcp streaming\n");
+    return -1;
   }
+  cl->tx = malloc(sizeof(UdpTx));
+  if(cl->tx == NULL){
+    fprintf(stderr, "Error: cannot allocate udp sender\n");
+    return -1;
+  }
+  udptx_init(cl->tx, cl == &gMcast ? gMcastSock : gUdpSock, 1);
+  tb_init(&cl->tb, gPaceKbps * 1000.0, PACE_BURST_PKTS * RTP_PKT_SIZE);
+  tb_init(&cl->rtx_tb, gRtxKbps * 1000.0, PACE_BURST_PKTS * RTP_PKT_SIZE);
+  cl->rtx_sent = cl->rtx_stale = cl->rtx_limited = cl->rtx_gone = 0;
+  abr_init(&cl->abr, ABR_MIN_KBPS * 1000.0, ABR_MAX_KBPS * 1000.0, gAbrBitrate);
+  memset(&cl->rep, 0, sizeof(cl->rep));
+  cl->rtx_reported = 0;
+  memset(&cl->ps, 0, sizeof(cl->ps));
+  cl->frames = cl->skipped = cl->dropped = 0;
+  cl->f = NULL;
+  cl->wake_ns = 0;
+  cl->want = NULL;
 
-  /* 2. bind local server port */
-  servAddr.sin_family = AF_INET;
-  servAddr.sin_addr.s_addr = htonl(INADDR_ANY);
-  servAddr.sin_port = htons(STREAM_CLIENT_PORT-1); // can use any not conflicting  
-  rc = bind (sock, (struct sockaddr *) &servAddr,sizeof(servAddr));
-  if(rc<0) {
-    fprintf(stderr, "Error: cannot bind port number %d\n", localport);
-    pthread_exit((void *)-1);
+  /* start at the cached IDR, else at the newest frame */
+  pthread_mutex_lock(&cl->bc->lock);
+  cl->cursor = cl->bc->next_seq ? cl->bc->next_seq - 1 : 0;
+  cl->catchup = 0;
+  if(cl->bc->gop_n > 0){
+    cl->cursor = cl->bc->gop[0]->seq;
+    cl->catchup = cl->bc->next_seq - cl->cursor;
+  }
+  pthread_mutex_unlock(&cl->bc->lock);
+  cl->t_start = now_ns();
+
+  cl->streaming = 1;
+  cl->tcp = tcp;
+  if(gNumLayers > 1)
+    fprintf(stdout, "STREAM %s> layer %d\n", cl->name, cl->bc->id);
+  if(tcp)
+    fprintf(stdout, "STREAM %s> over tcp, %d KB unsent at most\n", cl->name, TCP_LOWAT / 1024);
+  else
+    fprintf(stdout, "STREAM %s> batched send, GSO %s\n", cl->name, cl->tx->gso ? "on" : "off");
+  if(cl->catchup)
+    fprintf(stdout, "STREAM %s> starts at the cached IDR, %d frames behind\n", cl->name, cl->catchup);
+  return 0;
+}
+
+static void stream_stop(Client *cl)
+{
+  if(!cl->streaming)
+    return;
+  if(cl->f)
+    frame_put(cl->f);
+  cl->f = NULL;
+  if(cl->blocked)
+    tcp_block(cl, 0);
+  free(cl->tx);
+  cl->tx = NULL;
+  cl->streaming = 0;
+}
+
+/* a frame is out: statistics and next frame */
+static void frame_done(Client *cl, long long now)
+{
+  PaceStat *ps = &cl->ps;
+  double ms = (now - cl->t_frame) / 1e6;
+  UdpTx *tx = cl->tx;
+  int outq;
+
+  if(ioctl(cl->tcp ? cl->ctlsock : tx->sock, SIOCOUTQ, &outq) == 0 && outq > ps->max_outq)
+    ps->max_outq = outq;
+  ps->frames++;
+  ps->sum_ms += ms;
+  if(ms > ps->max_ms)
+    ps->max_ms = ms;
+  if(cl->f->capture_us > 0){
+    ms = (realtime_us() - cl->f->capture_us) / 1e3;
+    ps->cap_frames++;
+    ps->cap_sum_ms += ms;
+    if(ms > ps->cap_max_ms)
+      ps->cap_max_ms = ms;
+  }
+
+  frame_put(cl->f);
+  cl->f = NULL;
+  cl->cursor++;
+  cl->frames++;
+
+  if(cl->frames % (STREAM_FRAMERATE*5) == 0){
+    fprintf(stdout, "STREAM %s> %lu frames %lu skipped %lu packets %.2f syscalls/frame %lu errors\n",
+            cl->name, cl->frames, cl->skipped, tx->packets, (double)tx->syscalls / cl->frames, tx->errors);
+    fprintf(stdout, "STREAM %s> send ms avg %.2f max %.2f, queue max %d pkts %d bytes in socket\n",
+            cl->name, ps->sum_ms / ps->frames, ps->max_ms, ps->max_qpkts, ps->max_outq);
+    if(ps->cap_frames)
+      fprintf(stdout, "STREAM %s> capture to sent ms avg %.2f max %.2f\n",
+              cl->name, ps->cap_sum_ms / ps->cap_frames, ps->cap_max_ms);
+    if(cl->rtx_sent + cl->rtx_stale + cl->rtx_limited + cl->rtx_gone)
+      fprintf(stdout, "STREAM %s> resent %lu, not resent: %lu too old %lu over rate %lu not cached\n",
+              cl->name, cl->rtx_sent, cl->rtx_stale, cl->rtx_limited, cl->rtx_gone);
+    if(cl->rep.recv_kbps)
+      fprintf(stdout, "STREAM %s> receiver: loss %.1f%% receive %u kbit/s delay %+.1f ms/s jitter %.1f ms\n",
+              cl->name, cl->rep.fraction_lost * 100 / 256.0, cl->rep.recv_kbps, cl->rep.trend_us / 1000.0,
+              cl->rep.jitter * 1000.0 / RTP_CLOCK);
+    memset(ps, 0, sizeof(*ps));
+  }
+}
+
+/* between frames: the layer asked for (CTL_LAYER) has its first IDR since
+   the request out, the client goes on from there */
+static void layer_switch(Client *cl)
+{
+  Bcast *b = cl->want;
+  unsigned long idr;
+
+  pthread_mutex_lock(&b->lock);
+  idr = b->last_idr;
+  pthread_mutex_unlock(&b->lock);
+  if(idr <= cl->want_seq)
+    return;
+  fprintf(stdout, "STREAM %s> layer %d -> %d\n", cl->name, cl->bc->id, b->id);
+  cl->bc = b;
+  cl->cursor = idr - 1;
+  cl->catchup = 0;
+  cl->want = NULL;
+}
+
+/* TCP streamer ----------------------------------------------------------
+
+   't' instead of 's': the frames go over the control connection, for
+   links that block udp. each packet has the 2 byte length of RFC 4571
+   in front, a frame goes out in one sendmsg (MSG_MORE between the
+   calls of a frame too large for one). after the 'a' the connection
+   carries nothing else: later commands are not answered.
+
+   the kernel must not queue seconds of video for a slow link: with
+   TCP_NOTSENT_LOWAT the socket is writable only while less than
+   TCP_LOWAT bytes wait unsent, and a frame starts only then. until it
+   is, non-reference frames are dropped whole and a reference frame
+   waits; a client that falls behind the ring meanwhile jumps to the
+   newest frame, as over udp. a frame once begun is finished, the
+   stream stays framed. a full socket is not retried: the stream
+   waits for EPOLLOUT, which comes below TCP_LOWAT. no packet pacing
+   (TCP has its own), but the GOP cache still goes at -G times the
+   frame rate.
+*/
+
+static int tcp_writable(int sock)
+{
+  struct pollfd pfd = { sock, POLLOUT };
+  return poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLOUT);
+}
+
+/* the rest of the frame: 1 sent, 0 the socket is full, -1 error */
+static int tcp_send(Client *cl)
+{
+  struct iovec iov[TCP_MAX_IOV];
+  unsigned char hdr[TCP_MAX_IOV / 2][2];
+  struct msghdr msg = { 0 };
+  const RtpPkt *p;
+  int i, k, off;
+  ssize_t n;
+
+  while(cl->pkt < cl->f->npkts){
+    /* 1. length and packet, from where the last write stopped */
+    for(i = 0, k = 0; cl->pkt + i < cl->f->npkts && k + 2 <= TCP_MAX_IOV; i++){
+      p = &cl->f->pkts[cl->pkt + i];
+      hdr[i][0] = p->len >> 8;
+      hdr[i][1] = p->len;
+      off = i == 0 ? cl->pkt_off : 0;
+      if(off < 2){
+        iov[k].iov_base = hdr[i] + off;
+        iov[k++].iov_len = 2 - off;
+        off = 2;
+      }
+      iov[k].iov_base = p->data + off - 2;
+      iov[k++].iov_len = p->len + 2 - off;
+    }
+    msg.msg_iov = iov;
+    msg.msg_iovlen = k;
+    n = sendmsg(cl->ctlsock, &msg, cl->pkt + i < cl->f->npkts ? MSG_MORE : 0);
+    cl->tx->syscalls++;
+    if(n < 0)
+      return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+
+    /* 2. whole packets written, and part of the next */
+    while(n > 0){
+      p = &cl->f->pkts[cl->pkt];
+      k = p->len + 2 - cl->pkt_off;
+      if(n < k){
+        cl->pkt_off += n;
+        break;
+      }
+      n -= k;
+      cl->pkt++;
+      cl->pkt_off = 0;
+      cl->tx->packets++;
+    }
+  }
+  return 1;
+}
+
+static void stream_pump_tcp(Client *cl, long long now)
+{
+  int rc;
+
+  cl->wake_ns = 0;
+  if(cl->blocked)
+    return;                     // EPOLLOUT wakes it
+  while(cl->streaming){
+    if(cl->f == NULL){
+      /* the GOP cache at -G times the frame rate, as over udp */
+      if(cl->catchup && now < cl->t_frame + NSEC_PER_SEC / (STREAM_FRAMERATE * gGopSpeed)){
+        cl->wake_ns = cl->t_frame + NSEC_PER_SEC / (STREAM_FRAMERATE * gGopSpeed);
+        return;
+      }
+      if(cl->want)
+        layer_switch(cl);
+      cl->f = frame_try_get(cl->bc, &cl->cursor, &cl->skipped, cl->catchup);
+      if(cl->f == NULL){
+        cl->catchup = 0;
+        return;
+      }
+      cl->pkt = cl->pkt_off = 0;
+      cl->t_frame = now;
+    }
+
+    /* 1. a new frame only while the kernel has little unsent */
+    if(cl->pkt == 0 && cl->pkt_off == 0 && !tcp_writable(cl->ctlsock)){
+      if(!cl->f->ref){
+        frame_put(cl->f);
+        cl->f = NULL;
+        cl->cursor++;
+        cl->skipped++;
+        continue;
+      }
+      tcp_block(cl, 1);
+      return;
+    }
+
+    /* 2. all of it, or as much as the socket takes */
+    rc = tcp_send(cl);
+    if(rc < 0){
+      cl->tx->errors++;
+      stream_stop(cl);        // the read side sees the connection go
+      return;
+    }
+    if(rc == 0){
+      tcp_block(cl, 1);
+      return;
+    }
+    now = now_ns();
+    frame_done(cl, now);
+  }
+}
+
+/* send what the pacer allows, never blocks */
+static void stream_pump(Client *cl, long long now)
+{
+  int i, k, bytes;
+  long long wait;
+  double frame_bps, rate;
+
+  if(cl->tcp){
+    stream_pump_tcp(cl, now);
+    return;
+  }
+  cl->wake_ns = 0;
+  while(cl->streaming){
+
+    /* 1. next frame */
+    if(cl->f == NULL){
+      if(cl->want)
+        layer_switch(cl);
+      cl->f = frame_try_get(cl->bc, &cl->cursor, &cl->skipped, cl->catchup);
+      if(cl->f == NULL){
+        if(cl->catchup)
+          fprintf(stdout, "STREAM %s> live after %lu frames, %.0f ms\n",
+                  cl->name, cl->frames, (now - cl->t_start) / 1e6);
+        cl->catchup = 0;
+        return;                 // the event loop wakes us on a new frame
+      }
+      cl->pkt = 0;
+      cl->t_frame = now;
+      if(gPaceHeadroom >= 0){
+        frame_bps = cl->f->bytes * 8.0 * STREAM_FRAMERATE;
+        rate = gPaceKbps * 1000.0 > frame_bps ? gPaceKbps * 1000.0 : frame_bps;
+        if(cl->catchup)
+          rate *= gGopSpeed;
+        tb_set_rate(&cl->tb, rate * (100 + gPaceHeadroom) / 100);
+      }
+    }
+
+    /* 2. bursts while there are tokens */
+    while(cl->pkt < cl->f->npkts){
+      const RtpPkt *pkts = cl->f->pkts + cl->pkt;
+
+      k = cl->f->npkts - cl->pkt;
+      if(k > cl->ps.max_qpkts)
+        cl->ps.max_qpkts = k;
+      if(gPaceHeadroom >= 0){
+        if(k > PACE_BURST_PKTS)
+          k = PACE_BURST_PKTS;
+        for(i = 0, bytes = 0; i < k; i++)
+          bytes += pkts[i].len;
+        wait = tb_try_take(&cl->tb, bytes);
+        if(wait > 0){
+          cl->wake_ns = now + wait;
+          return;
+        }
+      }
+      cl->dropped += k - udptx_send(cl->tx, &cl->addr, pkts, k);
+      cl->pkt += k;
+    }
+
+    now = now_ns();
+    frame_done(cl, now);
+  }
+}
+
+
+/* retransmission -------------------------------------------------------
+
+   NACKs (RTCP generic NACK) come to the shared udp socket from the
+   players' stream port. the NACK's media SSRC tells the layer: one sent
+   just before a layer switch is of the old layer, whose frames are
+   still in its ring. each lost packet is sent again, unless its frame
+   left the ring, it is older than RTX_DEADLINE_MS (the player gave up on
+   it, sending it only costs rate) or the client's retransmission bucket
+   (-R) is empty: no queueing, a late retransmission is a useless one.
+*/
+
+/* the layer whose packets carry ssrc, NULL if none (yet) */
+static Bcast *layer_find(uint32_t ssrc)
+{
+  Bcast *b;
+  BFrame *f;
+  int l, i, found;
+
+  for(l = 0; l < gNumLayers; l++){
+    b = &gBcast[l];
+    pthread_mutex_lock(&b->lock);
+    for(i = 0, found = 0; i < BCAST_RING && !found; i++)
+      found = (f = b->ring[i]) != NULL && f->npkts > 0 && rtp_ssrc(f->pkts[0].data) == ssrc;
+    pthread_mutex_unlock(&b->lock);
+    if(found)
+      return b;
+  }
+  return NULL;
+}
+
+static void stream_resend(Client *cl, uint32_t ssrc, const uint16_t *seqs, int n, long long now)
+{
+  BFrame *held[RTCP_MAX_NACK];
+  RtpPkt pkts[RTCP_MAX_NACK];
+  const RtpPkt *pkt;
+  Bcast *b = layer_find(ssrc);
+  BFrame *f;
+  int i, k = 0;
+
+  for(i = 0; i < n; i++){
+    f = b ? frame_find_pkt(b, seqs[i], &pkt) : NULL;
+    if(f == NULL){
+      cl->rtx_gone++;
+      continue;
+    }
+    if(now - f->t_pub > RTX_DEADLINE_MS * 1000000LL)
+      cl->rtx_stale++;
+    else if(tb_try_take(&cl->rtx_tb, pkt->len) > 0)
+      cl->rtx_limited++;
+    else{
+      pkts[k] = *pkt;
+      held[k++] = f;
+      continue;
+    }
+    frame_put(f);
+  }
+
+  /* the frames are held until the packets are out */
+  if(k > 0)
+    cl->rtx_sent += udptx_send(cl->tx, &cl->addr, pkts, k);
+  for(i = 0; i < k; i++)
+    frame_put(held[i]);
+}
+
+/* encoder control ------------------------------------------------------
+
+   one command per line to the encoder's control fifo (-E,
+   rpi-camera-encode2 file1 file2 <fifo>). the fifo is opened when there
+   is something to write: the encoder may start after the streamer, or
+   restart. returns -1 if the encoder did not get it.
+*/
+
+static int encoder_command(const char *line)
+{
+  int n = strlen(line);
+
+  if(gEncPath == NULL)
+    return -1;
+  if(gEncFd < 0)
+    gEncFd = open(gEncPath, O_WRONLY | O_NONBLOCK | O_APPEND);
+  if(gEncFd < 0)
+    return -1;                   // no encoder on the fifo (yet)
+  if(write(gEncFd, line, n) != n){
+    close(gEncFd);
+    gEncFd = -1;
+    return -1;
   }
+  return 0;
+}
+
+
+/* key frame on demand --------------------------------------------------
+
+   a player that starts, or lost a reference, asks for an IDR ('k')
+   rather than waiting for the next periodic one. an IDR costs the bits
+   of several frames, so the requests of all clients are rate limited:
+   one goes to the encoder each IDR_MIN_INTERVAL_MS at most, one coming
+   in sooner waits for the end of the interval (pending), and those
+   coming while a forwarded one is not out of the encoder yet are served
+   by it (coalesced). the encoder makes an IDR on every layer, each
+   layer's is waited for on its own: the layers' frames do not line up.
+*/
+
+static struct {
+  long long t_fwd;             // last forwarded
+  unsigned long seq[MAX_LAYERS];   // each layer's frame number then, its IDR comes after
+  int waiting[MAX_LAYERS];     // forwarded, the layer's IDR is not out yet
+  int pending;                 // forward at the end of the interval
+  unsigned long requests, forwarded;
+} gIdr;
 
-  /* 3. prepare destination address */
-  //cliAddr.sin_family = AF_INET;
-  //cliAddr.sin_addr.s_addr = htonl(); // same destination as contoller 
-  cliAddr.sin_port = htons(1501);      // different port 
-  cliLen = sizeof(struct sockaddr_in);
+static void idr_forward(long long now)
+{
+  int l;
 
-  flags = 0;
+  gIdr.pending = 0;
+  if(encoder_command("idr\n") < 0)
+    return;
+  gIdr.t_fwd = now;
+  gIdr.forwarded++;
+  for(l = 0; l < gNumLayers; l++){
+    pthread_mutex_lock(&gBcast[l].lock);
+    gIdr.seq[l] = gBcast[l].next_seq;
+    pthread_mutex_unlock(&gBcast[l].lock);
+    gIdr.waiting[l] = 1;
+  }
+}
+
+/* a client needs an IDR of layer b ('k', a layer switch), -1 if there is
+   no encoder to ask */
+static int idr_request(Bcast *b, long long now)
+{
+  if(gEncPath == NULL)
+    return -1;
+  gIdr.requests++;
+  if(gIdr.waiting[b->id] || gIdr.pending)
+    return 0;
+  if(now - gIdr.t_fwd < IDR_MIN_INTERVAL_MS * 1000000LL)
+    gIdr.pending = 1;
+  else
+    idr_forward(now);
+  return 0;
+}
 
-  /* 4. infinite loop */
-  while(gStreamStopReq != 1) {
+/* event loop: the requested IDR is out, the pending one is due; returns
+   the time it is due, 0 if none */
+static long long idr_poll(long long now)
+{
+  long long due = gIdr.t_fwd + IDR_MIN_INTERVAL_MS * 1000000LL;
+  int l, out;
 
-    fprintf(stdout, "STREAM> Alive \n");
-    
-    /* init buffer with dummy data (0xF0) */
-    memset(msg,0xF0,MAX_MSG);
+  for(l = 0; l < gNumLayers; l++){
+    if(!gIdr.waiting[l])
+      continue;
+    pthread_mutex_lock(&gBcast[l].lock);
+    out = gBcast[l].last_idr > gIdr.seq[l];
+    pthread_mutex_unlock(&gBcast[l].lock);
+    if(out)
+      fprintf(stdout, "IDR> layer %d key frame %.0f ms after the request (%lu requests, %lu to the encoder)\n",
+              l, (now - gIdr.t_fwd) / 1e6, gIdr.requests, gIdr.forwarded);
+    if(out || now - gIdr.t_fwd > IDR_TIMEOUT_MS * 1000000LL)
+      gIdr.waiting[l] = 0;
+  }
+  if(!gIdr.pending)
+    return 0;
+  if(now >= due){
+    idr_forward(now);
+    return 0;
+  }
+  return due;
+}
 
-    n = MAX_MSG; // temporary
-    n = sendto(sock,msg,n,flags,(struct sockaddr *)&cliAddr,cliLen);
-    if(n < MAX_MSG)
-   	fprintf(stderr,"cannot send all data (%d) to client\n", n);
 
-    usleep(1000000L); // slow down for debugging
-    
-  }/* end of server infinite loop */
+/* rate control ---------------------------------------------------------
 
+   a receiver report updates its client's controller; the packets resent
+   since the last report count as lost (the player counts them received,
+   but the link lost them first). the encoder gets
+   the lowest target of the streaming clients when it moved by ABR_STEP
+   or more. only the clients of layer 0 count: the bitrate is that of
+   the encoder's main output, a player that picked a smaller layer
+   already asked for less.
+*/
 
-  /* 5. finish */
-  close(sock);
-  pthread_exit((void *)0); // user-requested-stop
+static void abr_set_bitrate(double bps)
+{
+  char line[32];
 
+  snprintf(line, sizeof(line), "bitrate %d\n", (int)bps);
+  if(encoder_command(line) == 0)
+    gAbrBitrate = bps;
 }
 
+static void abr_input(Client *cl, const RtcpReport *rep, long long now)
+{
+  RtcpReport r = *rep;
+  double target = 0, lost;
+  uint32_t expected = rep->ext_seq - cl->rep.ext_seq;
+  int i;
+
+  if(cl->rep.ext_seq && expected > 0 && expected < 0x8000){
+    lost = r.fraction_lost / 256.0 + (double)(cl->rtx_sent - cl->rtx_reported) / expected;
+    r.fraction_lost = lost < 1 ? lost * 256 : 255;
+  }
+  cl->rtx_reported = cl->rtx_sent;
+  cl->rep = r;
+  if(!gAbr)
+    return;
+  abr_update(&cl->abr, &r, now);
+
+  for(i = 0; i < MAX_CLIENTS; i++)
+    if(gClients[i].inuse && gClients[i].streaming && gClients[i].abr.reports &&
+       gClients[i].bc == &gBcast[0] && (target == 0 || gClients[i].abr.target < target))
+      target = gClients[i].abr.target;
+  if(target == 0 || (target < gAbrBitrate * (1 + ABR_STEP) && target > gAbrBitrate * (1 - ABR_STEP)))
+    return;
+
+  abr_set_bitrate(target);
+  fprintf(stdout, "ABR> bitrate %.0f kbit/s%s (%s: loss %.1f%% receive %u kbit/s delay %+.1f ms/s)\n",
+          target / 1000, gEncFd < 0 ? " not set, no encoder" : "", cl->name,
+          r.fraction_lost * 100 / 256.0, r.recv_kbps, r.trend_us / 1000.0);
+}
+
+/* read the NACKs and receiver reports waiting on the udp socket */
+static void rtcp_input(long long now)
+{
+  unsigned char buf[RTCP_MAX_SIZE];
+  uint16_t seqs[RTCP_MAX_NACK];
+  uint32_t ssrc;
+  struct sockaddr_in from;
+  socklen_t fromlen;
+  RtcpReport rep;
+  Client *cl;
+  int len, n, i;
+
+  while(1){
+    fromlen = sizeof(from);
+    len = recvfrom(gUdpSock, buf, sizeof(buf), 0, (struct sockaddr *)&from, &fromlen);
+    if(len < 0)
+      return;                    // EAGAIN: no more for now
+
+    for(i = 0, cl = NULL; i < MAX_CLIENTS && cl == NULL; i++)
+      if(gClients[i].inuse && gClients[i].streaming &&
+         gClients[i].addr.sin_addr.s_addr == from.sin_addr.s_addr &&
+         gClients[i].addr.sin_port == from.sin_port)
+        cl = &gClients[i];
+    /* a player of the group: its NACKs are answered on the group */
+    for(i = 0; i < MAX_CLIENTS && cl == NULL && gMcast.streaming; i++)
+      if(gClients[i].inuse && gClients[i].addr.sin_addr.s_addr == from.sin_addr.s_addr)
+        cl = &gMcast;
+    if(cl == NULL)
+      continue;
+
+    if(rtcp_report_parse(buf, len, &rep) == 0){
+      if(cl != &gMcast)
+        abr_input(cl, &rep, now);
+    }
+    else if((n = rtcp_nack_parse(buf, len, &ssrc, seqs, RTCP_MAX_NACK)) > 0 && gRtxKbps > 0)
+      stream_resend(cl, ssrc, seqs, n, now);
+  }
+}
+
+
 /* open a tcp server socket --------------------------------------------- 
  a wrapper function to hide dirty details 
 
@@ -110,7 +1242,7 @@ static void *stream_loop(void *arg) {
 
 static int open_listenfd(short portNum)
 {
-  int sock, rc;
+  int sock, rc, one = 1;
   struct sockaddr_in servAddr;
 
   sock=socket(AF_INET, SOCK_STREAM, 0);
@@ -119,7 +1251,9 @@ static int open_listenfd(short portNum)
     return -1; 
   }
 
-  /* bind local server port */
+  /* bind local server port, also while the last run's connections are
+     in TIME_WAIT */
+  setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
   servAddr.sin_family = AF_INET;
   servAddr.sin_addr.s_addr = htonl(INADDR_ANY);
   servAddr.sin_port = htons(portNum);
@@ -134,124 +1268,462 @@ static int open_listenfd(short portNum)
 
 /* stream control module ----------------------------------------------- 
    control via TCP connection (to reliable communicaiton and detect connection loss)
-   command : start streaming and stop
-   response: ack and nack 
+   command : start streaming, stop, and 'k' for a key frame now
+   response: ack and nack ('k': nack if there is no encoder to ask)
+   a command comes as one byte, answered by one, or as a message
+   (ctlmsg.h), answered by a message; so is the stats query.
+
+   called when the (non-blocking) control socket is readable,
+   returns -1 when the connection is to be closed
 */
 
-static int stream_control(int sock, struct sockaddr_in *pCliAddr)
+/* one command, returns 'a' or 'n' */
+static int control_command(Client *cl, int cmd)
+{
+   switch(cmd){
+   case 's':
+	if(gMcastGroup)
+	   return 'a';   // the player joins the group, no stream of its own
+	return stream_start(cl, 0) == 0 ? 'a' : 'n'; // ack or nack
+   case 't': // start streaming over this connection
+	return stream_start(cl, 1) == 0 ? 'a' : 'n';
+   case 'k': // key frame request
+	return idr_request(cl->want ? cl->want : cl->bc, now_ns()) == 0 ? 'a' : 'n';
+   case 'c': // finish streaming
+	stream_stop(cl);
+	return 'a';
+   default:
+	return 'n';
+   }
+}
+
+/* CTL_LAYER: the layer from 's' on, or from its next IDR on (the encoder
+   is asked for it), so the player never gets a frame it cannot decode;
+   the multicast stream stays on layer 0. returns 'a' or 'n' */
+static int layer_select(Client *cl, int id)
+{
+   Bcast *b;
+
+   if(id >= gNumLayers || (gMcastGroup && id != 0))
+	return 'n';
+   b = &gBcast[id];
+   if(!cl->streaming || b == cl->bc){
+	if(!cl->streaming)
+	   cl->bc = b;
+	cl->want = NULL;
+	return 'a';
+   }
+   pthread_mutex_lock(&b->lock);
+   cl->want_seq = b->next_seq;
+   pthread_mutex_unlock(&b->lock);
+   cl->want = b;
+   idr_request(b, now_ns());
+   return 'a';
+}
+
+/* the streamer's state for a stats query */
+static void stats_collect(CtlStats *st, long long now)
+{
+   struct tcp_info ti;
+   socklen_t len;
+   CtlClientStats *c;
+   Client *cl;
+   unsigned long next_seq;
+   int i;
+
+   memset(st, 0, sizeof(*st));
+   st->uptime_ms = (now - gStartNs) / 1000000;
+   pthread_mutex_lock(&gBcast[0].lock);
+   st->frames = gBcast[0].next_seq;
+   st->fps100 = gBcast[0].fps * 100;
+   st->kbps   = gBcast[0].kbps;
+   pthread_mutex_unlock(&gBcast[0].lock);
+   for(i = -1; i < MAX_CLIENTS && st->nclients < CTL_MAX_CLIENTS; i++){
+	cl = i < 0 ? &gMcast : &gClients[i];   // the group first, its address
+	if(!cl->inuse)
+	   continue;
+	c = &st->client[st->nclients++];
+	c->addr = cl->addr.sin_addr.s_addr;
+	c->streaming = cl->streaming;
+	c->layer = cl->bc->id;
+	if(cl->streaming){
+	   pthread_mutex_lock(&cl->bc->lock);
+	   next_seq = cl->bc->next_seq;
+	   pthread_mutex_unlock(&cl->bc->lock);
+	   c->queue_pkts   = cl->f ? cl->f->npkts - cl->pkt : 0;
+	   c->queue_frames = next_seq - cl->cursor - (cl->f != NULL);
+	   c->sent         = cl->tx->packets;
+	}
+	c->dropped       = cl->dropped;
+	c->skipped       = cl->skipped;
+	c->resent        = cl->rtx_sent;
+	c->fraction_lost = cl->rep.fraction_lost;
+	c->recv_kbps     = cl->rep.recv_kbps;
+	len = sizeof(ti);
+	if(getsockopt(cl->ctlsock, IPPROTO_TCP, TCP_INFO, &ti, &len) == 0){
+	   c->rtt_us    = ti.tcpi_rtt;
+	   c->rttvar_us = ti.tcpi_rttvar;
+	}
+   }
+   if(gAbr)
+	st->target_kbps = gAbrBitrate / 1000;
+}
+
+static int stream_control(Client *cl)
 {
-   size_t n;
-   int r;
-   pthread_t tid;
-   int  retval;
-   char rxbuf[128]; /* one byte only used */
-   char txbuf[128]; /* one byte only used */
+   int n, i, used, type, plen, rsp;
+   int sock = cl->ctlsock;
+   const unsigned char *payload;
+   unsigned char txbuf[CTL_MAX_MSG];
+   CtlStats st;
    int flags = 0;
 
-   while(1){
-
-	// 1. get commands from client
-   	n = recv(sock, rxbuf, 128, flags);
-
-	// 2. prorocol error check 
-   	if (n<=0){
-		fprintf(stderr, "read error: connection closed\n");
-                gStreamStopReq = 1;
-	  	r = pthread_join(tid, (void **)&retval);  
-		gStreamStopReq = 0;
-		return -1;  // abnormal finish 
-   	}
-   	else if(n > 1){ 
-		fprintf(stderr, "protocol error: too big msg\n");
-		txbuf[0]  = 'n'; // nack
-		write(sock, txbuf, 1);
+   // 1. get commands from client
+   n = recv(sock, cl->rx + cl->rxlen, sizeof(cl->rx) - cl->rxlen, flags);
+
+   // 2. prorocol error check 
+   if (n<0 && (errno == EAGAIN || errno == EINTR))
+	return 0;
+   if (n<=0){
+	fprintf(stderr, "read error: connection closed\n");
+	return -1;  // abnormal finish 
+   }
+   cl->rxlen += n;
+
+   // 3. protocol handle: one byte commands and messages
+   for(i = 0; i < cl->rxlen; i += used){
+
+	if(cl->rx[i] != CTL_MAGIC){
+	   used = 1;
+	   type = cl->rx[i];
+	   txbuf[0] = rsp = control_command(cl, type);
+	   if(!(cl->streaming && cl->tcp) || type == 't')
+		write(sock, txbuf, 1);  // a tcp stream carries no answers
+	}else{
+	   used = ctl_msg_parse(cl->rx + i, cl->rxlen - i, &type, &payload, &plen);
+	   if(used == 0 && i == 0 && cl->rxlen == sizeof(cl->rx))
+		used = -1;        // longer than any request
+	   if(used < 0){
+		fprintf(stderr, "CNTL> bad message from %s\n", cl->name);
+		return -1;
+	   }
+	   if(used == 0)
+		break;            // the rest comes with the next read
+	   if(type == CTL_LAYER){
+		rsp = plen == 1 ? layer_select(cl, payload[0]) : 'n';
+		if(!(cl->streaming && cl->tcp))
+		   write(sock, txbuf, ctl_msg_build(txbuf, rsp, NULL, 0));
+	   }else if(cl->streaming && cl->tcp){
+		rsp = type == CTL_STATS_REQ ? 'n' : control_command(cl, type);
+	   }else if(type == CTL_STATS_REQ){
+		stats_collect(&st, now_ns());
+		rsp = ctl_stats_build(txbuf + CTL_HDR_SIZE, &st);
+		write(sock, txbuf, ctl_msg_build(txbuf, CTL_STATS, txbuf + CTL_HDR_SIZE, rsp));
 		continue;
-   	}
-	// 3. protocol handle
-	else{
-
-		switch(rxbuf[0]){
-
-		case 's':
-			r = pthread_create(&tid, NULL, stream_loop, (void *)pCliAddr);
-                   	if(r!=0){
-				fprintf(stderr, "ERROR:pthread_create\n");
-				txbuf[0]  = 'n'; // ack
-				write(sock, txbuf, 1);
-			}else{
-				txbuf[0]  = 'a'; // ack
-				write(sock, txbuf, 1);
-			}
-
-			break;
-		case 'c': // finish streaming
-                   	gStreamStopReq = 1;
-		   	r = pthread_join(tid, (void **)&retval); // TODO: check it run successfully 
-			gStreamStopReq = 0;
-		 	if(r!=0){
-				fprintf(stderr, "ERROR:pthread_join\n");
-		 		gStreamStopReq = 0;
-				txbuf[0]  = 'n'; // ack
-				write(sock, txbuf, 1);
-
-			}else{
-				txbuf[0]  = 'a'; // ack
-				write(sock, txbuf, 1);
-				return 0; // normal  finish 
-			}
-
-		default:
-			txbuf[0]  = 'n'; // nack
-			write(sock, txbuf, 1);
-			break;
-		}
+	   }else{
+		rsp = control_command(cl, type);
+		write(sock, txbuf, ctl_msg_build(txbuf, rsp, NULL, 0));
+	   }
 	}
-	
+
+	if((type == 's' || type == 't') && rsp == 'a')
+	   stream_pump(cl, now_ns());
+	if(type == 'c')
+	   return -1; // normal  finish 
    }
+   cl->rxlen -= i;
+   memmove(cl->rx, cl->rx + i, cl->rxlen);
+   return 0;
+}
+
+static void client_close(Client *cl)
+{
+    stream_stop(cl);
+    fprintf(stderr, "CTNL> connection %s lost\n", cl->name);
+    close(cl->ctlsock);   // also removes it from epoll
+    cl->inuse = 0;
+}
+
+static void client_accept(int epfd, int listenfd)
+{
+    struct sockaddr_in clientaddr;
+    socklen_t clientlen;
+    struct epoll_event ev;
+    int connfd, i;
+    Client *cl;
+
+    while (1) {
+        clientlen = sizeof(clientaddr);
+        connfd = accept(listenfd, (struct sockaddr *)&clientaddr, &clientlen);
+        if (connfd < 0)
+            return;       // EAGAIN: no more for now
+
+        for (i = 0; i < MAX_CLIENTS && gClients[i].inuse; i++)
+            ;
+        if (i == MAX_CLIENTS) {
+            fprintf(stderr, "CNTL> too many clients, connection refused\n");
+            close(connfd);
+            continue;
+        }
+
+        cl = &gClients[i];
+        memset(cl, 0, sizeof(*cl));
+        cl->inuse = 1;
+        cl->ctlsock = connfd;
+        cl->bc = &gBcast[0];
+        cl->addr = clientaddr;
+        cl->addr.sin_port = htons(STREAM_CLIENT_PORT);   // different port 
+        snprintf(cl->name, sizeof(cl->name), "%s", inet_ntoa(clientaddr.sin_addr));
+        set_nonblock(connfd);
+
+        ev.events = EPOLLIN;
+        ev.data.u32 = i;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, connfd, &ev);
+        fprintf(stderr, "CNTL> new client %s connected\n", cl->name);
+    }
+}
+
+
+/* multicast -----------------------------------------------------------
+
+   -M group[:port]: one copy of the stream goes to a multicast group,
+   not one per player: on a shared radio link the airtime no longer grows
+   with the viewers. the group stream is a client without a control
+   connection (gMcast), paced like the others, sending from the start
+   from a socket of its own: TTL (-L), interface (-I), loopback for a
+   player on this host. players join the group (rpi-player -M) and keep
+   their control connection: 's' is acked without a stream of its own,
+   'k' and the stats query work as before, 't' still gets one the stream
+   over tcp. a NACK from a connected player is answered on the group
+   (-R): one resend serves every player that lost the packet. receiver
+   reports of the group are not used, rate control (-A) follows the
+   unicast clients.
+*/
+
+static int mcast_open(void)
+{
+  struct sockaddr_in *dst = &gMcast.addr;
+  struct ip_mreqn mreq;
+  int ttl = gMcastTtl, loop = 1, sndbuf = UDP_SNDBUF;
+  char group[64], *colon;
+
+  snprintf(group, sizeof(group), "%s", gMcastGroup);
+  memset(dst, 0, sizeof(*dst));
+  dst->sin_family = AF_INET;
+  dst->sin_port = htons(STREAM_CLIENT_PORT);
+  if((colon = strchr(group, ':')) != NULL){
+    *colon = '\0';
+    dst->sin_port = htons(atoi(colon + 1));
+  }
+  if(inet_aton(group, &dst->sin_addr) == 0 || !IN_MULTICAST(ntohl(dst->sin_addr.s_addr))){
+    fprintf(stderr, "Error: %s is no multicast group\n", group);
+    return -1;
+  }
+  memset(&mreq, 0, sizeof(mreq));
+  if(gMcastIf && inet_aton(gMcastIf, &mreq.imr_address) == 0 &&
+     (mreq.imr_ifindex = if_nametoindex(gMcastIf)) == 0){
+    fprintf(stderr, "Error: no interface %s\n", gMcastIf);
+    return -1;
+  }
+
+  gMcastSock = socket(AF_INET, SOCK_DGRAM, 0);
+  if(gMcastSock < 0 ||
+     setsockopt(gMcastSock, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) < 0 ||
+     setsockopt(gMcastSock, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop)) < 0 ||
+     (gMcastIf && setsockopt(gMcastSock, IPPROTO_IP, IP_MULTICAST_IF, &mreq, sizeof(mreq)) < 0)){
+    fprintf(stderr, "Error: cannot set up the multicast socket\n");
+    return -1;
+  }
+  setsockopt(gMcastSock, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+  set_nonblock(gMcastSock);
+
+  gMcast.inuse = 1;
+  gMcast.ctlsock = -1;
+  gMcast.bc = &gBcast[0];
+  snprintf(gMcast.name, sizeof(gMcast.name), "%s:%d", inet_ntoa(dst->sin_addr), ntohs(dst->sin_port));
+  if(stream_start(&gMcast, 0) < 0)
+    return -1;
+  fprintf(stdout, "STREAM %s> multicast, ttl %d%s%s\n", gMcast.name, ttl,
+          gMcastIf ? ", interface " : "", gMcastIf ? gMcastIf : "");
+  return 0;
 }
 
 
 /* main 
 
-   main thread for control (tcp) server 
-   command from client: 0x1 for start 0x0 for stop
-   respnse to  client:  0x1 for ack   0x0 for nack (not used) 
+   main thread: event loop for the control (tcp) server and the streams
+   command from client: 's' for start 'c' for stop 'k' for a key frame
+   respnse to  client:  'a' for ack   'n' for nack
 */
+
+/* epoll data.u32 of the fds that are not clients */
+#define EV_LISTEN  (MAX_CLIENTS + 0)
+#define EV_SOURCE  (MAX_CLIENTS + 1)
+#define EV_TIMER   (MAX_CLIENTS + 2)
+#define EV_UDP     (MAX_CLIENTS + 3)
+
 int main(int argc, char **argv)
 {
-    int listenfd, connfd, port;
-    socklen_t  clientlen;
-    struct sockaddr_in clientaddr;
-    struct hostent *hp;
-    char *haddrp;
-    if (argc != 2) {
-        fprintf(stderr, "usage: %s <port>\n", argv[0]);
+    int listenfd, port, i, n, epfd, tfd;
+    struct sockaddr_in servAddr;
+    struct epoll_event ev, events[MAX_EVENTS];
+    struct itimerspec its;
+    uint64_t cnt;
+    long long now, wake;
+    int opt, sndbuf = UDP_SNDBUF;
+    pthread_t tid;
+
+    while ((opt = getopt(argc, argv, "r:H:nF:R:E:AG:TM:L:I:")) != -1) {
+        switch (opt) {
+        case 'r': gPaceKbps = atoi(optarg); break;
+        case 'H': gPaceHeadroom = atoi(optarg); break;
+        case 'n': gPaceHeadroom = -1; break;
+        case 'R': gRtxKbps = atoi(optarg); break;
+        case 'E': gEncPath = optarg; break;
+        case 'A': gAbr = 1; break;
+        case 'G': gGopSpeed = atoi(optarg); break;
+        case 'T': gTs = 1; break;
+        case 'M': gMcastGroup = optarg; break;
+        case 'L': gMcastTtl = atoi(optarg); break;
+        case 'I': gMcastIf = optarg; break;
+        case 'F':
+            if (fec_parse(&gFec, optarg) < 0) {
+                fprintf(stderr, "Error: bad FEC scheme %s\n", optarg);
+                argc = 0;
+            }
+            break;
+        default:  argc = 0; break;
+        }
+    }
+    if (gTs && gFec.scheme != FEC_NONE) {
+        fprintf(stderr, "Error: no FEC (-F) for MPEG-TS (-T)\n");
+        argc = 0;
+    }
+    if (argc - optind < 2 || argc - optind > MAX_LAYERS + 1) {
+        fprintf(stderr, "usage: %s [-r kbit/s] [-H headroom%%] [-n] [-F fec] [-R kbit/s] [-E fifo] [-A] [-G speed] [-T]\n"
+                        "       [-M group[:port] [-L ttl] [-I interface]] <port> <source> [source ...]\n", argv[0]);
+        fprintf(stderr, "  source: h264 file, fifo, - or shm:/name; more than one: layers 0 ..\n"
+                        "      the players pick (rpi-camera-encode2 shm:/big shm:/small)\n");
+        fprintf(stderr, "  -r  pacing rate (default: bitrate of each frame)\n");
+        fprintf(stderr, "  -H  pacing headroom in %% (default 25)\n");
+        fprintf(stderr, "  -n  no pacing, frames go out in one burst\n");
+        fprintf(stderr, "  -F  repair packets: row:L col:L:D 2d:L:D rs:K:M (default none)\n");
+        fprintf(stderr, "  -R  retransmission rate for NACKs (default %d, 0: off)\n", gRtxKbps);
+        fprintf(stderr, "  -E  the encoder's control fifo (rpi-camera-encode2): key frames on request\n");
+        fprintf(stderr, "  -A  rate control, the bitrate goes to the encoder (-E)\n");
+        fprintf(stderr, "  -G  new clients start at the last IDR and catch up at that\n"
+                        "      times the frame rate (default %d, 0: at the newest frame)\n", gGopSpeed);
+        fprintf(stderr, "  -T  MPEG-TS over UDP instead of RTP (VLC, ffplay: udp://@:%d)\n", STREAM_CLIENT_PORT);
+        fprintf(stderr, "  -M  one stream to a multicast group (port default %d) for all players\n", STREAM_CLIENT_PORT);
+        fprintf(stderr, "  -L  multicast TTL (default 1: this LAN)\n");
+        fprintf(stderr, "  -I  multicast interface, name or address (default: the route's)\n");
         exit(0);
     }
-    port = atoi(argv[1]);
+    port = atoi(argv[optind]);
+    for (gNumLayers = 0; optind + 1 + gNumLayers < argc; gNumLayers++)
+        bcast_init(&gBcast[gNumLayers], gNumLayers, argv[optind + 1 + gNumLayers]);
+    gAbrBitrate = ABR_MAX_KBPS * 1000.0;   // the encoder starts at its maximum
+    gStartNs = now_ns();
+    if (gEncPath)
+        signal(SIGPIPE, SIG_IGN);     // the encoder may go away, the streamer stays
+    if (gFec.scheme != FEC_NONE)
+        fprintf(stdout, "FEC> blocks of %d packets, %.0f%% repair packets\n",
+                fec_block_size(&gFec), 100 * fec_overhead(&gFec));
+
+    /* udp socket shared by all clients, never blocks the loop */
+    gUdpSock = socket(AF_INET, SOCK_DGRAM, 0);
+    servAddr.sin_family = AF_INET;
+    servAddr.sin_addr.s_addr = htonl(INADDR_ANY);
+    servAddr.sin_port = htons(LOCAL_SERVER_PORT); // can use any not conflicting  
+    if (gUdpSock < 0 || bind(gUdpSock, (struct sockaddr *)&servAddr, sizeof(servAddr)) < 0) {
+        fprintf(stderr, "Error: cannot bind udp port number %d\n", LOCAL_SERVER_PORT);
+        exit(1);
+    }
+    setsockopt(gUdpSock, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+    set_nonblock(gUdpSock);
+    if (gMcastGroup && mcast_open() < 0)
+        exit(1);
 
+    /* event loop fds */
+    gEpfd = epfd = epoll_create1(0);
+    tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    gBcastEvfd = eventfd(0, EFD_NONBLOCK);
     listenfd = open_listenfd(port);
-    listen(listenfd, 1);
+    if (epfd < 0 || tfd < 0 || gBcastEvfd < 0 || listenfd < 0) {
+        fprintf(stderr, "Error: cannot set up the event loop\n");
+        exit(1);
+    }
+    set_nonblock(listenfd);
+    listen(listenfd, MAX_CLIENTS);
 
-    clientlen = sizeof(clientaddr);
+    ev.events = EPOLLIN;
+    ev.data.u32 = EV_LISTEN;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, listenfd, &ev);
+    ev.data.u32 = EV_SOURCE;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, gBcastEvfd, &ev);
+    ev.data.u32 = EV_TIMER;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, tfd, &ev);
+    ev.data.u32 = EV_UDP;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, gUdpSock, &ev);
+
+    /* one source for all clients, per layer */
+    for (i = 0; i < gNumLayers; i++) {
+        if (pthread_create(&tid, NULL, source_loop, &gBcast[i]) != 0) {
+            fprintf(stderr, "ERROR:pthread_create\n");
+            exit(1);
+        }
+        pthread_detach(tid);
+    }
 
     while (1) // to stop CTRL-C or kill me 
     {
-        connfd = accept(listenfd, (struct sockaddr *)&clientaddr, &clientlen);
+        n = epoll_wait(epfd, events, MAX_EVENTS, -1);
+        if (n < 0 && errno != EINTR) {
+            fprintf(stderr, "Error: epoll_wait\n");
+            break;
+        }
+        now = now_ns();
 
-        /* determine the domain name and IP address of the client */
-        hp = gethostbyaddr((const char *)&clientaddr.sin_addr.s_addr,
-                           sizeof(clientaddr.sin_addr.s_addr), AF_INET);
-        haddrp = inet_ntoa(clientaddr.sin_addr);
-        fprintf(stderr, "CNTL> new client %s (%s) connected\n", hp->h_name, haddrp);
+        /* 1. sockets and wake-ups */
+        for (i = 0; i < n; i++) {
+            uint32_t id = events[i].data.u32;
 
-        stream_control(connfd, &clientaddr);
+            if (id == EV_LISTEN) {
+                client_accept(epfd, listenfd);
+            } else if (id == EV_UDP) {
+                rtcp_input(now);
+            } else if (id == EV_SOURCE || id == EV_TIMER) {
+                if (read(id == EV_SOURCE ? gBcastEvfd : tfd, &cnt, sizeof(cnt)) < 0)
+                    ;     // already drained
+            } else if (gClients[id].inuse) {
+                if ((events[i].events & EPOLLOUT) && gClients[id].blocked)
+                    tcp_block(&gClients[id], 0);      // pumped below
+                if ((events[i].events & ~EPOLLOUT) && stream_control(&gClients[id]) < 0)
+                    client_close(&gClients[id]);
+            }
+        }
 
-        fprintf(stderr, "CTNL> connection %s (%s) lost\n", hp->h_name, haddrp);
+        /* 2. every stream sends what it may: new frames, tokens */
+        for (i = 0; i < MAX_CLIENTS; i++)
+            if (gClients[i].inuse && gClients[i].streaming &&
+                (gClients[i].wake_ns == 0 || gClients[i].wake_ns <= now))
+                stream_pump(&gClients[i], now);
+        if (gMcast.streaming && (gMcast.wake_ns == 0 || gMcast.wake_ns <= now))
+            stream_pump(&gMcast, now);
 
-        close(connfd);
+        /* 3. pacing timer for the earliest stream waiting for tokens,
+              or a key frame request due */
+        wake = idr_poll(now);
+        for (i = 0; i < MAX_CLIENTS; i++)
+            if (gClients[i].inuse && gClients[i].streaming && gClients[i].wake_ns &&
+                (wake == 0 || gClients[i].wake_ns < wake))
+                wake = gClients[i].wake_ns;
+        if (gMcast.streaming && gMcast.wake_ns && (wake == 0 || gMcast.wake_ns < wake))
+            wake = gMcast.wake_ns;
+        memset(&its, 0, sizeof(its));
+        its.it_value.tv_sec  = wake / NSEC_PER_SEC;
+        its.it_value.tv_nsec = wake % NSEC_PER_SEC;
+        timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, NULL);   // 0: disarm
     }
     return 0;
 }
-
-
@@ -0,0 +1,122 @@
+#include <string.h>
+
+#include "rtcp.h"
+
+static void put32(unsigned char *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static uint32_t get32(const unsigned char *p)
+{
+	return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+int rtcp_nack_build(unsigned char *buf, uint32_t ssrc, uint32_t media_ssrc,
+		    const uint16_t *seqs, int n)
+{
+	unsigned char *p = buf + 12;
+	uint16_t pid, blp;
+	int i = 0, words;
+
+	while(i < n){
+		/* one FCI: a lost packet and the 16 after it */
+		pid = seqs[i++];
+		blp = 0;
+		while(i < n && (uint16_t)(seqs[i] - pid - 1) < 16){
+			blp |= 1 << (uint16_t)(seqs[i] - pid - 1);
+			i++;
+		}
+		p[0] = pid >> 8;
+		p[1] = pid & 0xFF;
+		p[2] = blp >> 8;
+		p[3] = blp & 0xFF;
+		p += 4;
+	}
+
+	words = (p - buf) / 4 - 1;
+	buf[0] = 0x80 | RTCP_FMT_NACK;                 // V=2
+	buf[1] = RTCP_RTPFB;
+	buf[2] = words >> 8;
+	buf[3] = words & 0xFF;
+	put32(buf + 4, ssrc);
+	put32(buf + 8, media_ssrc);
+	return p - buf;
+}
+
+int rtcp_nack_parse(const unsigned char *buf, int len, uint32_t *media_ssrc,
+		    uint16_t *seqs, int max)
+{
+	const unsigned char *p = buf + 12;
+	uint16_t pid, blp;
+	int n = 0, i;
+
+	if(len < 16 || (buf[0] >> 6) != 2 || (buf[0] & 0x1F) != RTCP_FMT_NACK || buf[1] != RTCP_RTPFB)
+		return -1;
+	if(len > 4 * (((buf[2] << 8) | buf[3]) + 1))
+		len = 4 * (((buf[2] << 8) | buf[3]) + 1);
+	*media_ssrc = get32(buf + 8);
+
+	for(; p + 4 <= buf + len; p += 4){
+		pid = (p[0] << 8) | p[1];
+		blp = (p[2] << 8) | p[3];
+		if(n < max)
+			seqs[n++] = pid;
+		for(i = 0; i < 16; i++)
+			if((blp & (1 << i)) && n < max)
+				seqs[n++] = pid + i + 1;
+	}
+	return n;
+}
+
+int rtcp_report_build(unsigned char *buf, uint32_t ssrc, uint32_t media_ssrc,
+		      const RtcpReport *r)
+{
+	unsigned char *p = buf + 32;
+
+	/* RR, one report block */
+	buf[0] = 0x80 | 1;                             // V=2, RC=1
+	buf[1] = RTCP_RR;
+	buf[2] = 0;
+	buf[3] = 7;
+	put32(buf + 4, ssrc);
+	put32(buf + 8, media_ssrc);
+	put32(buf + 12, ((uint32_t)r->fraction_lost << 24) | (r->cum_lost & 0xFFFFFF));
+	put32(buf + 16, r->ext_seq);
+	put32(buf + 20, r->jitter);
+	put32(buf + 24, 0);                            // no SR seen: LSR, DLSR 0
+	put32(buf + 28, 0);
+
+	/* APP "RATE" */
+	p[0] = 0x80;
+	p[1] = RTCP_APP;
+	p[2] = 0;
+	p[3] = 4;
+	put32(p + 4, ssrc);
+	memcpy(p + 8, "RATE", 4);
+	put32(p + 12, r->recv_kbps);
+	put32(p + 16, (uint32_t)r->trend_us);
+	return RTCP_REPORT_SIZE;
+}
+
+int rtcp_report_parse(const unsigned char *buf, int len, RtcpReport *r)
+{
+	const unsigned char *p = buf + 32;
+
+	if(len < RTCP_REPORT_SIZE || (buf[0] >> 6) != 2 || (buf[0] & 0x1F) != 1 ||
+	   buf[1] != RTCP_RR || buf[3] != 7)
+		return -1;
+	if((p[0] >> 6) != 2 || p[1] != RTCP_APP || p[3] != 4 || memcmp(p + 8, "RATE", 4) != 0)
+		return -1;
+
+	r->fraction_lost = buf[12];
+	r->cum_lost      = get32(buf + 12) & 0xFFFFFF;
+	r->ext_seq       = get32(buf + 16);
+	r->jitter        = get32(buf + 20);
+	r->recv_kbps     = get32(p + 12);
+	r->trend_us      = (int32_t)get32(p + 16);
+	return 0;
+}
@@ -0,0 +1,62 @@
+#ifndef RTCP_H
+#define RTCP_H
+
+#include <stdint.h>
+
+/*--------------------------------------------------------------------------
+   RTCP feedback
+
+   generic NACK (RFC 4585, 6.2.1): the receiver names lost RTP packets,
+   the sender sends them again
+
+     V=2 P FMT=1 | PT=205 | length | SSRC of sender | SSRC of media source
+     FCI*: PID (lost sequence number) | BLP (bit i: PID+i+1 lost too)
+
+   receiver report: a compound packet, the RR of RFC 3550 (6.4.2) with
+   one report block and an APP packet "RATE" with what the RR lacks for
+   rate control (abr.h)
+
+     RR   V=2 RC=1 | PT=201 | length=7 | SSRC of sender
+          SSRC of media source | fraction lost | cumulative lost (24)
+          extended highest sequence number | jitter | LSR=0 | DLSR=0
+     APP  V=2 subtype=0 | PT=204 | length=4 | SSRC of sender | "RATE"
+          receive rate (kbit/s) | delay trend (us per s, signed)
+---------------------------------------------------------------------------*/
+
+#define RTCP_RR         201
+#define RTCP_APP        204
+#define RTCP_RTPFB      205      // transport layer feedback
+#define RTCP_FMT_NACK   1
+#define RTCP_MAX_NACK   128      // sequence numbers per NACK
+#define RTCP_MAX_SIZE   (12 + 4 * RTCP_MAX_NACK)
+#define RTCP_REPORT_SIZE (32 + 20)
+
+typedef struct {
+	uint8_t  fraction_lost;      // since the last report, / 256
+	uint32_t cum_lost;           // 24 bits
+	uint32_t ext_seq;            // extended highest sequence number
+	uint32_t jitter;             // interarrival jitter, RTP timestamp units
+	uint32_t recv_kbps;          // APP: receive rate since the last report
+	int32_t  trend_us;           // APP: one-way delay change per second
+} RtcpReport;
+
+/*
+ * NACK for n lost sequence numbers (ascending, n <= RTCP_MAX_NACK)
+ * returns its length
+ */
+int rtcp_nack_build(unsigned char *buf, uint32_t ssrc, uint32_t media_ssrc,
+		    const uint16_t *seqs, int n);
+
+/* lost sequence numbers of a NACK and the SSRC of the stream they are
+   of, returns how many or -1 if not a NACK */
+int rtcp_nack_parse(const unsigned char *buf, int len, uint32_t *media_ssrc,
+		    uint16_t *seqs, int max);
+
+/* receiver report (RR + APP), returns its length, RTCP_REPORT_SIZE */
+int rtcp_report_build(unsigned char *buf, uint32_t ssrc, uint32_t media_ssrc,
+		      const RtcpReport *r);
+
+/* 0 and *r if buf is a receiver report, -1 if not */
+int rtcp_report_parse(const unsigned char *buf, int len, RtcpReport *r);
+
+#endif
@@ -0,0 +1,266 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "rtp264.h"
+
+/*--------------------------------------------------------------------------
+   RTP payload format for H.264 (RFC 6184)
+
+   RTP header (12 bytes)
+    V=2 P X CC | M PT | sequence number | timestamp | SSRC
+
+   payload  NAL type 1-23 : single NAL unit packet
+            NAL type 24   : STAP-A  = hdr {size(2) NAL}*
+            NAL type 28   : FU-A    = indicator(F,NRI,28) header(S,E,R,type) data
+---------------------------------------------------------------------------*/
+
+/* packetizer -------------------------------------------------------------*/
+
+void rtp264_packetizer_init(RtpPacketizer *rp, int pktsize)
+{
+	srand(time(NULL) ^ getpid());
+	rp->seq  = rand() & 0xFFFF;
+	rp->ssrc = ((uint32_t)rand() << 16) ^ rand();
+	rp->pktsize = (pktsize > 0 && pktsize <= RTP_PKT_SIZE) ? pktsize : RTP_PKT_SIZE;
+}
+
+static void put_header(RtpPacketizer *rp, unsigned char *p, uint32_t ts, int marker)
+{
+	p[0]  = 0x80;                                  // V=2
+	p[1]  = (marker ? 0x80 : 0) | RTP_PT_H264;
+	p[2]  = rp->seq >> 8;
+	p[3]  = rp->seq & 0xFF;
+	p[4]  = ts >> 24;
+	p[5]  = ts >> 16;
+	p[6]  = ts >> 8;
+	p[7]  = ts;
+	p[8]  = rp->ssrc >> 24;
+	p[9]  = rp->ssrc >> 16;
+	p[10] = rp->ssrc >> 8;
+	p[11] = rp->ssrc;
+	rp->seq++;
+}
+
+static int is_vcl(const H264Nal *nal)
+{
+	int type = nal->data[0] & 0x1F;
+	return type == H264_NAL_SLICE || type == H264_NAL_IDR;
+}
+
+int rtp264_packetize(RtpPacketizer *rp, const H264AU *au, uint32_t ts,
+		     unsigned char *out, RtpPkt *pkts, int maxpkts)
+{
+	int maxpay = rp->pktsize - RTP_HDR_SIZE;
+	int n = 0, i = 0, j, last;
+	unsigned char *p, *q;
+
+	while(i < au->nnal){
+		const H264Nal *nal = &au->nal[i];
+
+		if(nal->len <= 0){
+			i++;
+			continue;
+		}
+
+		/* 1. STAP-A: two or more small non-VCL NALs (SPS/PPS..) in a row */
+		if(!is_vcl(nal)){
+			int size = 1, nri = 0;
+			for(j = i; j < au->nnal && !is_vcl(&au->nal[j]); j++){
+				if(size + 2 + au->nal[j].len > maxpay)
+					break;
+				size += 2 + au->nal[j].len;
+				if((au->nal[j].data[0] & 0x60) > nri)
+					nri = au->nal[j].data[0] & 0x60;
+			}
+			if(j - i >= 2){
+				if(n == maxpkts)
+					return -1;
+				p = out + n * rp->pktsize;
+				q = p + RTP_HDR_SIZE;
+				*q++ = nri | RTP_NAL_STAPA;
+				for(; i < j; i++){
+					*q++ = au->nal[i].len >> 8;
+					*q++ = au->nal[i].len & 0xFF;
+					memcpy(q, au->nal[i].data, au->nal[i].len);
+					q += au->nal[i].len;
+				}
+				put_header(rp, p, ts, i == au->nnal);
+				pkts[n].data = p;
+				pkts[n].len  = q - p;
+				n++;
+				continue;
+			}
+		}
+
+		last = (i == au->nnal - 1);
+
+		/* 2. single NAL unit packet */
+		if(nal->len <= maxpay){
+			if(n == maxpkts)
+				return -1;
+			p = out + n * rp->pktsize;
+			memcpy(p + RTP_HDR_SIZE, nal->data, nal->len);
+			put_header(rp, p, ts, last);
+			pkts[n].data = p;
+			pkts[n].len  = RTP_HDR_SIZE + nal->len;
+			n++;
+		}
+		/* 3. FU-A fragments, all but the last one full size */
+		else{
+			const unsigned char *src = nal->data + 1;   // NAL header goes to FU header
+			int remain = nal->len - 1;
+			int chunk = maxpay - 2;
+			int start = 1;
+
+			while(remain > 0){
+				int len = remain < chunk ? remain : chunk;
+				int end = (len == remain);
+
+				if(n == maxpkts)
+					return -1;
+				p = out + n * rp->pktsize;
+				p[RTP_HDR_SIZE]     = (nal->data[0] & 0xE0) | RTP_NAL_FUA;
+				p[RTP_HDR_SIZE + 1] = (start ? 0x80 : 0) | (end ? 0x40 : 0) | (nal->data[0] & 0x1F);
+				memcpy(p + RTP_HDR_SIZE + 2, src, len);
+				put_header(rp, p, ts, last && end);
+				pkts[n].data = p;
+				pkts[n].len  = RTP_HDR_SIZE + 2 + len;
+				n++;
+
+				src += len;
+				remain -= len;
+				start = 0;
+			}
+		}
+		i++;
+	}
+	return n;
+}
+
+/* depacketizer -----------------------------------------------------------*/
+
+int rtp264_depacketizer_init(RtpDepacketizer *rd)
+{
+	memset(rd, 0, sizeof(*rd));
+	rd->au = malloc(H264_MAX_AU_SIZE + RTP_AU_PADDING);
+	return rd->au ? 0 : -1;
+}
+
+void rtp264_depacketizer_free(RtpDepacketizer *rd)
+{
+	free(rd->au);
+	rd->au = NULL;
+}
+
+void rtp264_depacketizer_reset(RtpDepacketizer *rd)
+{
+	rd->len = 0;
+	rd->idr = 0;
+	rd->broken = 0;
+	rd->in_fu = 0;
+}
+
+/* append a start code and NAL (or part of it) */
+static void append(RtpDepacketizer *rd, const unsigned char *hdr, int hlen,
+		   const unsigned char *data, int len)
+{
+	static const unsigned char startcode[4] = { 0, 0, 0, 1 };
+
+	if(rd->len + 4 + hlen + len > H264_MAX_AU_SIZE){
+		rd->broken = 1;
+		return;
+	}
+	if(hlen){
+		memcpy(rd->au + rd->len, startcode, 4);
+		memcpy(rd->au + rd->len + 4, hdr, hlen);
+		rd->len += 4 + hlen;
+		if((hdr[0] & 0x1F) == H264_NAL_IDR)
+			rd->idr = 1;
+	}
+	memcpy(rd->au + rd->len, data, len);
+	rd->len += len;
+}
+
+int rtp264_depacketize(RtpDepacketizer *rd, const unsigned char *pkt, int len)
+{
+	const unsigned char *p;
+	int hdrlen, plen, gap = 0;
+	uint16_t seq;
+	uint32_t ts;
+
+	/* 1. RTP header */
+	if(len < RTP_HDR_SIZE + 1 || (pkt[0] >> 6) != 2)
+		return -1;
+	hdrlen = RTP_HDR_SIZE + 4 * (pkt[0] & 0x0F);       // CSRCs
+	if((pkt[0] & 0x10) && len >= hdrlen + 4)           // extension
+		hdrlen += 4 + 4 * ((pkt[hdrlen + 2] << 8) | pkt[hdrlen + 3]);
+	if(pkt[0] & 0x20)                                  // padding
+		len -= pkt[len - 1];
+	if(hdrlen >= len)
+		return -1;
+
+	seq = rtp_seq(pkt);
+	ts  = rtp_ts(pkt);
+
+	/* 2. losses: sequence gap, or a new timestamp before the marker */
+	if(rd->have_seq && seq != (uint16_t)(rd->seq + 1)){
+		rd->lost += (uint16_t)(seq - rd->seq - 1);
+		gap = 1;
+	}
+	rd->have_seq = 1;
+	rd->seq = seq;
+	if((rd->len > 0 || rd->broken) && ts != rd->ts)
+		rtp264_depacketizer_reset(rd);   // marker of the previous AU lost
+	if(gap){
+		rd->broken = 1;
+		rd->in_fu = 0;
+	}
+	rd->ts = ts;
+
+	/* 3. payload */
+	p = pkt + hdrlen;
+	plen = len - hdrlen;
+
+	switch(p[0] & 0x1F){
+	case RTP_NAL_STAPA:
+		p++; plen--;
+		while(plen >= 2){
+			int nlen = (p[0] << 8) | p[1];
+			if(nlen == 0 || nlen > plen - 2)
+				break;
+			append(rd, p + 2, 1, p + 3, nlen - 1);
+			p += 2 + nlen;
+			plen -= 2 + nlen;
+		}
+		break;
+
+	case RTP_NAL_FUA:
+		if(plen < 2)
+			return -1;
+		if(p[1] & 0x80){                    // start: rebuild the NAL header
+			unsigned char nalhdr = (p[0] & 0xE0) | (p[1] & 0x1F);
+			append(rd, &nalhdr, 1, p + 2, plen - 2);
+			rd->in_fu = 1;
+		}else if(rd->in_fu)
+			append(rd, NULL, 0, p + 2, plen - 2);
+		else
+			rd->broken = 1;                 // start fragment lost
+		if(p[1] & 0x40)
+			rd->in_fu = 0;
+		break;
+
+	default:
+		if((p[0] & 0x1F) == 0 || (p[0] & 0x1F) > 23)
+			return -1;                      // STAP-B, MTAP, FU-B: not used
+		append(rd, p, 1, p + 1, plen - 1);
+		break;
+	}
+
+	if(!rtp_marker(pkt))
+		return 0;
+	memset(rd->au + rd->len, 0, RTP_AU_PADDING);
+	return 1;
+}
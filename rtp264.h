@@ -0,0 +1,97 @@
+#ifndef RTP264_H
+#define RTP264_H
+
+#include <stdint.h>
+#include "h264au.h"
+
+/*--------------------------------------------------------------------------
+   RTP payload format for H.264 (RFC 6184), non-interleaved mode
+
+   packetizer   : access unit -> RTP packets
+                  single NAL unit packet  small NALs
+                  STAP-A                  consecutive small non-VCL NALs
+                                          (SPS/PPS, SEI, AUD) in one packet
+                  FU-A                    NALs larger than a packet
+                  marker bit on the last packet of the access unit
+   depacketizer : RTP packets (in order) -> Annex-B access unit, zero
+                  padded for the decoder
+---------------------------------------------------------------------------*/
+
+#define RTP_HDR_SIZE   12
+#define RTP_PT_H264    96
+#define RTP_PKT_SIZE   1400      // RTP header + payload, fits a 1500 MTU
+#define RTP_CLOCK      90000     // 90 kHz video clock
+#define RTP_AU_PADDING 64        // after the access unit, zeroed: decoders read ahead
+
+#define RTP_NAL_STAPA  24
+#define RTP_NAL_FUA    28
+
+typedef struct {
+	unsigned char *data;         // RTP header + payload
+	int len;
+} RtpPkt;
+
+typedef struct {
+	uint16_t seq;                // next sequence number
+	uint32_t ssrc;
+	int      pktsize;            // max packet size, <= RTP_PKT_SIZE
+} RtpPacketizer;
+
+typedef struct {
+	unsigned char *au;           // Annex-B output, H264_MAX_AU_SIZE + RTP_AU_PADDING
+	                             // (may be swapped for another one that size)
+	int      len;
+	uint32_t ts;                 // RTP timestamp of the access unit
+	int      idr;
+	int      broken;             // packets lost inside this access unit
+	int      in_fu;              // inside a FU-A NAL
+	int      have_seq;
+	uint16_t seq;                // last sequence number
+	unsigned long lost;          // packets lost (sequence gaps) in total
+} RtpDepacketizer;
+
+/* random SSRC and first sequence number */
+void rtp264_packetizer_init(RtpPacketizer *rp, int pktsize);
+
+/*
+ * packetize one access unit with RTP timestamp ts
+ * pkts[i].data is out + i*rp->pktsize, returns the number of packets
+ * or -1 if maxpkts is too small
+ */
+int  rtp264_packetize(RtpPacketizer *rp, const H264AU *au, uint32_t ts,
+		      unsigned char *out, RtpPkt *pkts, int maxpkts);
+
+int  rtp264_depacketizer_init(RtpDepacketizer *rd);
+void rtp264_depacketizer_free(RtpDepacketizer *rd);
+/* start a new access unit (drop the partial one) */
+void rtp264_depacketizer_reset(RtpDepacketizer *rd);
+
+/*
+ * feed one RTP packet (in sequence order)
+ * returns 1 when an access unit is complete (marker bit) in rd->au,
+ * 0 if more packets are needed, -1 if the packet is not valid
+ */
+int  rtp264_depacketize(RtpDepacketizer *rd, const unsigned char *pkt, int len);
+
+/* header fields */
+static inline uint16_t rtp_seq(const unsigned char *pkt)
+{
+	return (pkt[2] << 8) | pkt[3];
+}
+
+static inline uint32_t rtp_ts(const unsigned char *pkt)
+{
+	return ((uint32_t)pkt[4] << 24) | (pkt[5] << 16) | (pkt[6] << 8) | pkt[7];
+}
+
+static inline uint32_t rtp_ssrc(const unsigned char *pkt)
+{
+	return ((uint32_t)pkt[8] << 24) | (pkt[9] << 16) | (pkt[10] << 8) | pkt[11];
+}
+
+static inline int rtp_marker(const unsigned char *pkt)
+{
+	return (pkt[1] & 0x80) != 0;
+}
+
+#endif
@@ -0,0 +1,288 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "shmring.h"
+
+static long long now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* between processes: no FUTEX_PRIVATE_FLAG */
+static void futex_wake(uint32_t *addr)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE, 0x7FFFFFFF, NULL, NULL, 0);
+}
+
+static void futex_wait(uint32_t *addr, uint32_t val, int timeout_ms)
+{
+	struct timespec ts = { timeout_ms / 1000, (timeout_ms % 1000) * 1000000L };
+	syscall(SYS_futex, addr, FUTEX_WAIT, val, &ts, NULL, 0);
+}
+
+static int map(ShmRing *r, const char *name, int fd, size_t len)
+{
+	void *p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+	close(fd);
+	if(p == MAP_FAILED){
+		fprintf(stderr, "Cannot map shared memory %s\n", name);
+		return -1;
+	}
+	r->hdr    = p;
+	r->maplen = len;
+	snprintf(r->name, sizeof(r->name), "%s", name);
+	return 0;
+}
+
+static void layout(ShmRing *r)
+{
+	r->slot = (ShmSlot *)((unsigned char *)r->hdr + sizeof(ShmHeader));
+	r->data = (unsigned char *)(r->slot + r->hdr->nslots);
+}
+
+/* writer -----------------------------------------------------------------*/
+
+int shmring_create(ShmRing *r, const char *name, uint32_t size, uint32_t nslots)
+{
+	size_t len = sizeof(ShmHeader) + nslots * sizeof(ShmSlot) + size;
+	int fd;
+
+	memset(r, 0, sizeof(*r));
+	shm_unlink(name);                    // readers of an old one keep theirs
+	fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+	if(fd < 0 || ftruncate(fd, len) < 0){
+		fprintf(stderr, "Cannot create shared memory %s\n", name);
+		if(fd >= 0)
+			close(fd);
+		return -1;
+	}
+	if(map(r, name, fd, len) < 0)
+		return -1;
+	r->hdr->size    = size;
+	r->hdr->nslots  = nslots;
+	r->hdr->pid     = getpid();
+	r->hdr->version = SHMRING_VERSION;
+	layout(r);
+	memset(r->slot, 0xFF, nslots * sizeof(ShmSlot));   // seq ~0: none
+	__atomic_store_n(&r->hdr->magic, SHMRING_MAGIC, __ATOMIC_RELEASE);
+	r->writer = 1;
+	return 0;
+}
+
+/* the writer is about to write data up to end: readers of what it
+   overwrites see it before the bytes change */
+static void reserve(ShmRing *r, uint64_t end)
+{
+	__atomic_store_n(&r->hdr->reserve, end, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void shmring_append(ShmRing *r, const void *p, int len, uint32_t flags)
+{
+	uint32_t size = r->hdr->size;
+	uint64_t off;
+
+	if(r->pend_bad || len <= 0)
+		return;
+	if(r->pend_len + len > size / 2){
+		r->pend_bad = 1;
+		return;
+	}
+	off = r->pend_pos % size;
+	if(off + r->pend_len + len > size){
+		/* no room before the end: the record moves to the beginning */
+		reserve(r, r->pend_pos + (size - off) + r->pend_len + len);
+		memmove(r->data, r->data + off, r->pend_len);
+		r->pend_pos += size - off;
+		off = 0;
+	}else
+		reserve(r, r->pend_pos + r->pend_len + len);
+	memcpy(r->data + off + r->pend_len, p, len);
+	r->pend_len   += len;
+	r->pend_flags |= flags;
+}
+
+/* the header keeps the codec config: consecutive config records */
+static void keep_config(ShmRing *r)
+{
+	ShmHeader *h = r->hdr;
+	uint32_t len = r->config_run ? h->config_len : 0;
+
+	if(len + r->pend_len > SHMRING_MAX_CONFIG)
+		return;
+	__atomic_store_n(&h->config_seq, h->config_seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	memcpy(h->config + len, r->data + r->pend_pos % h->size, r->pend_len);
+	h->config_len = len + r->pend_len;
+	__atomic_store_n(&h->config_seq, h->config_seq + 1, __ATOMIC_RELEASE);
+}
+
+int64_t shmring_commit(ShmRing *r, int64_t pts)
+{
+	ShmHeader *h = r->hdr;
+	uint64_t seq = h->head;
+	ShmSlot *s = &r->slot[seq % h->nslots];
+	uint32_t flags = r->pend_flags;
+
+	if(r->pend_bad || r->pend_len == 0){
+		if(r->pend_bad)
+			r->dropped++;
+		r->pend_len = r->pend_flags = r->pend_bad = 0;
+		return -1;
+	}
+
+	/* 1. the slot: readers of its old record see it change */
+	__atomic_store_n(&s->seq, ~0ULL, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	s->pos   = r->pend_pos;
+	s->len   = r->pend_len;
+	s->flags = flags;
+	s->pts   = pts;
+	s->t_ns  = now_ns();
+	__atomic_store_n(&s->seq, seq, __ATOMIC_RELEASE);
+
+	if(flags & SHMRING_CONFIG)
+		keep_config(r);
+	r->config_run = (flags & SHMRING_CONFIG) != 0;
+	if(flags & SHMRING_KEY)
+		__atomic_store_n(&h->last_key, seq + 1, __ATOMIC_RELEASE);
+
+	/* 2. publish, wake the readers waiting */
+	__atomic_store_n(&h->head, seq + 1, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&h->futex, 1, __ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&h->waiters, __ATOMIC_SEQ_CST))
+		futex_wake(&h->futex);
+
+	r->pend_pos += r->pend_len;
+	r->pend_len = r->pend_flags = 0;
+	return seq;
+}
+
+/* readers ----------------------------------------------------------------*/
+
+int shmring_open(ShmRing *r, const char *name)
+{
+	struct stat st;
+	int fd;
+
+	memset(r, 0, sizeof(*r));
+	fd = shm_open(name, O_RDWR, 0);
+	if(fd < 0 || fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(ShmHeader)){
+		fprintf(stderr, "Cannot open shared memory %s\n", name);
+		if(fd >= 0)
+			close(fd);
+		return -1;
+	}
+	if(map(r, name, fd, st.st_size) < 0)
+		return -1;
+	if(__atomic_load_n(&r->hdr->magic, __ATOMIC_ACQUIRE) != SHMRING_MAGIC ||
+	   r->hdr->version != SHMRING_VERSION ||
+	   sizeof(ShmHeader) + r->hdr->nslots * sizeof(ShmSlot) + r->hdr->size > r->maplen){
+		fprintf(stderr, "Shared memory %s is no ring (version %d)\n", name, SHMRING_VERSION);
+		munmap(r->hdr, r->maplen);
+		return -1;
+	}
+	layout(r);
+	return 0;
+}
+
+uint64_t shmring_start(ShmRing *r)
+{
+	uint64_t key = __atomic_load_n(&r->hdr->last_key, __ATOMIC_ACQUIRE);
+	return key ? key - 1 : __atomic_load_n(&r->hdr->head, __ATOMIC_ACQUIRE);
+}
+
+int shmring_valid(const ShmRing *r, const ShmRec *rec)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&r->hdr->reserve, __ATOMIC_RELAXED) - rec->pos <= r->hdr->size;
+}
+
+int shmring_next(ShmRing *r, uint64_t *cursor, ShmRec *rec)
+{
+	ShmHeader *h = r->hdr;
+	uint64_t head = __atomic_load_n(&h->head, __ATOMIC_ACQUIRE), pos;
+	ShmSlot *s = &r->slot[*cursor % h->nslots];
+
+	if(*cursor >= head)
+		return 0;
+	if(head - *cursor > h->nslots || __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) != *cursor)
+		goto overrun;
+	pos        = s->pos;
+	rec->len   = s->len;
+	rec->flags = s->flags;
+	rec->pts   = s->pts;
+	rec->t_ns  = s->t_ns;
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if(__atomic_load_n(&s->seq, __ATOMIC_RELAXED) != *cursor ||
+	   __atomic_load_n(&h->reserve, __ATOMIC_RELAXED) - pos > h->size)
+		goto overrun;
+	rec->seq  = *cursor;
+	rec->pos  = pos;
+	rec->data = r->data + pos % h->size;
+	(*cursor)++;
+	return 1;
+
+overrun:
+	*cursor = shmring_start(r);
+	return -1;
+}
+
+int shmring_wait(ShmRing *r, uint64_t cursor, int timeout_ms)
+{
+	ShmHeader *h = r->hdr;
+	uint32_t f = __atomic_load_n(&h->futex, __ATOMIC_SEQ_CST);
+
+	if(__atomic_load_n(&h->head, __ATOMIC_ACQUIRE) > cursor)
+		return 1;
+	__atomic_add_fetch(&h->waiters, 1, __ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&h->head, __ATOMIC_ACQUIRE) <= cursor && !h->closed)
+		futex_wait(&h->futex, f, timeout_ms);
+	__atomic_sub_fetch(&h->waiters, 1, __ATOMIC_SEQ_CST);
+	return __atomic_load_n(&h->head, __ATOMIC_ACQUIRE) > cursor;
+}
+
+int shmring_config(ShmRing *r, unsigned char *buf, int max)
+{
+	ShmHeader *h = r->hdr;
+	uint32_t seq, len;
+
+	do{
+		seq = __atomic_load_n(&h->config_seq, __ATOMIC_ACQUIRE);
+		len = h->config_len;
+		if(len > (uint32_t)max || len > SHMRING_MAX_CONFIG)
+			len = 0;
+		memcpy(buf, h->config, len);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	}while((seq & 1) || __atomic_load_n(&h->config_seq, __ATOMIC_RELAXED) != seq);
+	return len;
+}
+
+int shmring_closed(const ShmRing *r)
+{
+	return __atomic_load_n(&r->hdr->closed, __ATOMIC_ACQUIRE);
+}
+
+void shmring_close(ShmRing *r)
+{
+	if(r->hdr == NULL)
+		return;
+	if(r->writer){
+		__atomic_store_n(&r->hdr->closed, 1, __ATOMIC_RELEASE);
+		__atomic_add_fetch(&r->hdr->futex, 1, __ATOMIC_SEQ_CST);
+		futex_wake(&r->hdr->futex);
+		shm_unlink(r->name);
+	}
+	munmap(r->hdr, r->maplen);
+	r->hdr = NULL;
+}
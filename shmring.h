@@ -0,0 +1,133 @@
+#ifndef SHMRING_H
+#define SHMRING_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*--------------------------------------------------------------------------
+   shared memory ring of encoded access units
+
+   one writer (rpi-camera-encode2, an output "shm:/name") copies each
+   access unit once into a POSIX shared memory object; any number of
+   reader processes (the streamer, a recorder, analytics) map it and
+   follow the writer's head, each with a cursor of its own. readers use
+   the data in place and never block or slow down the writer: a reader
+   that falls behind by more than the ring finds its records overwritten
+   and starts again at the newest key frame.
+
+     header | slots[nslots] | data[size]
+
+   a record is a slot (sequence number, position, length, flags,
+   timestamps) and its bytes, contiguous in data (a record that does not
+   fit before the end starts at the beginning). the writer moves
+   reserve past the bytes it is about to overwrite before it writes
+   them, then fills the slot and advances head (release stores); a
+   reader checks after using the bytes that reserve did not pass them
+   (shmring_valid()), as with a seqlock. readers sleep on a futex in the
+   header, woken by the writer when one waits.
+
+   the stream's last codec config (SPS, PPS) is kept in the header too:
+   a reader joining later needs it before the first key frame.
+---------------------------------------------------------------------------*/
+
+#define SHMRING_MAGIC       0x53524E47   // "SRNG"
+#define SHMRING_VERSION     1
+#define SHMRING_SIZE        (8*1024*1024)  // data, a few seconds at 10 Mbit/s
+#define SHMRING_SLOTS       256            // records kept at most, power of 2
+#define SHMRING_MAX_CONFIG  256
+
+enum {
+	SHMRING_KEY    = 1,              // key frame (IDR)
+	SHMRING_CONFIG = 2,              // codec config (SPS, PPS)
+};
+
+typedef struct {
+	uint64_t seq;                    // record number, ~0: being written
+	uint64_t pos;                    // in data: pos % size
+	uint32_t len, flags;
+	int64_t  pts;                    // capture time, us, CLOCK_REALTIME
+	int64_t  t_ns;                   // written, CLOCK_MONOTONIC
+} ShmSlot;
+
+typedef struct {
+	uint32_t magic, version;
+	uint32_t size, nslots;
+	uint32_t pid;                    // writer
+	uint32_t closed;                 // the writer is gone
+	uint64_t head __attribute__((aligned(64)));  // next record number
+	uint64_t reserve;                // data written (or being written) up to
+	uint64_t last_key;               // newest key record + 1, 0: none yet
+	uint32_t futex;                  // changes with each record
+	uint32_t waiters;
+	uint32_t config_seq;             // odd while the config is written
+	uint32_t config_len;
+	unsigned char config[SHMRING_MAX_CONFIG];
+} ShmHeader;
+
+typedef struct {
+	ShmHeader *hdr;
+	ShmSlot   *slot;
+	unsigned char *data;
+	size_t     maplen;
+	char       name[64];
+	int        writer;
+
+	/* writer: the record being put together */
+	uint64_t   pend_pos;
+	uint32_t   pend_len, pend_flags;
+	int        pend_bad;             // too big, dropped
+	int        config_run;           // the last records were config
+	unsigned long dropped;
+} ShmRing;
+
+typedef struct {
+	uint64_t seq, pos;
+	const unsigned char *data;       // in the ring: valid while shmring_valid()
+	int      len;
+	uint32_t flags;
+	int64_t  pts, t_ns;
+} ShmRec;
+
+/* writer -----------------------------------------------------------------*/
+
+/* create (or replace) the ring "/name", 0 on success */
+int  shmring_create(ShmRing *r, const char *name, uint32_t size, uint32_t nslots);
+
+/* add bytes to the record being put together (an access unit may come in
+   several encoder buffers), flags are or'ed */
+void shmring_append(ShmRing *r, const void *p, int len, uint32_t flags);
+
+/* publish it, returns its number or -1 if it was dropped (larger than
+   half the ring) or empty */
+int64_t shmring_commit(ShmRing *r, int64_t pts);
+
+/* readers: open "/name", 0 on success ------------------------------------*/
+
+int  shmring_open(ShmRing *r, const char *name);
+
+/* where a new reader starts: the newest key record, else the next one */
+uint64_t shmring_start(ShmRing *r);
+
+/*
+ * record *cursor: 1 and *rec (the cursor moves on), 0 if it is not
+ * written yet, -1 if it was overwritten (the cursor moves to the newest
+ * key record)
+ */
+int  shmring_next(ShmRing *r, uint64_t *cursor, ShmRec *rec);
+
+/* after using rec->data: 1 if the writer did not overwrite it meanwhile */
+int  shmring_valid(const ShmRing *r, const ShmRec *rec);
+
+/* wait up to timeout_ms for record cursor, 1 if it is there */
+int  shmring_wait(ShmRing *r, uint64_t cursor, int timeout_ms);
+
+/* the stream's codec config, returns its length (0: none yet) */
+int  shmring_config(ShmRing *r, unsigned char *buf, int max);
+
+/* the writer closed the ring */
+int  shmring_closed(const ShmRing *r);
+
+/* both: unmap, the writer marks it closed and removes the name */
+void shmring_close(ShmRing *r);
+
+#endif
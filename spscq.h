@@ -0,0 +1,61 @@
+#ifndef SPSCQ_H
+#define SPSCQ_H
+
+/*--------------------------------------------------------------------------
+   lock-free single-producer single-consumer queue of pointers
+
+   the producer only writes head, the consumer only writes tail; each one
+   publishes its index with a release store and reads the other's with an
+   acquire load, so a slot is always written before it is seen. no locks,
+   no syscalls: waking the consumer up is the caller's business (eventfd).
+
+   SPSCQ_SIZE is a power of 2 and has to cover all the items in flight
+   (e.g. the buffers of an OMX port), then push never fails.
+---------------------------------------------------------------------------*/
+
+#define SPSCQ_SIZE  16
+
+typedef struct {
+	void *slot[SPSCQ_SIZE];
+	unsigned head __attribute__((aligned(64)));   // next push, producer
+	unsigned tail __attribute__((aligned(64)));   // next pop, consumer
+} SpscQ;
+
+static inline void spscq_init(SpscQ *q)
+{
+	q->head = q->tail = 0;
+}
+
+/* producer: 0 if full */
+static inline int spscq_push(SpscQ *q, void *p)
+{
+	unsigned h = q->head;
+
+	if(h - __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) == SPSCQ_SIZE)
+		return 0;
+	q->slot[h & (SPSCQ_SIZE - 1)] = p;
+	__atomic_store_n(&q->head, h + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+/* consumer: oldest item without removing it, NULL if empty */
+static inline void *spscq_peek(SpscQ *q)
+{
+	unsigned t = q->tail;
+
+	if(__atomic_load_n(&q->head, __ATOMIC_ACQUIRE) == t)
+		return NULL;
+	return q->slot[t & (SPSCQ_SIZE - 1)];
+}
+
+/* consumer: remove the oldest item, NULL if empty */
+static inline void *spscq_pop(SpscQ *q)
+{
+	void *p = spscq_peek(q);
+
+	if(p)
+		__atomic_store_n(&q->tail, q->tail + 1, __ATOMIC_RELEASE);
+	return p;
+}
+
+#endif
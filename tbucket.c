@@ -0,0 +1,46 @@
+#include <time.h>
+
+#include "tbucket.h"
+
+#define NSEC_PER_SEC 1000000000LL
+
+static long long now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static void refill(TokenBucket *tb, long long now)
+{
+	tb->tokens += tb->rate * (now - tb->last_ns) / NSEC_PER_SEC;
+	if(tb->tokens > tb->depth)
+		tb->tokens = tb->depth;
+	tb->last_ns = now;
+}
+
+void tb_init(TokenBucket *tb, double rate_bps, int depth)
+{
+	tb->rate = rate_bps / 8;
+	tb->depth = depth;
+	tb->tokens = depth;
+	tb->last_ns = now_ns();
+}
+
+void tb_set_rate(TokenBucket *tb, double rate_bps)
+{
+	refill(tb, now_ns());        // tokens so far at the old rate
+	tb->rate = rate_bps / 8;
+}
+
+long long tb_try_take(TokenBucket *tb, int bytes)
+{
+	refill(tb, now_ns());
+	if(tb->tokens >= bytes || tb->tokens >= tb->depth || tb->rate <= 0){
+		tb->tokens -= bytes;
+		return 0;
+	}
+	/* a full bucket is enough for a burst larger than depth */
+	bytes = bytes < tb->depth ? bytes : tb->depth;
+	return (long long)((bytes - tb->tokens) * NSEC_PER_SEC / tb->rate) + 1;
+}
@@ -0,0 +1,31 @@
+#ifndef TBUCKET_H
+#define TBUCKET_H
+
+#include <time.h>
+
+/*--------------------------------------------------------------------------
+   token bucket
+
+   tokens (bytes) flow in at rate and are capped at depth, the largest
+   burst that may leave back to back. a sender takes tokens before each
+   burst; when short it is told how long until there are enough and
+   arms its own timer (the event loop's timerfd), it never sleeps.
+---------------------------------------------------------------------------*/
+
+typedef struct {
+	double rate;                 // bytes per second
+	double depth;                // bucket size (bytes)
+	double tokens;
+	long long last_ns;           // last refill
+} TokenBucket;
+
+/* rate in bit/s, depth in bytes, the bucket starts full */
+void tb_init(TokenBucket *tb, double rate_bps, int depth);
+void tb_set_rate(TokenBucket *tb, double rate_bps);
+
+/* take bytes if there are tokens and return 0, else return the ns
+   until there will be (nothing taken); tokens may go negative when
+   bytes > depth */
+long long tb_try_take(TokenBucket *tb, int bytes);
+
+#endif
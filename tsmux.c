@@ -0,0 +1,199 @@
+#include <string.h>
+
+#include "tsmux.h"
+
+/*--------------------------------------------------------------------------
+   TS packet (188 bytes)
+    0x47 | TEI PUSI PRIO PID(13) | SC(2) AFC(2) CC(4) | [adaptation] payload
+
+   adaptation field : length | flags (RAI 0x40, PCR 0x10) | PCR(6) | 0xFF..
+   PES header       : 00 00 01 E0 | length 0 (video) | 0x84 | 0x80 (PTS)
+                      | 5 | PTS(5)
+---------------------------------------------------------------------------*/
+
+#define PES_HDR_SIZE   14
+#define TS_PAYLOAD     (TS_PKT_SIZE - 4)
+#define PCR_AF_SIZE    8          // length, flags, PCR
+
+static const unsigned char aud[] = { 0, 0, 0, 1, H264_NAL_AUD, 0xF0 };
+
+/* MPEG-2 CRC32 (poly 0x04C11DB7, msb first), twice per stream: no table */
+static uint32_t crc32_mpeg(const unsigned char *p, int len)
+{
+	uint32_t crc = 0xFFFFFFFF;
+	int i;
+
+	while(len-- > 0){
+		crc ^= (uint32_t)*p++ << 24;
+		for(i = 0; i < 8; i++)
+			crc = (crc & 0x80000000) ? (crc << 1) ^ 0x04C11DB7 : crc << 1;
+	}
+	return crc;
+}
+
+/* a PSI packet: section of len bytes (CRC not included) after pointer 0 */
+static void psi_packet(unsigned char *p, int pid, const unsigned char *sec, int len)
+{
+	uint32_t crc;
+
+	memset(p, 0xFF, TS_PKT_SIZE);
+	p[0] = 0x47;
+	p[1] = 0x40 | pid >> 8;                        // PUSI
+	p[2] = pid & 0xFF;
+	p[3] = 0x10;                                   // payload only, CC set when sent
+	p[4] = 0;                                      // pointer field
+	memcpy(p + 5, sec, len);
+	crc = crc32_mpeg(sec, len);
+	p[5 + len]     = crc >> 24;
+	p[5 + len + 1] = crc >> 16;
+	p[5 + len + 2] = crc >> 8;
+	p[5 + len + 3] = crc;
+}
+
+void ts_muxer_init(TsMuxer *m)
+{
+	/* section length counts from after it, CRC included */
+	static const unsigned char pat[] = {
+		0x00, 0xB0, 13,                            // table 0, length
+		0x00, 0x01, 0xC1, 0x00, 0x00,              // TS id 1, version 0, current
+		0x00, 0x01, 0xE0 | TS_PID_PMT >> 8, TS_PID_PMT & 0xFF,   // program 1
+	};
+	static const unsigned char pmt[] = {
+		0x02, 0xB0, 18,                            // table 2, length
+		0x00, 0x01, 0xC1, 0x00, 0x00,              // program 1, version 0, current
+		0xE0 | TS_PID_VIDEO >> 8, TS_PID_VIDEO & 0xFF,   // PCR PID
+		0xF0, 0x00,                                // no program info
+		0x1B, 0xE0 | TS_PID_VIDEO >> 8, TS_PID_VIDEO & 0xFF, 0xF0, 0x00,   // H.264
+	};
+
+	memset(m, 0, sizeof(*m));
+	psi_packet(m->pat, 0, pat, sizeof(pat));
+	psi_packet(m->pmt, TS_PID_PMT, pmt, sizeof(pmt));
+	m->since_psi = -1;
+}
+
+int ts_max_dgrams(int len)
+{
+	int npkts = (PES_HDR_SIZE + sizeof(aud) + len + PCR_AF_SIZE) / TS_PAYLOAD + 1 + 2;
+	return (npkts + TS_PER_DGRAM - 1) / TS_PER_DGRAM;
+}
+
+/* the PES (header, delimiter, access unit) as three pieces */
+typedef struct {
+	const unsigned char *p[3];
+	int len[3];
+	int i;
+} Pieces;
+
+static void copy_out(Pieces *ps, unsigned char *dst, int n)
+{
+	int k;
+
+	while(n > 0){
+		k = ps->len[ps->i] < n ? ps->len[ps->i] : n;
+		memcpy(dst, ps->p[ps->i], k);
+		dst += k;
+		n -= k;
+		ps->p[ps->i] += k;
+		if((ps->len[ps->i] -= k) == 0)
+			ps->i++;
+	}
+}
+
+int ts_mux(TsMuxer *m, const H264AU *au, uint64_t pts,
+	   unsigned char *out, int stride, RtpPkt *pkts, int maxpkts)
+{
+	unsigned char pes[PES_HDR_SIZE], *p;
+	uint64_t pcr = pts & 0x1FFFFFFFFULL;
+	Pieces ps;
+	int n = 0, left, af, pay, first = 1, i;
+
+	pts = (pts + TS_PTS_DELAY) & 0x1FFFFFFFFULL;
+	pes[0] = 0; pes[1] = 0; pes[2] = 1; pes[3] = 0xE0;
+	pes[4] = 0; pes[5] = 0;                        // unbounded (video)
+	pes[6] = 0x84;                                 // data aligned: an access unit
+	pes[7] = 0x80;                                 // PTS only
+	pes[8] = 5;
+	pes[9]  = 0x21 | ((pts >> 29) & 0x0E);
+	pes[10] = pts >> 22;
+	pes[11] = 0x01 | ((pts >> 14) & 0xFE);
+	pes[12] = pts >> 7;
+	pes[13] = 0x01 | ((pts << 1) & 0xFE);
+
+	i = 0;
+	ps.p[i] = pes;
+	ps.len[i++] = PES_HDR_SIZE;
+	if(au->nnal == 0 || au->nal[0].len == 0 || (au->nal[0].data[0] & 0x1F) != H264_NAL_AUD){
+		ps.p[i] = aud;
+		ps.len[i++] = sizeof(aud);
+	}
+	ps.p[i] = au->data;
+	ps.len[i++] = au->len;
+	ps.i = 0;
+	for(left = 0; i > 0; )
+		left += ps.len[--i];
+
+	if(ts_max_dgrams(au->len) > maxpkts)
+		return -1;
+
+#define NEXT_PKT() (out + (n / TS_PER_DGRAM) * stride + (n % TS_PER_DGRAM) * TS_PKT_SIZE)
+
+	/* 1. PAT and PMT */
+	if(au->idr || m->since_psi < 0 || m->since_psi >= TS_PSI_FRAMES){
+		p = NEXT_PKT();
+		memcpy(p, m->pat, TS_PKT_SIZE);
+		p[3] = 0x10 | (m->cc_pat++ & 0x0F);
+		n++;
+		p = NEXT_PKT();
+		memcpy(p, m->pmt, TS_PKT_SIZE);
+		p[3] = 0x10 | (m->cc_pmt++ & 0x0F);
+		n++;
+		m->since_psi = 0;
+	}
+	m->since_psi++;
+
+	/* 2. the PES, PCR on its first packet, stuffing in its last */
+	while(left > 0){
+		p = NEXT_PKT();
+		af = first ? PCR_AF_SIZE : 0;
+		pay = TS_PAYLOAD - af;
+		if(left < pay){
+			af += pay - left;
+			pay = left;
+		}
+		p[0] = 0x47;
+		p[1] = (first ? 0x40 : 0) | TS_PID_VIDEO >> 8;
+		p[2] = TS_PID_VIDEO & 0xFF;
+		p[3] = (af ? 0x30 : 0x10) | (m->cc_video++ & 0x0F);
+		if(af > 0){
+			p[4] = af - 1;
+			if(af > 1){
+				p[5] = 0;
+				i = 6;
+				if(first){
+					p[5] = 0x10 | (au->idr ? 0x40 : 0);
+					p[6]  = pcr >> 25;
+					p[7]  = pcr >> 17;
+					p[8]  = pcr >> 9;
+					p[9]  = pcr >> 1;
+					p[10] = ((pcr & 1) << 7) | 0x7E;
+					p[11] = 0;
+					i = 12;
+				}
+				memset(p + i, 0xFF, 4 + af - i);
+			}
+		}
+		copy_out(&ps, p + 4 + af, pay);
+		left -= pay;
+		first = 0;
+		n++;
+	}
+#undef NEXT_PKT
+
+	/* 3. TS_PER_DGRAM to a datagram */
+	for(i = 0; i * TS_PER_DGRAM < n; i++){
+		pkts[i].data = out + i * stride;
+		pkts[i].len  = (n - i * TS_PER_DGRAM < TS_PER_DGRAM ? n - i * TS_PER_DGRAM : TS_PER_DGRAM) * TS_PKT_SIZE;
+	}
+	return i;
+}
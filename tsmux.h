@@ -0,0 +1,53 @@
+#ifndef TSMUX_H
+#define TSMUX_H
+
+#include <stdint.h>
+#include "h264au.h"
+#include "rtp264.h"
+
+/*--------------------------------------------------------------------------
+   MPEG-2 transport stream (ISO 13818-1) for H.264 over UDP
+
+   muxer : access unit -> 188 byte TS packets, TS_PER_DGRAM to a datagram
+           (1316 bytes, what VLC, ffmpeg and most ground tools expect)
+
+           PAT and PMT (one program, one H.264 stream) before every IDR
+           and every TS_PSI_FRAMES frames, so a receiver can start soon
+           one PES per access unit, with an access unit delimiter in
+           front if it has none (required in a TS), PTS only (the
+           encoder sends no B frames), PCR on its first packet
+
+   the PAT and PMT are put together once, a frame is written straight
+   into the caller's buffers: nothing is allocated per packet.
+   the datagrams go out as RtpPkt, like those of the RTP packetizer.
+---------------------------------------------------------------------------*/
+
+#define TS_PKT_SIZE     188
+#define TS_PER_DGRAM    7
+#define TS_DGRAM_SIZE   (TS_PKT_SIZE * TS_PER_DGRAM)
+#define TS_PID_PMT      0x1000
+#define TS_PID_VIDEO    0x0100
+#define TS_PSI_FRAMES   5          // PAT/PMT at least every 200 ms at 25 fps
+#define TS_PTS_DELAY    3600       // PTS after PCR (90 kHz): one frame of decoder buffer
+
+typedef struct {
+	unsigned char pat[TS_PKT_SIZE];
+	unsigned char pmt[TS_PKT_SIZE];
+	uint8_t cc_pat, cc_pmt, cc_video;   // continuity counters
+	int     since_psi;                  // frames since the last PAT/PMT, -1: none yet
+} TsMuxer;
+
+void ts_muxer_init(TsMuxer *m);
+
+/* datagrams of an access unit of len bytes, at most */
+int  ts_max_dgrams(int len);
+
+/*
+ * mux one access unit, pts 90 kHz (33 bits used), into datagrams of
+ * TS_DGRAM_SIZE at most; pkts[i].data is out + i*stride, returns the
+ * number of datagrams or -1 if maxpkts is too small
+ */
+int  ts_mux(TsMuxer *m, const H264AU *au, uint64_t pts,
+	    unsigned char *out, int stride, RtpPkt *pkts, int maxpkts);
+
+#endif
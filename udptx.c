@@ -0,0 +1,145 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <netinet/udp.h>
+
+#include "udptx.h"
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+
+void udptx_init(UdpTx *tx, int sock, int use_gso)
+{
+	int val;
+	socklen_t len = sizeof(val);
+
+	memset(tx, 0, sizeof(*tx));
+	tx->sock = sock;
+	tx->mmsg = 1;
+	/* kernels without GSO do not know the option */
+	tx->gso = use_gso && getsockopt(sock, SOL_UDP, UDP_SEGMENT, &val, &len) == 0;
+}
+
+/* one message: a run of packets of the same size (the last may be shorter) */
+static void add_msg(UdpTx *tx, const struct sockaddr_in *dst, int first, int n, int segsize)
+{
+	struct msghdr *mh = &tx->msg[tx->nmsg].msg_hdr;
+
+	memset(mh, 0, sizeof(*mh));
+	mh->msg_name    = (void *)dst;
+	mh->msg_namelen = sizeof(*dst);
+	mh->msg_iov     = &tx->iov[first];
+	mh->msg_iovlen  = n;
+	if(n > 1){
+		struct cmsghdr *cm;
+
+		mh->msg_control    = tx->ctrl[tx->nmsg].buf;
+		mh->msg_controllen = sizeof(tx->ctrl[tx->nmsg].buf);
+		cm = CMSG_FIRSTHDR(mh);
+		cm->cmsg_level = SOL_UDP;
+		cm->cmsg_type  = UDP_SEGMENT;
+		cm->cmsg_len   = CMSG_LEN(sizeof(uint16_t));
+		*(uint16_t *)CMSG_DATA(cm) = segsize;
+	}
+	tx->nmsg++;
+}
+
+/* send the packets of messages [from, nmsg) one by one */
+static int send_each(UdpTx *tx, int from)
+{
+	int i, k, sent = 0;
+
+	for(i = from; i < tx->nmsg; i++){
+		struct msghdr *mh = &tx->msg[i].msg_hdr;
+		for(k = 0; k < mh->msg_iovlen; k++){
+			tx->syscalls++;
+			if(sendto(tx->sock, mh->msg_iov[k].iov_base, mh->msg_iov[k].iov_len, 0,
+				  mh->msg_name, mh->msg_namelen) < 0)
+				tx->errors++;
+			else
+				sent++;
+		}
+	}
+	return sent;
+}
+
+/* send the queued messages, returns the number of packets sent */
+static int flush(UdpTx *tx)
+{
+	int i, sent = 0, done = 0, r;
+
+	while(done < tx->nmsg){
+		if(!tx->mmsg){
+			sent += send_each(tx, done);
+			break;
+		}
+
+		r = sendmmsg(tx->sock, &tx->msg[done], tx->nmsg - done, 0);
+		tx->syscalls++;
+		if(r < 0){
+			if(errno == EINTR)
+				continue;
+			if(errno == ENOSYS){            // very old kernel
+				tx->mmsg = 0;
+				continue;
+			}
+			/* GSO refused (no checksum offload, old kernel): go without it */
+			if(tx->gso && tx->msg[done].msg_hdr.msg_iovlen > 1 &&
+			   (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT)){
+				fprintf(stderr, "UDPTX> GSO not supported (%s), disabled\n", strerror(errno));
+				tx->gso = 0;
+				sent += send_each(tx, done);
+				break;
+			}
+			tx->errors++;
+			r = 1;                          // skip the message
+		}else{
+			for(i = done; i < done + r; i++)
+				sent += tx->msg[i].msg_hdr.msg_iovlen;
+		}
+		done += r;
+	}
+	tx->nmsg = tx->niov = 0;
+	return sent;
+}
+
+int udptx_send(UdpTx *tx, const struct sockaddr_in *dst, const RtpPkt *pkts, int n)
+{
+	int i = 0, j, sent = 0;
+
+	while(i < n){
+		int segsize = pkts[i].len;
+		int bytes = segsize;
+		int first = tx->niov;
+
+		/* 1. collect a run for one message */
+		tx->iov[tx->niov].iov_base = pkts[i].data;
+		tx->iov[tx->niov].iov_len  = pkts[i].len;
+		tx->niov++;
+		for(j = i + 1; tx->gso && j < n && tx->niov < UDPTX_MAX_IOV; j++){
+			if(pkts[j].len > segsize || pkts[j-1].len != segsize)
+				break;
+			if(j - i == UDPTX_GSO_MAX_SEGS || bytes + pkts[j].len > UDPTX_GSO_MAX_BYTES)
+				break;
+			tx->iov[tx->niov].iov_base = pkts[j].data;
+			tx->iov[tx->niov].iov_len  = pkts[j].len;
+			tx->niov++;
+			bytes += pkts[j].len;
+		}
+		add_msg(tx, dst, first, j - i, segsize);
+		i = j;
+
+		/* 2. send when full or done */
+		if(tx->nmsg == UDPTX_MAX_MSGS || tx->niov == UDPTX_MAX_IOV || i == n)
+			sent += flush(tx);
+	}
+	tx->packets += sent;
+	return sent;
+}
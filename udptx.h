@@ -0,0 +1,55 @@
+#ifndef UDPTX_H
+#define UDPTX_H
+
+/* struct mmsghdr: _GNU_SOURCE before the first system header */
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <sys/uio.h>
+#include <stdint.h>
+
+#include "rtp264.h"
+
+/*--------------------------------------------------------------------------
+   batched UDP sender
+
+   the packets of a frame are queued and sent with few syscalls:
+     sendmmsg()      many datagrams per call
+     UDP_SEGMENT     (GSO, Linux 4.18+) packets of the same size go in one
+                     message and the kernel splits them into datagrams
+   without GSO each packet is one message, without sendmmsg() one sendto().
+
+   packets are not copied: the iovecs point into the caller's arena, which
+   has to stay untouched until udptx_send() returns.
+---------------------------------------------------------------------------*/
+
+#define UDPTX_MAX_MSGS      64      // messages per sendmmsg()
+#define UDPTX_MAX_IOV       1024    // packets per sendmmsg()
+#define UDPTX_GSO_MAX_SEGS  64      // UDP_MAX_SEGMENTS in the kernel
+#define UDPTX_GSO_MAX_BYTES 65000   // one GSO message < 64K
+
+typedef struct {
+	int sock;
+	int gso;                             // UDP_SEGMENT in use
+	int mmsg;                            // sendmmsg() in use
+	struct mmsghdr msg[UDPTX_MAX_MSGS];
+	struct iovec   iov[UDPTX_MAX_IOV];
+	union {
+		char buf[CMSG_SPACE(sizeof(uint16_t))];
+		struct cmsghdr align;
+	} ctrl[UDPTX_MAX_MSGS];
+	int nmsg, niov;
+
+	/* totals, for syscalls per frame */
+	unsigned long syscalls;
+	unsigned long packets;
+	unsigned long errors;
+} UdpTx;
+
+/* use_gso 0: never, 1: if the kernel has it */
+void udptx_init(UdpTx *tx, int sock, int use_gso);
+
+/* send n packets to dst, returns the number of packets sent */
+int  udptx_send(UdpTx *tx, const struct sockaddr_in *dst, const RtpPkt *pkts, int n);
+
+#endif